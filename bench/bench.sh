@@ -0,0 +1,83 @@
+#!/bin/sh
+# Host-throughput benchmark: runs each kernel headlessly for a fixed number of
+# simulated cycles, several times, and reports simulated Mcycles and MIPS per
+# host second as mean and standard deviation. Results are written to a file
+# named after the commit so later commits can be compared against them.
+#
+# usage: bench.sh <simulator> <cycles> <runs> <results dir> [baseline] [tolerance %] [simulator flags...]
+#
+# Kernels (hex text, each an endless loop; the cycle budget ends the run):
+#   alu     dependent and independent ALU ops, shifts and compares, one branch per 16
+#   stream  lw/addu/sw over a 64 KiB array in the data segment
+#   pchase  builds a 16 Ki-node linked list with a 487-word stride, then chases it
+#   muldiv  mult/div/multu/divu chains through HI/LO
+#   synthetic  generated by mu-mips-gen (default mix), when present
+#
+# With a baseline results file, a kernel whose mean Mcycles/s falls more than
+# the tolerance below the baseline is reported as slower and the exit status is 1.
+
+sim=$1
+cycles=$2
+runs=$3
+results_dir=$4
+baseline=$5
+tolerance=${6:-5}
+if [ $# -gt 6 ]; then shift 6; else set --; fi
+dir=$(dirname "$0")
+
+rev=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if ! git diff --quiet HEAD -- mu-mips.c mu-mips.h 2>/dev/null; then
+	rev="$rev-dirty"
+fi
+mkdir -p "$results_dir" || exit 1
+out="$results_dir/$rev.txt"
+tmp=${TMPDIR:-/tmp}/mu-mips-bench.$$
+trap 'rm -f "$tmp"' EXIT
+
+{
+	echo "# commit $rev, $(uname -m), $cycles cycles x $runs runs, flags: $*"
+	echo "# kernel	instructions	Mcycles/s	sd	MIPS	sd"
+} > "$out"
+
+printf '%-10s %12s %8s %16s %16s\n' kernel instructions CPI "Mcycles/s" "MIPS"
+for kernel in alu stream pchase muldiv synthetic; do
+	[ -f "$dir/$kernel.in" ] || continue
+	: > "$tmp"
+	i=0
+	while [ $i -lt "$runs" ]; do
+		if ! "$sim" "$@" --run --max-cycles "$cycles" --stats-json - "$dir/$kernel.in" 2>/dev/null |
+			awk -F'[:,]' '/"host_seconds"/ { s = $2 } /"cycles"/ { c = $2 } /"instructions"/ { n = $2 }
+				END { if (s == "" || c == "") exit 1; print c, n, s }' >> "$tmp"; then
+			echo "Error: $sim failed on $kernel" >&2
+			exit 1
+		fi
+		i=$((i + 1))
+	done
+	awk -v kernel="$kernel" -v out="$out" '
+		{ c = $1; n = $2; s = ($3 > 0) ? $3 : 1e-9; r[NR] = c / s / 1e6; m[NR] = n / s / 1e6; rs += r[NR]; ms += m[NR] }
+		END {
+			rs /= NR; ms /= NR
+			for (i = 1; i <= NR; i++) { rv += (r[i] - rs) ^ 2; mv += (m[i] - ms) ^ 2 }
+			rd = (NR > 1) ? sqrt(rv / (NR - 1)) : 0; md = (NR > 1) ? sqrt(mv / (NR - 1)) : 0
+			printf "%-10s %12d %8.3f %9.2f +-%5.2f %9.2f +-%5.2f\n", kernel, n, n ? c / n : 0, rs, rd, ms, md
+			printf "%s\t%d\t%.3f\t%.3f\t%.3f\t%.3f\n", kernel, n, rs, rd, ms, md >> out
+		}' "$tmp"
+done
+echo "Results written to $out"
+
+[ -n "$baseline" ] || exit 0
+if [ ! -f "$baseline" ]; then
+	echo "Error: No baseline $baseline" >&2
+	exit 1
+fi
+echo "Compared with $baseline (Mcycles/s, tolerance $tolerance%):"
+awk -v tol="$tolerance" '
+	/^#/ { next }
+	FNR == NR { base[$1] = $3; next }
+	($1 in base) && base[$1] > 0 {
+		change = 100 * ($3 - base[$1]) / base[$1]
+		slower = change < -tol
+		bad += slower
+		printf "%-10s %9.2f -> %9.2f  %+6.1f%%%s\n", $1, base[$1], $3, change, slower ? "  SLOWER" : ""
+	}
+	END { exit bad > 0 }' "$baseline" "$out"
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+/***************************************************************/
+/* Synthetic workload generator: writes a program in the simulator's hex   */
+/* text format (one word per line, placed from MEM_TEXT_BEGIN) with a      */
+/* given instruction mix, dependency distance, data footprint and stride.   */
+/***************************************************************/
+
+#define TRUE  1
+#define FALSE 0
+
+#define TEXT_BEGIN	0x00400000
+#define DATA_BEGIN	0x10010000	/* MEM_DATA_BEGIN */
+
+#define REG_ZERO	0
+#define REG_V0		2
+#define REG_BASE	23			/* $s7: base of the current 32 KiB data window */
+#define HISTORY		64			/* dependency distances reach this far back */
+
+#define DEFAULT_MIX "alu=50,load=20,store=15,muldiv=5,branch=10"
+
+enum { MIX_ALU = 0, MIX_LOAD, MIX_STORE, MIX_MULDIV, MIX_BRANCH, NUM_MIX };
+
+static const char* const MIX_NAMES[NUM_MIX] = { "alu", "load", "store", "muldiv", "branch" };
+
+/* $v1, $a0-$a3, $t0-$t9, $s0-$s6: never $zero, $at, $v0 (syscall), $s7 (data base), $k0/$k1, $gp, $sp, $fp, $ra */
+static const uint8_t POOL[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 24, 25 };
+#define POOL_SIZE (sizeof(POOL) / sizeof(POOL[0]))
+
+typedef struct {
+	FILE* out;
+	uint64_t emitted;
+	uint64_t rng;
+
+	unsigned mix[NUM_MIX];		/* weights */
+	unsigned mix_total;
+	double dep;					/* mean dependency distance, 0 = random sources */
+	uint32_t footprint;			/* bytes touched by loads and stores */
+	uint32_t stride;			/* bytes between consecutive accesses */
+
+	uint8_t history[HISTORY];	/* dests of the last instructions, newest at [count % HISTORY] */
+	uint64_t count;
+	uint32_t offset;			/* next access, from DATA_BEGIN */
+	uint32_t window;			/* what $s7 holds now, from DATA_BEGIN */
+	uint64_t shadow_end;		/* words before this may be skipped by a branch */
+	int stale;					/* the last $s7 move may have been branched over */
+} gen_t;
+
+/* xorshift64*: the same seed gives the same program on every host */
+static uint32_t gen_random(gen_t* g)
+{
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return (uint32_t)((g->rng * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static uint32_t gen_below(gen_t* g, uint32_t n)
+{
+	return (uint32_t)(((uint64_t)gen_random(g) * n) >> 32);
+}
+
+static void emit(gen_t* g, uint32_t word)
+{
+	fprintf(g->out, "%08X\n", word);
+	g->emitted++;
+}
+
+static uint32_t r_type(uint8_t rs, uint8_t rt, uint8_t rd, uint8_t shamt, uint8_t funct)
+{
+	return ((uint32_t)rs << 21) | ((uint32_t)rt << 16) | ((uint32_t)rd << 11) | ((uint32_t)shamt << 6) | funct;
+}
+
+static uint32_t i_type(uint8_t opcode, uint8_t rs, uint8_t rt, uint16_t imm)
+{
+	return ((uint32_t)opcode << 26) | ((uint32_t)rs << 21) | ((uint32_t)rt << 16) | imm;
+}
+
+/* record an instruction's dest so later sources can depend on it */
+static void retire(gen_t* g, uint8_t dest)
+{
+	g->history[++g->count % HISTORY] = dest;
+}
+
+/***************************************************************/
+/* A source register: the dest of the instruction a geometrically            */
+/* distributed distance back (mean dep), or any register in the pool       */
+/***************************************************************/
+static uint8_t pick_source(gen_t* g)
+{
+	uint32_t distance = 1;
+
+	if (g->dep <= 0 || g->count == 0) {
+		return POOL[gen_below(g, POOL_SIZE)];
+	}
+	while (distance < HISTORY && distance < g->count && gen_below(g, 1u << 16) >= (uint32_t)(65536.0 / g->dep)) {
+		distance++;
+	}
+	return g->history[(g->count - distance + 1) % HISTORY];
+}
+
+static uint8_t pick_dest(gen_t* g)
+{
+	return POOL[gen_below(g, POOL_SIZE)];
+}
+
+static void gen_alu(gen_t* g)
+{
+	static const uint8_t r_funct[] = { 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x2A };	// add .. slt
+	static const uint8_t i_opcode[] = { 0x8, 0x9, 0xA, 0xC, 0xD, 0xE };							// addi .. xori
+	uint8_t rd = pick_dest(g), rs = pick_source(g), rt = pick_source(g);
+
+	switch (gen_below(g, 4)) {
+		case (0):
+		case (1):
+			emit(g, r_type(rs, rt, rd, 0, r_funct[gen_below(g, sizeof(r_funct))]));
+		break;
+
+		case (2):
+			emit(g, i_type(i_opcode[gen_below(g, sizeof(i_opcode))], rs, rd, gen_random(g) & 0xFFFF));
+		break;
+
+		default:
+			emit(g, r_type(0, rt, rd, gen_below(g, 32), (uint8_t[]){ 0x00, 0x02, 0x03 }[gen_below(g, 3)]));	// sll/srl/sra
+		break;
+	}
+	retire(g, rd);
+}
+
+static void gen_muldiv(gen_t* g)
+{
+	uint8_t rd = pick_dest(g), rs = pick_source(g), rt = pick_source(g);
+
+	emit(g, r_type(rs, rt, 0, 0, 0x18 + gen_below(g, 4)));				// mult/multu/div/divu
+	retire(g, REG_ZERO);
+	emit(g, r_type(0, 0, rd, 0, gen_below(g, 2) ? 0x10 : 0x12));		// mfhi/mflo
+	retire(g, rd);
+}
+
+/***************************************************************/
+/* Loads and stores walk the footprint at the stride. $s7 points at a       */
+/* 32 KiB window and is moved (lui/ori) when an access falls outside it,  */
+/* or when a branch may have skipped the last move.                                 */
+/***************************************************************/
+static uint16_t gen_address(gen_t* g)
+{
+	uint32_t offset = g->offset;
+	uint32_t window = offset & ~0x7FFFu;
+
+	g->offset = (uint32_t)(((uint64_t)g->offset + g->stride) % g->footprint);
+	if (window != g->window || g->stale) {
+		while (g->emitted < g->shadow_end && g->emitted + 2 >= g->shadow_end) {
+			emit(g, 0);	// nop: a branch target must not split the move from the access
+			retire(g, REG_ZERO);
+		}
+		g->stale = (g->emitted < g->shadow_end);
+		emit(g, i_type(0xF, 0, REG_BASE, (uint16_t)((DATA_BEGIN + window) >> 16)));				// lui
+		emit(g, i_type(0xD, REG_BASE, REG_BASE, (uint16_t)((DATA_BEGIN + window) & 0xFFFF)));	// ori
+		retire(g, REG_ZERO);
+		retire(g, REG_ZERO);
+		g->window = window;
+	}
+	return (uint16_t)(offset - window);
+}
+
+static void gen_load(gen_t* g)
+{
+	uint16_t imm = gen_address(g);
+	uint8_t rt = pick_dest(g);
+
+	// lw, lh or lb; the stride keeps every access word aligned
+	emit(g, i_type((uint8_t[]){ 0x23, 0x23, 0x21, 0x20 }[gen_below(g, 4)], REG_BASE, rt, imm));
+	retire(g, rt);
+}
+
+static void gen_store(gen_t* g)
+{
+	uint16_t imm = gen_address(g);
+	uint8_t rt = pick_source(g);
+
+	emit(g, i_type((uint8_t[]){ 0x2B, 0x2B, 0x29, 0x28 }[gen_below(g, 4)], REG_BASE, rt, imm));	// sw, sh or sb
+	retire(g, REG_ZERO);
+}
+
+/* forward beq/bne over up to 3 words, never past the end of the body */
+static void gen_branch(gen_t* g, uint64_t remaining)
+{
+	uint16_t skip = 1 + gen_below(g, 3);
+	uint8_t rs = pick_source(g), rt = pick_source(g);
+
+	if (skip > remaining - 1) {
+		skip = (uint16_t)(remaining - 1);
+	}
+	emit(g, i_type(gen_below(g, 2) ? 0x4 : 0x5, rs, rt, skip));
+	retire(g, REG_ZERO);
+	if (g->emitted + skip > g->shadow_end) {
+		g->shadow_end = g->emitted + skip;
+	}
+}
+
+static int parse_mix(gen_t* g, const char* spec)
+{
+	char buffer[256], *key, *value, *end, *save = NULL;
+	int i;
+
+	snprintf(buffer, sizeof(buffer), "%s", spec);
+	for (key = strtok_r(buffer, ",", &save); key != NULL; key = strtok_r(NULL, ",", &save)) {
+		value = strchr(key, '=');
+		if (value == NULL) {
+			printf("Error: Mix entry '%s' needs a weight\n", key);
+			return FALSE;
+		}
+		*value++ = '\0';
+		for (i = 0; i < NUM_MIX && strcmp(key, MIX_NAMES[i]) != 0; i++);
+		if (i == NUM_MIX) {
+			printf("Error: Unknown mix entry '%s' (alu, load, store, muldiv or branch)\n", key);
+			return FALSE;
+		}
+		g->mix[i] = strtoul(value, &end, 0);
+		if (*end != '\0' || end == value) {
+			printf("Error: Bad weight '%s' for %s\n", value, key);
+			return FALSE;
+		}
+	}
+	for (g->mix_total = 0, i = 0; i < NUM_MIX; i++) {
+		g->mix_total += g->mix[i];
+	}
+	if (g->mix_total == 0) {
+		printf("Error: The mix needs at least one nonzero weight\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void usage(const char* name)
+{
+	printf("Usage: %s [-n <instructions>] [-s <seed>] [--mix alu=N,load=N,store=N,muldiv=N,branch=N]\n"
+		"\t[--dep <mean distance>] [--footprint <bytes>] [--stride <bytes>] [--loop] [-o <file>]\n\n", name);
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[]) {
+	static const struct option long_options[] = {
+		{ "mix", required_argument, NULL, 'm' },
+		{ "dep", required_argument, NULL, 'd' },
+		{ "footprint", required_argument, NULL, 'F' },
+		{ "stride", required_argument, NULL, 'S' },
+		{ "loop", no_argument, NULL, 'l' },
+		{ NULL, 0, NULL, 0 }
+	};
+	gen_t g;
+	uint64_t length = 100000, seed = 1, body, i;
+	const char* output = NULL;
+	int loop = FALSE;
+	int opt;
+	uint32_t pick;
+
+	memset(&g, 0, sizeof(g));
+	g.dep = 4;
+	g.footprint = 64 * 1024;
+	g.stride = 4;
+	if (!parse_mix(&g, DEFAULT_MIX)) {
+		return 1;
+	}
+
+	while ((opt = getopt_long(argc, argv, "n:s:o:", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'n':
+				length = strtoull(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'm':
+				memset(g.mix, 0, sizeof(g.mix));
+				if (!parse_mix(&g, optarg)) {
+					return 1;
+				}
+				break;
+			case 'd':
+				g.dep = strtod(optarg, NULL);
+				break;
+			case 'F':
+				g.footprint = strtoul(optarg, NULL, 0);
+				break;
+			case 'S':
+				g.stride = strtoul(optarg, NULL, 0);
+				break;
+			case 'l':
+				loop = TRUE;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind < argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (g.footprint < 4 || (g.footprint & 3) || (g.stride & 3) || g.footprint > 0x10000000) {
+		printf("Error: Footprint (4 bytes .. 256 MiB) and stride must be multiples of 4\n");
+		return 1;
+	}
+	if (g.dep < 0) {
+		printf("Error: The dependency distance can't be negative\n");
+		return 1;
+	}
+
+	g.out = stdout;
+	if (output != NULL && (g.out = fopen(output, "w")) == NULL) {
+		printf("Error: Can't create %s\n", output);
+		return 1;
+	}
+	g.rng = seed * 0x9E3779B97F4A7C15ull + 1;
+
+	/* prologue: data base and a random value in every pool register */
+	emit(&g, i_type(0xF, 0, REG_BASE, DATA_BEGIN >> 16));
+	for (i = 0; i < POOL_SIZE; i++) {
+		emit(&g, i_type(0xF, 0, POOL[i], gen_random(&g) & 0xFFFF));					// lui
+		emit(&g, i_type(0xD, POOL[i], POOL[i], gen_random(&g) & 0xFFFF));			// ori
+		retire(&g, POOL[i]);
+	}
+
+	/* body: length words, leaving room for the epilogue */
+	body = g.emitted;
+	while (g.emitted - body < length) {
+		pick = gen_below(&g, g.mix_total);
+		for (i = 0; pick >= g.mix[i]; pick -= g.mix[i++]);
+		switch (i) {
+			case (MIX_ALU):		gen_alu(&g); break;
+			case (MIX_LOAD):	gen_load(&g); break;
+			case (MIX_STORE):	gen_store(&g); break;
+			case (MIX_MULDIV):	gen_muldiv(&g); break;
+			default:			gen_branch(&g, length - (g.emitted - body)); break;
+		}
+	}
+
+	/* epilogue: back to the top of the body for benchmarks, or exit (syscall 10) */
+	if (loop) {
+		emit(&g, i_type(0xF, 0, REG_BASE, DATA_BEGIN >> 16));	// the body starts in the first window
+		emit(&g, (0x2u << 26) | (((TEXT_BEGIN + 4 * (uint32_t)body) >> 2) & 0x3FFFFFF));	// j
+	} else {
+		emit(&g, i_type(0x9, REG_ZERO, REG_V0, 10));		// addiu $v0, $zero, 10
+		emit(&g, r_type(0, 0, 0, 0, 0x0C));					// syscall
+	}
+
+	if (g.out != stdout) {
+		fclose(g.out);
+	}
+	return 0;
+}
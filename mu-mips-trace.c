@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "mu-mips.h"
+
+/***************************************************************/
+/* Pipeline trace decoder: prints a window of the per-cycle records written */
+/* by the simulator's trace command (or --trace) and sums up its stalls.     */
+/***************************************************************/
+
+#define READ_BATCH 4096		/* records per fread */
+
+static const char* const LATCH_NAMES[NUM_LATCHES] = { "IF/ID", "ID/EX", "EX/MEM", "MEM/WB" };
+
+static const struct {
+	uint8_t flag;
+	char letter;
+	const char* name;
+} FLAGS[] = {
+	{ TRACE_STALL_HAZARD, 'H', "hazard stall" },
+	{ TRACE_STALL_MEM, 'M', "D-cache stall" },
+	{ TRACE_STALL_FETCH, 'I', "I-cache stall" },
+	{ TRACE_FLUSH, 'F', "flush" },
+	{ TRACE_REDIRECT, 'R', "redirect" },
+	{ TRACE_NO_FETCH, 'D', "no fetch" },
+};
+#define NUM_FLAGS (sizeof(FLAGS) / sizeof(FLAGS[0]))
+
+/***************************************************************/
+/* Mnemonic of an instruction word, without operands                                     */
+/***************************************************************/
+static const char* mnemonic(uint32_t word)
+{
+	static const char* const special[64] = {
+		[0x00] = "sll", [0x02] = "srl", [0x03] = "sra", [0x08] = "jr", [0x09] = "jalr", [0x0C] = "syscall",
+		[0x10] = "mfhi", [0x11] = "mthi", [0x12] = "mflo", [0x13] = "mtlo",
+		[0x18] = "mult", [0x19] = "multu", [0x1A] = "div", [0x1B] = "divu",
+		[0x20] = "add", [0x21] = "addu", [0x22] = "sub", [0x23] = "subu",
+		[0x24] = "and", [0x25] = "or", [0x26] = "xor", [0x27] = "nor", [0x2A] = "slt",
+	};
+	static const char* const opcodes[64] = {
+		[0x02] = "j", [0x03] = "jal", [0x04] = "beq", [0x05] = "bne", [0x06] = "blez", [0x07] = "bgtz",
+		[0x08] = "addi", [0x09] = "addiu", [0x0A] = "slti", [0x0C] = "andi", [0x0D] = "ori", [0x0E] = "xori",
+		[0x0F] = "lui", [0x20] = "lb", [0x21] = "lh", [0x23] = "lw", [0x28] = "sb", [0x29] = "sh", [0x2B] = "sw",
+		[0x30] = "ll", [0x38] = "sc",
+	};
+	uint32_t opcode = word >> 26;
+	const char* name;
+
+	if (word == 0) {
+		return "nop";
+	}
+	if (opcode == 0x00) {
+		name = special[word & 0x3F];
+	} else if (opcode == 0x01) {
+		name = ((word >> 16) & 0x1F) == 0 ? "bltz" : ((word >> 16) & 0x1F) == 1 ? "bgez" : NULL;
+	} else {
+		name = opcodes[opcode];
+	}
+	return name != NULL ? name : "?";
+}
+
+/***************************************************************/
+/* One cycle per line: fetch PC, then each latch as address and mnemonic    */
+/***************************************************************/
+static void print_record(const trace_record_t* r)
+{
+	int i;
+	unsigned j;
+
+	printf("%10llu %10llu  %08x", (unsigned long long)r->cycle, (unsigned long long)r->retired, r->fetch_pc);
+	for (i = 0; i < NUM_LATCHES; i++) {
+		if (r->valid & (1 << i)) {
+			printf("  %08x %-7s%c", r->pc[i], mnemonic(r->ir[i]), (r->pred_taken & (1 << i)) ? '*' : ' ');
+		} else {
+			printf("  %-17s", "-");
+		}
+	}
+	printf("  ");
+	for (j = 0; j < NUM_FLAGS; j++) {
+		putchar((r->flags & FLAGS[j].flag) ? FLAGS[j].letter : '.');
+	}
+	putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ "summary", no_argument, NULL, 'S' },
+		{ NULL, 0, NULL, 0 }
+	};
+	trace_header_t header;
+	trace_record_t *records;
+	trace_record_t first;
+	uint64_t flag_counts[NUM_FLAGS] = { 0 };
+	uint64_t shown = 0, bubbles[NUM_LATCHES] = { 0 };
+	uint64_t start = 0, end = UINT64_MAX, retired_start = 0, retired_end = 0;
+	unsigned long long count = 0;
+	int summary_only = FALSE;
+	int have_prev = FALSE;
+	size_t n, i;
+	unsigned j;
+	FILE* fp;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:e:n:", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 's':
+				start = strtoull(optarg, NULL, 0);
+				break;
+			case 'e':
+				end = strtoull(optarg, NULL, 0);
+				break;
+			case 'n':
+				count = strtoull(optarg, NULL, 0);
+				break;
+			case 'S':
+				summary_only = TRUE;
+				break;
+			default:
+				printf("Usage: %s [-s <first cycle>] [-e <last cycle>] [-n <cycles>] [--summary] <trace file>\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc) {
+		printf("Error: You should provide a trace file.\n"
+			"Usage: %s [-s <first cycle>] [-e <last cycle>] [-n <cycles>] [--summary] <trace file>\n", argv[0]);
+		return 1;
+	}
+	if (count > 0 && start + count - 1 >= start && start + count - 1 < end) {
+		end = start + count - 1;
+	}
+
+	fp = fopen(argv[optind], "rb");
+	if (fp == NULL) {
+		printf("Error: Can't open trace file %s\n", argv[optind]);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+		printf("Error: %s is not a pipeline trace\n", argv[optind]);
+		return 1;
+	}
+	if (header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)) {
+		printf("Error: %s is trace version %u with %u-byte records, this decoder reads version %u (%u bytes);"
+			" traces are in the byte order of the host that wrote them\n", argv[optind], header.version,
+			header.record_size, TRACE_VERSION, (unsigned)sizeof(trace_record_t));
+		return 1;
+	}
+	records = malloc(READ_BATCH * sizeof(trace_record_t));
+	if (records == NULL) {
+		printf("Error: Out of memory\n");
+		return 1;
+	}
+
+	/* cycles are consecutive unless the run was reset: try to seek straight to the */
+	/* cycle before the window, whose retired count starts the window's */
+	if (start > 0 && fread(&first, sizeof(first), 1, fp) == 1 && start - 1 > first.cycle) {
+		long offset = (long)sizeof(header) + (long)(start - 1 - first.cycle) * (long)sizeof(trace_record_t);
+		trace_record_t probe;
+		if (fseek(fp, offset, SEEK_SET) != 0 || fread(&probe, sizeof(probe), 1, fp) != 1 || probe.cycle != start - 1) {
+			offset = sizeof(header);
+		}
+		fseek(fp, offset, SEEK_SET);
+	} else {
+		fseek(fp, sizeof(header), SEEK_SET);
+	}
+
+	printf("Trace of core %u, %s\n\n", header.core, header.ring ? "last cycles of a ring" : "streamed");
+	if (!summary_only) {
+		printf("%10s %10s  %-8s", "cycle", "retired", "fetch");
+		for (i = 0; i < NUM_LATCHES; i++) {
+			printf("  %-17s", LATCH_NAMES[i]);
+		}
+		printf("  flags\n");
+	}
+	while ((n = fread(records, sizeof(trace_record_t), READ_BATCH, fp)) > 0) {
+		for (i = 0; i < n; i++) {
+			const trace_record_t* r = &records[i];
+			if (r->cycle < start || r->cycle > end) {
+				if (r->cycle < start && shown == 0) {
+					retired_start = r->retired;
+					have_prev = TRUE;
+				}
+				continue;
+			}
+			if (shown == 0 && !have_prev && r->cycle > 1) {
+				retired_start = r->retired; // a ring starts mid-run: the first cycle's retirement is lost
+			}
+			retired_end = r->retired;
+			shown++;
+			for (j = 0; j < NUM_LATCHES; j++) {
+				bubbles[j] += !(r->valid & (1 << j));
+			}
+			for (j = 0; j < NUM_FLAGS; j++) {
+				flag_counts[j] += (r->flags & FLAGS[j].flag) != 0;
+			}
+			if (!summary_only) {
+				print_record(r);
+			}
+		}
+	}
+	fclose(fp);
+	free(records);
+
+	printf("\n%llu cycles", (unsigned long long)shown);
+	if (shown > 0) {
+		printf(", %llu retired, IPC %.3f", (unsigned long long)(retired_end - retired_start),
+			(double)(retired_end - retired_start) / shown);
+	}
+	printf("\n");
+	for (j = 0; shown > 0 && j < NUM_FLAGS; j++) {
+		printf("%c %-16s%10llu  %5.1f%%\n", FLAGS[j].letter, FLAGS[j].name, (unsigned long long)flag_counts[j],
+			100.0 * flag_counts[j] / shown);
+	}
+	for (j = 0; shown > 0 && j < NUM_LATCHES; j++) {
+		printf("  %-6s bubbles  %10llu  %5.1f%%\n", LATCH_NAMES[j], (unsigned long long)bubbles[j],
+			100.0 * bubbles[j] / shown);
+	}
+	return 0;
+}
@@ -3,6 +3,14 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <math.h>
 
 #include "mu-mips.h"
 
@@ -14,8 +22,26 @@ void help() {
 	printf("\t**********MU-MIPS Help MENU**********\n\n");
 	printf("sim\t-- simulate program to completion \n");
 	printf("run <n>\t-- simulate program for <n> instructions\n");
+	printf("ff <n>\t-- fast-forward <n> instructions functionally, then resume the pipeline\n");
+	printf("fu <pc>\t-- fast-forward functionally until the PC reaches <pc>\n");
+	printf("jit\t-- toggle binary translation of hot blocks during fast-forward\n");
+	printf("stats [on|off|clear|<file>]\t-- show the performance counters, turn the detailed ones on/off, or write them to <file>\n");
+	printf("cache\t-- L1 cache configuration, hit/miss and eviction counts\n");
+	printf("bpred\t-- branch predictor configuration, accuracy and misprediction penalty\n");
+	printf("trace [<file> [<n>]|off]\t-- record the pipeline registers every cycle to <file>, or only the last <n> cycles\n");
+	printf("profile [on|off|clear|<n>]\t-- per-PC retirements and stalls, report the <n> hottest basic blocks\n");
+	printf("simpoint [<spec>]\t-- sampled simulation: cluster the program's intervals, simulate one per phase in detail, estimate the CPI\n");
+	printf("pipeview [<file> [konata|chrome]|off]\t-- write each instruction's stages to <file> for Konata, or as Chrome trace events (*.json)\n");
+	printf("check\t-- toggle lockstep checking of every retirement against the functional model\n");
+	printf("watchdog <c> <i>\t-- stop a run after <c> cycles or <i> instructions in total (0 = no limit)\n");
+	printf("width <n>\t-- issue up to <n> instructions per cycle, in order (1, 2 or 4)\n");
+	printf("forward\t-- toggle the forwarding unit (off: stall until results are written back)\n");
+	printf("core <i>\t-- make the other commands act on core <i> (multi-core only)\n");
+	printf("cores\t-- per-core cycle and instruction counters (multi-core only)\n");
 	printf("rdump\t-- dump register values\n");
 	printf("reset\t-- clears all registers/memory and re-loads the program\n");
+	printf("checkpoint <file>\t-- save registers, pipeline, counters and memory to <file>\n");
+	printf("restore <file>\t-- continue from a checkpoint saved with the same number of cores\n");
 	printf("input <reg> <val>\t-- set GPR <reg> to <val>\n");
 	printf("mdump <start> <stop>\t-- dump memory from <start> to <stop> address\n");
 	printf("high <val>\t-- set the HI register to <val>\n");
@@ -28,395 +54,5116 @@ void help() {
 }
 
 /***************************************************************/
-/* Read a 32-bit word from memory                                                                            */
+/* Check that an address falls inside one of the memory regions                                */
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+int mem_region_valid(uint32_t address)
 {
 	int i;
 	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset+3] << 24) |
-					(MEM_REGIONS[i].mem[offset+2] << 16) |
-					(MEM_REGIONS[i].mem[offset+1] <<  8) |
-					(MEM_REGIONS[i].mem[offset+0] <<  0);
+		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
+			return TRUE;
 		}
 	}
-	return 0;
+	return FALSE;
 }
 
 /***************************************************************/
-/* Write a 32-bit word to memory                                                                                */
+/* Return the backing page of an address, NULL if never written                                */
 /***************************************************************/
-void mem_write_32(uint32_t address, uint32_t value)
+uint8_t* mem_page_lookup(MIPS_Sim* sim, uint32_t address)
 {
-	int i;
-	uint32_t offset;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-			offset = address - MEM_REGIONS[i].begin;
-
-			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
-		}
+	/* acquire pairs with the release in mem_page_alloc: other cores may be publishing */
+	uint8_t **table = __atomic_load_n(&sim->MEMORY->PAGE_DIR[address >> MEM_DIR_SHIFT], __ATOMIC_ACQUIRE);
+	if (table == NULL) {
+		return NULL;
 	}
+	return __atomic_load_n(&table[(address >> MEM_PAGE_SHIFT) & (MEM_TABLE_ENTRIES - 1)], __ATOMIC_ACQUIRE);
 }
 
 /***************************************************************/
-/* Execute one cycle                                                                                                              */
+/* Return the backing page of an address, allocating it zeroed on first touch       */
 /***************************************************************/
-void cycle() {                                                
-	handle_pipeline();
-	CURRENT_STATE = NEXT_STATE;
-	CYCLE_COUNT++;
+uint8_t* mem_page_alloc(MIPS_Sim* sim, uint32_t address)
+{
+	MIPS_Memory *mem = sim->MEMORY;
+	uint8_t ***table = &mem->PAGE_DIR[address >> MEM_DIR_SHIFT];
+	uint8_t **page;
+	uint8_t *result = mem_page_lookup(sim, address);
+
+	if (result != NULL) {
+		return result;
+	}
+
+	/* first touch: allocate under the lock, publish with release stores */
+	pthread_mutex_lock(&mem->ALLOC_LOCK);
+	if (*table == NULL) {
+		uint8_t **new_table = calloc(MEM_TABLE_ENTRIES, sizeof(uint8_t *));
+		if (new_table == NULL) {
+			printf("Error: Out of memory allocating page table\n");
+			exit(-1);
+		}
+		__atomic_store_n(table, new_table, __ATOMIC_RELEASE);
+	}
+	page = &(*table)[(address >> MEM_PAGE_SHIFT) & (MEM_TABLE_ENTRIES - 1)];
+	if (*page == NULL) {
+		uint8_t *new_page = calloc(1, MEM_PAGE_SIZE);
+		if (new_page == NULL) {
+			printf("Error: Out of memory allocating page 0x%08x\n", address & ~MEM_PAGE_MASK);
+			exit(-1);
+		}
+		__atomic_store_n(page, new_page, __ATOMIC_RELEASE);
+		mem->PAGES_ALLOCATED++;
+	}
+	result = *page;
+	pthread_mutex_unlock(&mem->ALLOC_LOCK);
+	return result;
 }
 
 /***************************************************************/
-/* Simulate MIPS for n cycles                                                                                       */
+/* Invalidate every software TLB entry                                                                          */
 /***************************************************************/
-void run(int num_cycles) {                                      
-	
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped\n\n");
-		return;
-	}
-
-	printf("Running simulator for %d cycles...\n\n", num_cycles);
+void mem_tlb_flush(MIPS_Sim* sim)
+{
 	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
-			printf("Simulation Stopped.\n\n");
-			break;
-		}
-		cycle();
+	for (i = 0; i < MEM_TLB_ENTRIES; i++) {
+		sim->MEM_TLB[i].tag = MEM_TLB_INVALID;
+		sim->MEM_TLB[i].wtag = MEM_TLB_INVALID;
+		sim->MEM_TLB[i].page = NULL;
+		sim->MEM_TLB[i].code = FALSE;
 	}
 }
 
 /***************************************************************/
-/* simulate to completion                                                                                               */
+/* Record that a page was written since the program was loaded                        */
 /***************************************************************/
-void runAll() {                                                     
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped.\n\n");
+void mem_mark_dirty(MIPS_Sim* sim, uint32_t address)
+{
+	MIPS_Memory *mem = sim->MEMORY;
+	uint8_t **slot = &mem->DIRTY_DIR[address >> MEM_DIR_SHIFT];
+	uint8_t *flags = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	uint32_t index = (address >> MEM_PAGE_SHIFT) & (MEM_TABLE_ENTRIES - 1);
+
+	if (flags != NULL && __atomic_load_n(&flags[index], __ATOMIC_RELAXED)) {
 		return;
 	}
 
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG){
-		cycle();
+	pthread_mutex_lock(&mem->ALLOC_LOCK);
+	if (*slot == NULL) {
+		flags = calloc(MEM_TABLE_ENTRIES, 1);
+		if (flags == NULL) {
+			printf("Error: Out of memory allocating dirty page flags\n");
+			exit(-1);
+		}
+		__atomic_store_n(slot, flags, __ATOMIC_RELEASE);
 	}
-	printf("Simulation Finished.\n\n");
+	flags = *slot;
+	if (!flags[index]) {
+		if (mem->NUM_DIRTY == mem->DIRTY_CAPACITY) {
+			uint32_t capacity = mem->DIRTY_CAPACITY ? 2 * mem->DIRTY_CAPACITY : 64;
+			uint32_t *pages = realloc(mem->DIRTY_PAGES, capacity * sizeof(uint32_t));
+			if (pages == NULL) {
+				printf("Error: Out of memory tracking dirty pages\n");
+				exit(-1);
+			}
+			mem->DIRTY_PAGES = pages;
+			mem->DIRTY_CAPACITY = capacity;
+		}
+		mem->DIRTY_PAGES[mem->NUM_DIRTY++] = address & ~MEM_PAGE_MASK;
+		__atomic_store_n(&flags[index], 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&mem->ALLOC_LOCK);
 }
 
-/***************************************************************/ 
-/* Dump a word-aligned region of memory to the terminal                              */
 /***************************************************************/
-void mdump(uint32_t start, uint32_t stop) {          
-	uint32_t address;
+/* Forget which pages are dirty. TLB write tags must be flushed with it.          */
+/***************************************************************/
+void mem_clear_dirty(MIPS_Sim* sim)
+{
+	MIPS_Memory *mem = sim->MEMORY;
+	uint32_t i, address;
 
-	printf("-------------------------------------------------------------\n");
-	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
-	printf("-------------------------------------------------------------\n");
-	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
-	for (address = start; address <= stop; address += 4){
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+	for (i = 0; i < mem->NUM_DIRTY; i++) {
+		address = mem->DIRTY_PAGES[i];
+		mem->DIRTY_DIR[address >> MEM_DIR_SHIFT][(address >> MEM_PAGE_SHIFT) & (MEM_TABLE_ENTRIES - 1)] = 0;
 	}
-	printf("\n");
+	mem->NUM_DIRTY = 0;
 }
 
 /***************************************************************/
-/* Dump current values of registers to the teminal                                              */   
+/* Keep a copy of every page of the freshly loaded program for fast resets     */
 /***************************************************************/
-void rdump() {                               
-	int i; 
-	printf("-------------------------------------\n");
-	printf("Dumping Register Content\n");
-	printf("-------------------------------------\n");
-	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
-	printf("# Cycles Executed\t: %u\n", CYCLE_COUNT);
-	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
-	printf("-------------------------------------\n");
-	printf("[Register]\t[Value]\n");
-	printf("-------------------------------------\n");
-	for (i = 0; i < MIPS_REGS; i++){
-		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+void mem_snapshot_pristine(MIPS_Sim* sim)
+{
+	MIPS_Memory *mem = sim->MEMORY;
+	uint32_t count = 0;
+	int i, j;
+
+	mem_free_pristine(sim);
+	for (i = 0; i < MEM_DIR_ENTRIES; i++) {
+		if (mem->PAGE_DIR[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+			count += mem->PAGE_DIR[i][j] != NULL;
+		}
 	}
-	printf("-------------------------------------\n");
-	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
-	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
-	printf("-------------------------------------\n");
+	mem->PRISTINE_PAGES = malloc((count ? count : 1) * sizeof(uint32_t));
+	mem->PRISTINE_DATA = malloc((size_t)(count ? count : 1) * MEM_PAGE_SIZE);
+	if (mem->PRISTINE_PAGES == NULL || mem->PRISTINE_DATA == NULL) {
+		printf("Error: Out of memory copying the loaded program\n");
+		exit(-1);
+	}
+	for (i = 0; i < MEM_DIR_ENTRIES; i++) {
+		if (mem->PAGE_DIR[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+			if (mem->PAGE_DIR[i][j] != NULL) {
+				mem->PRISTINE_PAGES[mem->NUM_PRISTINE] = ((uint32_t)i << MEM_DIR_SHIFT) | ((uint32_t)j << MEM_PAGE_SHIFT);
+				memcpy(&mem->PRISTINE_DATA[(size_t)mem->NUM_PRISTINE * MEM_PAGE_SIZE], mem->PAGE_DIR[i][j], MEM_PAGE_SIZE);
+				mem->NUM_PRISTINE++;
+			}
+		}
+	}
+
+	/* loading is not a change to undo */
+	mem_clear_dirty(sim);
+	mem_tlb_flush(sim);
+	mem->CODE_GENERATION++;
 }
 
 /***************************************************************/
-/* Read a command from standard input.                                                               */  
+/* Drop the copy of the loaded program                                                               */
 /***************************************************************/
-void handle_command() {                         
-	char buffer[20];
-	uint32_t start, stop, cycles;
-	uint32_t register_no;
-	int register_value;
-	int hi_reg_value, lo_reg_value;
+void mem_free_pristine(MIPS_Sim* sim)
+{
+	free(sim->MEMORY->PRISTINE_PAGES);
+	free(sim->MEMORY->PRISTINE_DATA);
+	sim->MEMORY->PRISTINE_PAGES = NULL;
+	sim->MEMORY->PRISTINE_DATA = NULL;
+	sim->MEMORY->NUM_PRISTINE = 0;
+}
 
-	printf("MU-MIPS SIM:> ");
+/* index of a page in the pristine copy, -1 if the loaded program left it empty */
+static int mem_pristine_index(MIPS_Memory* mem, uint32_t page)
+{
+	int lo = 0, hi = (int)mem->NUM_PRISTINE - 1, mid;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (mem->PRISTINE_PAGES[mid] == page) {
+			return mid;
+		}
+		if (mem->PRISTINE_PAGES[mid] < page) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return -1;
+}
 
-	if (scanf("%s", buffer) == EOF){
-		exit(0);
+/***************************************************************/
+/* Put memory back to the loaded program by touching only the dirty pages:  */
+/* pages of the image are copied back, everything else is zeroed.               */
+/***************************************************************/
+void mem_reset_dirty(MIPS_Sim* sim)
+{
+	MIPS_Memory *mem = sim->MEMORY;
+	uint32_t i, address, restored = mem->NUM_DIRTY;
+	uint8_t *page;
+	int index;
+
+	for (i = 0; i < mem->NUM_DIRTY; i++) {
+		address = mem->DIRTY_PAGES[i];
+		page = mem_page_lookup(sim, address);
+		index = mem_pristine_index(mem, address);
+		if (index >= 0) {
+			memcpy(page, &mem->PRISTINE_DATA[(size_t)index * MEM_PAGE_SIZE], MEM_PAGE_SIZE);
+		} else {
+			memset(page, 0, MEM_PAGE_SIZE);
+		}
+		if (decoded_page_lookup(sim, address) != NULL) {
+			predecode_page(sim, address);
+		}
 	}
 
-	switch(buffer[0]) {
-		case 'S':
-		case 's':
-			if (buffer[1] == 'h' || buffer[1] == 'H'){
-				show_pipeline();
-			}else {
-				runAll(); 
-			}
-			break;
-		case 'M':
-		case 'm':
-			if (scanf("%x %x", &start, &stop) != 2){
-				break;
-			}
-			mdump(start, stop);
-			break;
-		case '?':
-			help();
-			break;
-		case 'Q':
-		case 'q':
-			printf("**************************\n");
-			printf("Exiting MU-MIPS! Good Bye...\n");
-			printf("**************************\n");
-			exit(0);
-		case 'R':
-		case 'r':
-			if (buffer[1] == 'd' || buffer[1] == 'D'){
-				rdump();
-			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
-				reset();
-			}
-			else {
-				if (scanf("%d", &cycles) != 1) {
-					break;
-				}
-				run(cycles);
-			}
-			break;
-		case 'I':
-		case 'i':
-			if (scanf("%u %i", &register_no, &register_value) != 2){
-				break;
-			}
-			CURRENT_STATE.REGS[register_no] = register_value;
-			NEXT_STATE.REGS[register_no] = register_value;
-			break;
-		case 'H':
-		case 'h':
-			if (scanf("%i", &hi_reg_value) != 1){
-				break;
-			}
-			CURRENT_STATE.HI = hi_reg_value; 
-			NEXT_STATE.HI = hi_reg_value; 
-			break;
-		case 'L':
-		case 'l':
-			if (scanf("%i", &lo_reg_value) != 1){
-				break;
+	/* a restored checkpoint may lack pages of the image altogether */
+	for (i = 0; i < mem->NUM_PRISTINE; i++) {
+		address = mem->PRISTINE_PAGES[i];
+		if (mem_page_lookup(sim, address) == NULL) {
+			memcpy(mem_page_alloc(sim, address), &mem->PRISTINE_DATA[(size_t)i * MEM_PAGE_SIZE], MEM_PAGE_SIZE);
+			if (address >= MEM_TEXT_BEGIN && address <= MEM_TEXT_END) {
+				predecode_page(sim, address);
 			}
-			CURRENT_STATE.LO = lo_reg_value;
-			NEXT_STATE.LO = lo_reg_value;
-			break;
-		case 'P':
-		case 'p':
-			print_program(); 
-			break;
-		default:
-			printf("Invalid Command.\n");
-			break;
+			restored++;
+		}
+	}
+
+	mem_clear_dirty(sim);
+	for (i = 0; i < MAX_CORES; i++) {
+		mem_clear_link(mem, i);
 	}
+	mem_tlb_flush(sim);
+	jit_flush(sim);
+	mem->CODE_GENERATION++;
+	printf("Memory reset: %u page(s) restored from the loaded program.\n\n", restored);
 }
 
 /***************************************************************/
-/* reset registers/memory and reload program                                                    */
+/* Guest memory is little-endian; load/store a word through a host pointer     */
 /***************************************************************/
-void reset() {   
-	int i;
-	/*reset registers*/
-	for (i = 0; i < MIPS_REGS; i++){
-		CURRENT_STATE.REGS[i] = 0;
-	}
-	CURRENT_STATE.HI = 0;
-	CURRENT_STATE.LO = 0;
-	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
-	}
-	
-	/*load program*/
-	load_program();
-	
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+static inline uint32_t host_load_32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	return value;
+}
+
+static inline void host_store_32(uint8_t *p, uint32_t value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	memcpy(p, &value, sizeof(value));
+}
+
+static inline void host_store_16(uint8_t *p, uint16_t value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap16(value);
+#endif
+	memcpy(p, &value, sizeof(value));
 }
 
 /***************************************************************/
-/* Allocate and set memory to zero                                                                            */
+/* Read a 32-bit word from memory                                                                            */
 /***************************************************************/
-void init_memory() {                                           
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+uint32_t mem_read_32(MIPS_Sim* sim, uint32_t address)
+{
+	mem_tlb_entry_t *entry = &sim->MEM_TLB[(address >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+
+	if (entry->tag == (address >> MEM_PAGE_SHIFT) && (address & 3) == 0) {
+		return host_load_32(entry->page + (address & MEM_PAGE_MASK));
 	}
+	return mem_read_32_slow(sim, address);
 }
 
-/**************************************************************/
-/* load program into memory                                                                                      */
-/**************************************************************/
-void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
+/***************************************************************/
+/* TLB miss (or unaligned) read: walk the regions and page table                            */
+/***************************************************************/
+uint32_t mem_read_32_slow(MIPS_Sim* sim, uint32_t address)
+{
+	uint32_t offset = address & MEM_PAGE_MASK;
+	uint32_t value = 0;
+	uint8_t *page;
+	int i;
 
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL) {
-		printf("Error: Can't open program file %s\n", prog_file);
-		exit(-1);
+	if (!mem_region_valid(address)) {
+		return 0;
 	}
 
-	/* Read in the program. */
+	if (offset <= MEM_PAGE_SIZE - 4) {
+		page = mem_page_lookup(sim, address);
+		if (page == NULL) {
+			return 0; /* untouched pages read as zero and are not cached */
+		}
+		if ((address & 3) == 0) {
+			mem_tlb_entry_t *entry = &sim->MEM_TLB[(address >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+			entry->tag = address >> MEM_PAGE_SHIFT;
+			entry->wtag = MEM_TLB_INVALID; /* the first store goes the slow way to mark the page dirty */
+			entry->page = page;
+			entry->code = (decoded_page_lookup(sim, address) != NULL);
+		}
+		return host_load_32(page + offset);
+	}
 
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+	/* word straddles two pages */
+	for (i = 3; i >= 0; i--) {
+		page = mem_page_lookup(sim, address + i);
+		value <<= 8;
+		if (page != NULL) {
+			value |= page[(address + i) & MEM_PAGE_MASK];
+		}
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
+	return value;
 }
 
-/************************************************************/
-/* maintain the pipeline                                                                                           */ 
-/************************************************************/
-void handle_pipeline()
+/***************************************************************/
+/* Write a 32-bit word to memory                                                                                */
+/***************************************************************/
+static inline void mem_write_word(MIPS_Sim* sim, uint32_t address, uint32_t value)
 {
-	WB();
-	MEM();
-	EX();
-	ID();
-	IF();
+	mem_tlb_entry_t *entry = &sim->MEM_TLB[(address >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+
+	if (entry->wtag == (address >> MEM_PAGE_SHIFT) && (address & 3) == 0) {
+		host_store_32(entry->page + (address & MEM_PAGE_MASK), value);
+		if (entry->code) {
+			redecode_word(sim, address);
+		}
+		return;
+	}
+	mem_write_32_slow(sim, address, value);
 }
 
-/************************************************************/
-/* writeback (WB) pipeline stage:                                                                          */ 
-/************************************************************/
-void WB()
+void mem_write_32(MIPS_Sim* sim, uint32_t address, uint32_t value)
 {
-	uint32_t rt;
-	uint32_t rd;
-	uint32_t opcode;
-	uint32_t funct;	
-
-	WB_decode_operands(MEM_WB.IR, &rt, &rd, &opcode, &funct);
-
-	WB_populate_destination(rt, rd, opcode, funct);
-	
-	INSTRUCTION_COUNT++;
+	if (__atomic_load_n(&sim->MEMORY->RESERVATIONS, __ATOMIC_RELAXED) != 0) {
+		mem_break_links(sim, address);
+	}
+	mem_write_word(sim, address, value);
 }
 
-/************************************************************/
-/* memory access (MEM) pipeline stage:                                                          */ 
-/************************************************************/
-void MEM()
+/***************************************************************/
+/* TLB miss (or unaligned) write: walk the regions, allocating the page            */
+/***************************************************************/
+void mem_write_32_slow(MIPS_Sim* sim, uint32_t address, uint32_t value)
 {
-	uint32_t opcode;
-	uint32_t addr;
-	
-	// Get the current instruction
-	MEM_WB.IR = EX_MEM.IR;
-	MEM_WB.ALUOutput = EX_MEM.ALUOutput;
-	MEM_WB.B = EX_MEM.B;
+	uint32_t offset = address & MEM_PAGE_MASK;
+	uint8_t *page;
+	int i;
+
+	if (!mem_region_valid(address)) {
+		return;
+	}
 
-	MEM_decode_operands(ID_EX.IR, &opcode, &addr);
+	if (offset <= MEM_PAGE_SIZE - 4) {
+		page = mem_page_alloc(sim, address);
+		mem_mark_dirty(sim, address);
+		if ((address & 3) == 0) {
+			mem_tlb_entry_t *entry = &sim->MEM_TLB[(address >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+			entry->tag = address >> MEM_PAGE_SHIFT;
+			entry->wtag = entry->tag;
+			entry->page = page;
+			entry->code = (decoded_page_lookup(sim, address) != NULL);
+		}
+		host_store_32(page + offset, value);
+		if (decoded_page_lookup(sim, address) != NULL) {
+			redecode_word(sim, address);
+			if (address & 3) {
+				redecode_word(sim, address + 3);
+			}
+		}
+		return;
+	}
 
-	// Perform the current memory operation
-	MEM_access(opcode, addr);
+	/* word straddles two pages */
+	for (i = 0; i < 4; i++) {
+		page = mem_page_alloc(sim, address + i);
+		mem_mark_dirty(sim, address + i);
+		page[(address + i) & MEM_PAGE_MASK] = (value >> (8 * i)) & 0xFF;
+		if (decoded_page_lookup(sim, address + i) != NULL) {
+			redecode_word(sim, address + i);
+		}
+	}
 }
 
-/************************************************************/
-/* execution (EX) pipeline stage:                                                                          */ 
-/************************************************************/
-void EX()
+/***************************************************************/
+/* sb/sh: write only their own bytes. Memory is shared between the core     */
+/* threads, so merging into the word would lose another core's store to the */
+/* rest of it.                                                                                                    */
+/***************************************************************/
+static void mem_write_narrow(MIPS_Sim* sim, uint32_t address, uint32_t value, uint32_t size)
 {
-	uint32_t opcode;
-	uint32_t shamt;
-	uint32_t funct;
-	uint32_t addr;
-	
-	// Get the current instruction & operands
-	EX_MEM.IR = ID_EX.IR;
-	EX_MEM.A = ID_EX.A;
-	EX_MEM.B = ID_EX.B;
-	EX_MEM.imm = ID_EX.imm;
-
-	EX_decode_operands(ID_EX.IR, &opcode, &shamt, &funct, &addr);
+	mem_tlb_entry_t *entry = &sim->MEM_TLB[(address >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+	uint8_t *page;
 
-	// Perform the current operation and store the values
-	EX_perform_operation(EX_MEM.A, EX_MEM.B, EX_MEM.imm, opcode, shamt, funct, addr);
+	if (__atomic_load_n(&sim->MEMORY->RESERVATIONS, __ATOMIC_RELAXED) != 0) {
+		mem_break_links(sim, address);
+	}
+	if (entry->wtag == (address >> MEM_PAGE_SHIFT)) {
+		page = entry->page;
+	} else {
+		if (!mem_region_valid(address)) {
+			return;
+		}
+		page = mem_page_alloc(sim, address);
+		mem_mark_dirty(sim, address);
+		entry->tag = address >> MEM_PAGE_SHIFT;
+		entry->wtag = entry->tag;
+		entry->page = page;
+		entry->code = (decoded_page_lookup(sim, address) != NULL);
+	}
 
-	return;
+	if (size == 1) {
+		page[address & MEM_PAGE_MASK] = value & 0xFF;
+	} else {
+		host_store_16(page + (address & MEM_PAGE_MASK), value & 0xFFFF);
+	}
+	if (entry->code) {
+		redecode_word(sim, address);
+	}
 }
 
-/************************************************************/
-/* instruction decode (ID) pipeline stage:                                                         */ 
-/************************************************************/
-void ID()
+/***************************************************************/
+/* Drop a core's LL link; LINK_LOCK must be held                                                  */
+/***************************************************************/
+void mem_clear_link(MIPS_Memory* mem, int core)
 {
-	uint32_t rs;
-	uint32_t rt;
-	uint32_t immediate;
-	
-	// Get the current instruction
-	ID_EX.IR = IF_ID.IR;
-
-	// Decode the registers in the instruction
-	ID_decode_operands(ID_EX.IR, &rs, &rt, &immediate);
+	if (mem->LL_VALID[core]) {
+		mem->LL_VALID[core] = FALSE;
+		__atomic_sub_fetch(&mem->RESERVATIONS, 1, __ATOMIC_RELAXED);
+	}
+}
 
-	// ID/EX.A <= REGS[ IF/ID.IR[rs] ]
-	ID_EX.A = CURRENT_STATE.REGS[rs];
+/***************************************************************/
+/* Break every LL link on the word a store is about to change                          */
+/***************************************************************/
+void mem_break_links(MIPS_Sim* sim, uint32_t address)
+{
+	MIPS_Memory *mem = sim->MEMORY;
+	int i;
 
-	// ID/EX.B <= REGS[ IF/ID.IR[rt] ]
-	ID_EX.B = CURRENT_STATE.REGS[rt];
+	pthread_mutex_lock(&mem->LINK_LOCK);
+	for (i = 0; i < MAX_CORES; i++) {
+		if (mem->LL_VALID[i] && mem->LL_ADDR[i] == (address & ~3)) {
+			mem_clear_link(mem, i);
+		}
+	}
+	pthread_mutex_unlock(&mem->LINK_LOCK);
+}
 
-	// ID/EX.imm <= sign-extend( IF/ID.IR[imm. Field] )
-	ID_EX.imm = immediate;
+/***************************************************************/
+/* ll: load a word and link this core to it                                                              */
+/***************************************************************/
+uint32_t mem_load_linked(MIPS_Sim* sim, uint32_t address)
+{
+	MIPS_Memory *mem = sim->MEMORY;
+	uint32_t value;
 
-	return;
+	pthread_mutex_lock(&mem->LINK_LOCK);
+	if (!mem->LL_VALID[sim->CORE_ID]) {
+		mem->LL_VALID[sim->CORE_ID] = TRUE;
+		__atomic_add_fetch(&mem->RESERVATIONS, 1, __ATOMIC_RELAXED);
+	}
+	value = mem_read_32(sim, address);
+	mem->LL_ADDR[sim->CORE_ID] = address & ~3;
+	mem->LL_VALUE[sim->CORE_ID] = value;
+	pthread_mutex_unlock(&mem->LINK_LOCK);
+	return value;
 }
 
+/***************************************************************/
+/* sc: store only if this core's link survived, returning 1 on success       */
+/* A racing plain store may miss RESERVATIONS and not break the link, so  */
+/* the word is also compared against what ll read.                                        */
+/***************************************************************/
+uint32_t mem_store_conditional(MIPS_Sim* sim, uint32_t address, uint32_t value)
+{
+	MIPS_Memory *mem = sim->MEMORY;
+	int core = sim->CORE_ID;
+	uint32_t success;
+	int i;
+
+	pthread_mutex_lock(&mem->LINK_LOCK);
+	success = mem->LL_VALID[core] && mem->LL_ADDR[core] == address &&
+		mem_read_32(sim, address) == mem->LL_VALUE[core];
+	if (success) {
+		for (i = 0; i < MAX_CORES; i++) {
+			if (mem->LL_VALID[i] && mem->LL_ADDR[i] == address) {
+				mem_clear_link(mem, i);
+			}
+		}
+		mem_write_word(sim, address, value);
+	}
+	mem_clear_link(mem, core);
+	pthread_mutex_unlock(&mem->LINK_LOCK);
+	return success;
+}
+
+/***************************************************************/
+/* Perform the memory read of a load, sign-extending lb/lh                                      */
+/***************************************************************/
+uint32_t mem_load(MIPS_Sim* sim, const Decoded_Instr* instr, uint32_t address)
+{
+	uint32_t word;
+
+	switch (instr->op) {
+		case (OP_LB):
+			word = mem_read_32(sim, address & ~3);
+			return (uint32_t)(int32_t)(int8_t)(word >> (8 * (address & 3)));
+
+		case (OP_LH):
+			word = mem_read_32(sim, address & ~3);
+			return (uint32_t)(int32_t)(int16_t)(word >> (8 * (address & 2)));
+
+		case (OP_LL):
+			return mem_load_linked(sim, address);
+
+		default:
+			return mem_read_32(sim, address);
+	}
+}
+
+/***************************************************************/
+/* Perform the memory write of a store                                                                  */
+/***************************************************************/
+void mem_store(MIPS_Sim* sim, const Decoded_Instr* instr, uint32_t address, uint32_t value)
+{
+	switch (instr->op) {
+		case (OP_SB):
+			mem_write_narrow(sim, address, value, 1);
+		break;
+
+		case (OP_SH):
+			mem_write_narrow(sim, address & ~1, value, 2);
+		break;
+
+		default:
+			mem_write_32(sim, address, value);
+		break;
+	}
+}
+
+/***************************************************************/
+/* Configure a cache from "key=value,..." (see CACHE_DEFAULT_SPEC for the   */
+/* keys); keys left out keep their defaults. Allocates the lines.            */
+/***************************************************************/
+int cache_configure(cache_t* cache, const char* spec)
+{
+	char buffer[256], *key, *value, *end, *save = NULL;
+	const char* specs[2] = { CACHE_DEFAULT_SPEC, spec };
+	unsigned long n;
+	int i;
+
+	cache_release(cache);
+	memset(cache, 0, sizeof(*cache));
+	for (i = 0; i < 2; i++) {
+		snprintf(buffer, sizeof(buffer), "%s", specs[i]);
+		for (key = strtok_r(buffer, ",", &save); key != NULL; key = strtok_r(NULL, ",", &save)) {
+			value = strchr(key, '=');
+			if (value == NULL) {
+				printf("Error: Cache option '%s' needs a value\n", key);
+				return FALSE;
+			}
+			*value++ = '\0';
+			n = strtoul(value, &end, 0);
+			if (*end == 'k' || *end == 'K') {
+				n *= 1024;
+				end++;
+			}
+			if (strcmp(key, "repl") == 0) {
+				if (strcmp(value, "lru") == 0) {
+					cache->REPLACEMENT = REPL_LRU;
+				} else if (strcmp(value, "random") == 0) {
+					cache->REPLACEMENT = REPL_RANDOM;
+				} else if (strcmp(value, "plru") == 0) {
+					cache->REPLACEMENT = REPL_PLRU;
+				} else {
+					printf("Error: Unknown cache replacement '%s' (lru, random or plru)\n", value);
+					return FALSE;
+				}
+			} else if (strcmp(key, "write") == 0) {
+				if (strcmp(value, "wb") != 0 && strcmp(value, "wt") != 0) {
+					printf("Error: Unknown cache write policy '%s' (wb or wt)\n", value);
+					return FALSE;
+				}
+				cache->WRITE_BACK = (value[1] == 'b');
+			} else if (*end != '\0' || end == value) {
+				printf("Error: Bad value '%s' for cache option %s\n", value, key);
+				return FALSE;
+			} else if (strcmp(key, "size") == 0) {
+				cache->SIZE = n;
+			} else if (strcmp(key, "assoc") == 0) {
+				cache->ASSOC = n;
+			} else if (strcmp(key, "line") == 0) {
+				cache->LINE_SIZE = n;
+			} else if (strcmp(key, "alloc") == 0) {
+				cache->WRITE_ALLOCATE = (n != 0);
+			} else if (strcmp(key, "penalty") == 0) {
+				cache->MISS_PENALTY = n;
+			} else {
+				printf("Error: Unknown cache option '%s'\n", key);
+				return FALSE;
+			}
+		}
+	}
+
+	/* geometry: powers of two, at least one set, a line holds a word */
+	if ((cache->SIZE & (cache->SIZE - 1)) || (cache->ASSOC & (cache->ASSOC - 1)) || (cache->LINE_SIZE & (cache->LINE_SIZE - 1)) ||
+		cache->ASSOC == 0 || cache->ASSOC > CACHE_MAX_ASSOC || cache->LINE_SIZE < 4 ||
+		cache->SIZE < cache->ASSOC * cache->LINE_SIZE) {
+		printf("Error: Cache size, associativity (1..%d) and line size (>= 4) must be powers of two, size >= assoc * line\n",
+			CACHE_MAX_ASSOC);
+		return FALSE;
+	}
+	cache->SETS = cache->SIZE / (cache->ASSOC * cache->LINE_SIZE);
+	for (cache->LINE_SHIFT = 0; (1u << cache->LINE_SHIFT) < cache->LINE_SIZE; cache->LINE_SHIFT++);
+	cache->LINES = calloc((size_t)cache->SETS * cache->ASSOC, sizeof(cache_line_t));
+	cache->PLRU = calloc(cache->SETS, sizeof(uint64_t));
+	if (cache->LINES == NULL || cache->PLRU == NULL) {
+		printf("Error: Out of memory allocating cache\n");
+		exit(-1);
+	}
+	cache->RANDOM = 0x9E3779B9;
+	cache->ENABLED = TRUE;
+	return TRUE;
+}
+
+/***************************************************************/
+/* Empty the cache and zero its statistics, keeping the configuration     */
+/***************************************************************/
+void cache_invalidate(cache_t* cache)
+{
+	if (!cache->ENABLED) {
+		return;
+	}
+	memset(cache->LINES, 0, (size_t)cache->SETS * cache->ASSOC * sizeof(cache_line_t));
+	memset(cache->PLRU, 0, cache->SETS * sizeof(uint64_t));
+	cache->CLOCK = 0;
+	cache->RANDOM = 0x9E3779B9;
+	cache->READS = cache->WRITES = 0;
+	cache->READ_MISSES = cache->WRITE_MISSES = 0;
+	cache->EVICTIONS = cache->MEMORY_WRITES = 0;
+}
+
+/***************************************************************/
+/* Free the lines of a cache, leaving it disabled                                           */
+/***************************************************************/
+void cache_release(cache_t* cache)
+{
+	free(cache->LINES);
+	free(cache->PLRU);
+	cache->LINES = NULL;
+	cache->PLRU = NULL;
+	cache->ENABLED = FALSE;
+}
+
+/* tree PLRU: each node points away from the half used last */
+static void cache_plru_touch(cache_t* cache, uint32_t set, uint32_t way)
+{
+	uint32_t node = 1, bit, level;
+	uint64_t *tree = &cache->PLRU[set];
+
+	for (level = cache->ASSOC >> 1; level > 0; level >>= 1) {
+		bit = (way & level) != 0;
+		*tree = bit ? (*tree & ~(1ull << node)) : (*tree | (1ull << node));
+		node = 2 * node + bit;
+	}
+}
+
+static uint32_t cache_plru_victim(cache_t* cache, uint32_t set)
+{
+	uint32_t node = 1;
+
+	while (node < cache->ASSOC) {
+		node = 2 * node + ((cache->PLRU[set] >> node) & 1);
+	}
+	return node - cache->ASSOC;
+}
+
+static uint32_t cache_victim(cache_t* cache, uint32_t set, cache_line_t* lines)
+{
+	uint32_t way, victim = 0;
+
+	for (way = 0; way < cache->ASSOC; way++) {
+		if (!lines[way].valid) {
+			return way;
+		}
+	}
+	switch (cache->REPLACEMENT) {
+		case (REPL_RANDOM):
+			cache->RANDOM ^= cache->RANDOM << 13;
+			cache->RANDOM ^= cache->RANDOM >> 17;
+			cache->RANDOM ^= cache->RANDOM << 5;
+			return cache->RANDOM & (cache->ASSOC - 1);
+
+		case (REPL_PLRU):
+			return cache_plru_victim(cache, set);
+
+		default:
+			for (way = 1; way < cache->ASSOC; way++) {
+				if (lines[way].stamp < lines[victim].stamp) {
+					victim = way;
+				}
+			}
+			return victim;
+	}
+}
+
+/***************************************************************/
+/* Look up an access and update the cache; returns the cycles it stalls  */
+/***************************************************************/
+uint32_t cache_access(cache_t* cache, uint32_t address, int write)
+{
+	uint32_t line_addr = address >> cache->LINE_SHIFT;
+	uint32_t set = line_addr & (cache->SETS - 1);
+	cache_line_t *lines = &cache->LINES[(size_t)set * cache->ASSOC];
+	uint32_t way, stall = 0;
+
+	if (write) {
+		cache->WRITES++;
+	} else {
+		cache->READS++;
+	}
+
+	for (way = 0; way < cache->ASSOC; way++) {
+		if (lines[way].valid && lines[way].tag == line_addr) {
+			break;
+		}
+	}
+
+	if (way == cache->ASSOC) {
+		if (write) {
+			cache->WRITE_MISSES++;
+		} else {
+			cache->READ_MISSES++;
+		}
+		if (write && !cache->WRITE_ALLOCATE) {
+			cache->MEMORY_WRITES++; // straight to memory through the write buffer
+			return 0;
+		}
+
+		/* fill: write back a dirty victim first */
+		way = cache_victim(cache, set, lines);
+		if (lines[way].valid) {
+			cache->EVICTIONS++;
+			if (lines[way].dirty) {
+				cache->MEMORY_WRITES++;
+				stall += cache->MISS_PENALTY;
+			}
+		}
+		lines[way].tag = line_addr;
+		lines[way].valid = TRUE;
+		lines[way].dirty = FALSE;
+		stall += cache->MISS_PENALTY;
+	}
+
+	if (write) {
+		if (cache->WRITE_BACK) {
+			lines[way].dirty = TRUE;
+		} else {
+			cache->MEMORY_WRITES++;
+		}
+	}
+	lines[way].stamp = ++cache->CLOCK;
+	if (cache->REPLACEMENT == REPL_PLRU) {
+		cache_plru_touch(cache, set, way);
+	}
+	return stall;
+}
+
+/***************************************************************/
+/* Print the configuration and statistics of a cache                                   */
+/***************************************************************/
+void cache_report(const cache_t* cache, const char* name, FILE* fp)
+{
+	static const char* const repl[] = { "LRU", "random", "PLRU" };
+	uint64_t accesses = cache->READS + cache->WRITES;
+	uint64_t misses = cache->READ_MISSES + cache->WRITE_MISSES;
+
+	if (!cache->ENABLED) {
+		fprintf(fp, "%s\t: off\n", name);
+		return;
+	}
+	fprintf(fp, "%s\t: %u bytes, %u-way, %u-byte lines, %u sets, %s, %s%s, miss penalty %u\n",
+		name, cache->SIZE, cache->ASSOC, cache->LINE_SIZE, cache->SETS, repl[cache->REPLACEMENT],
+		cache->WRITE_BACK ? "write-back" : "write-through", cache->WRITE_ALLOCATE ? ", write-allocate" : "",
+		cache->MISS_PENALTY);
+	fprintf(fp, "  # Reads\t\t: %llu (%llu misses)\n", (unsigned long long)cache->READS, (unsigned long long)cache->READ_MISSES);
+	fprintf(fp, "  # Writes\t\t: %llu (%llu misses)\n", (unsigned long long)cache->WRITES, (unsigned long long)cache->WRITE_MISSES);
+	fprintf(fp, "  # Hits\t\t: %llu\n", (unsigned long long)(accesses - misses));
+	if (accesses > 0) {
+		fprintf(fp, "  Miss Rate\t\t: %.2f%%\n", 100.0 * misses / accesses);
+	}
+	fprintf(fp, "  # Evictions\t\t: %llu\n", (unsigned long long)cache->EVICTIONS);
+	fprintf(fp, "  # Memory Writes\t: %llu\n", (unsigned long long)cache->MEMORY_WRITES);
+}
+
+/***************************************************************/
+/* Configure the branch predictor from "key=value,..." (see               */
+/* BPRED_DEFAULT_SPEC for the keys); keys left out keep their defaults.  */
+/***************************************************************/
+int bpred_configure(bpred_t* bp, const char* spec)
+{
+	char buffer[256], *key, *value, *end, *save = NULL;
+	const char* specs[2] = { BPRED_DEFAULT_SPEC, spec };
+	unsigned long n;
+	int i;
+
+	bpred_release(bp);
+	memset(bp, 0, sizeof(*bp));
+	for (i = 0; i < 2; i++) {
+		snprintf(buffer, sizeof(buffer), "%s", specs[i] != NULL ? specs[i] : "");
+		for (key = strtok_r(buffer, ",", &save); key != NULL; key = strtok_r(NULL, ",", &save)) {
+			value = strchr(key, '=');
+			if (value == NULL) {
+				printf("Error: Branch predictor option '%s' needs a value\n", key);
+				return FALSE;
+			}
+			*value++ = '\0';
+			n = strtoul(value, &end, 0);
+			if (*end == 'k' || *end == 'K') {
+				n *= 1024;
+				end++;
+			}
+			if (strcmp(key, "type") == 0) {
+				if (strcmp(value, "nottaken") == 0) {
+					bp->TYPE = BPRED_NOT_TAKEN;
+				} else if (strcmp(value, "btfn") == 0) {
+					bp->TYPE = BPRED_BTFN;
+				} else if (strcmp(value, "bimodal") == 0) {
+					bp->TYPE = BPRED_BIMODAL;
+				} else if (strcmp(value, "gshare") == 0) {
+					bp->TYPE = BPRED_GSHARE;
+				} else {
+					printf("Error: Unknown branch predictor '%s' (nottaken, btfn, bimodal or gshare)\n", value);
+					return FALSE;
+				}
+			} else if (*end != '\0' || end == value) {
+				printf("Error: Bad value '%s' for branch predictor option %s\n", value, key);
+				return FALSE;
+			} else if (strcmp(key, "size") == 0) {
+				bp->SIZE = n;
+			} else if (strcmp(key, "history") == 0) {
+				bp->HISTORY_BITS = n;
+			} else if (strcmp(key, "btb") == 0) {
+				bp->BTB_ENTRIES = n;
+			} else {
+				printf("Error: Unknown branch predictor option '%s'\n", key);
+				return FALSE;
+			}
+		}
+	}
+
+	if (bp->SIZE == 0 || (bp->SIZE & (bp->SIZE - 1)) || (bp->BTB_ENTRIES & (bp->BTB_ENTRIES - 1)) || bp->HISTORY_BITS > 31) {
+		printf("Error: Branch predictor size and BTB entries must be powers of two (btb=0 for none), history <= 31 bits\n");
+		return FALSE;
+	}
+	bp->COUNTERS = malloc(bp->SIZE);
+	bp->BTB = calloc(bp->BTB_ENTRIES ? bp->BTB_ENTRIES : 1, sizeof(btb_entry_t));
+	if (bp->COUNTERS == NULL || bp->BTB == NULL) {
+		printf("Error: Out of memory allocating branch predictor\n");
+		exit(-1);
+	}
+	bpred_reset(bp);
+	return TRUE;
+}
+
+/***************************************************************/
+/* Forget all history and zero the statistics, keeping the configuration */
+/***************************************************************/
+void bpred_reset(bpred_t* bp)
+{
+	if (bp->COUNTERS == NULL) {
+		return;
+	}
+	memset(bp->COUNTERS, 1, bp->SIZE); // weakly not-taken
+	memset(bp->BTB, 0, (bp->BTB_ENTRIES ? bp->BTB_ENTRIES : 1) * sizeof(btb_entry_t));
+	bp->HISTORY = 0;
+	bp->BRANCHES = bp->TAKEN = bp->DIRECTION_MISSES = 0;
+	bp->JUMPS = bp->MISPREDICTS = bp->ID_REDIRECTS = 0;
+	bp->BTB_LOOKUPS = bp->BTB_HITS = 0;
+	bp->PENALTY_CYCLES = 0;
+}
+
+/***************************************************************/
+/* Free the predictor tables                                                                         */
+/***************************************************************/
+void bpred_release(bpred_t* bp)
+{
+	free(bp->COUNTERS);
+	free(bp->BTB);
+	bp->COUNTERS = NULL;
+	bp->BTB = NULL;
+}
+
+/* target of a branch or direct jump at pc; FALSE for jr/jalr */
+static int branch_direct_target(uint32_t pc, const Decoded_Instr* d, uint32_t* target)
+{
+	if (d->class == CLASS_BRANCH) {
+		*target = pc + 4 + (d->imm << 2);
+		return TRUE;
+	}
+	if (d->op == OP_J || d->op == OP_JAL) {
+		*target = ((pc + 4) & 0xF0000000) | (d->target << 2);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static uint32_t bpred_index(const bpred_t* bp, uint32_t pc, uint32_t history)
+{
+	uint32_t index = pc >> 2;
+
+	if (bp->TYPE == BPRED_GSHARE) {
+		index ^= history;
+	}
+	return index & (bp->SIZE - 1);
+}
+
+static uint32_t bpred_shift(const bpred_t* bp, uint32_t history, int taken)
+{
+	return ((history << 1) | (taken != 0)) & ((1u << bp->HISTORY_BITS) - 1);
+}
+
+/* A redirect dropped everything fetched after reg: take the global history */
+/* back to what it was just after reg, with its real (or ID's) outcome        */
+static void bpred_repair(bpred_t* bp, const CPU_Pipeline_Reg* reg, int taken)
+{
+	bp->HISTORY = (reg->D.class == CLASS_BRANCH) ? bpred_shift(bp, reg->PRED_HISTORY, taken) : reg->PRED_HISTORY;
+}
+
+/***************************************************************/
+/* Predict the instruction IF just fetched at pc: sets *taken, and *history */
+/* to the global history it was predicted with, and returns where fetch    */
+/* goes next. A branch shifts its prediction into the history right away, */
+/* so the branches fetched behind it see it.                                          */
+/***************************************************************/
+uint32_t bpred_predict(MIPS_Sim* sim, uint32_t pc, const Decoded_Instr* d, uint8_t* taken, uint32_t* history)
+{
+	bpred_t* bp = &sim->BPRED;
+	btb_entry_t* entry;
+	uint32_t target;
+
+	*history = bp->HISTORY;
+	switch (bp->TYPE) {
+		case (BPRED_BTFN):
+			*taken = (d->class == CLASS_JUMP) || (int32_t)d->imm < 0;
+		break;
+
+		case (BPRED_BIMODAL):
+		case (BPRED_GSHARE):
+			*taken = (d->class == CLASS_JUMP) || bp->COUNTERS[bpred_index(bp, pc, *history)] >= 2;
+		break;
+
+		default:
+			*taken = (d->class == CLASS_JUMP);
+		break;
+	}
+	if (d->class == CLASS_BRANCH) {
+		bp->HISTORY = bpred_shift(bp, *history, *taken);
+	}
+	if (!*taken) {
+		return pc + 4;
+	}
+
+	// the target comes from the BTB if there is one, else straight from the instruction
+	if (bp->BTB_ENTRIES > 0) {
+		entry = &bp->BTB[(pc >> 2) & (bp->BTB_ENTRIES - 1)];
+		bp->BTB_LOOKUPS++;
+		if (entry->valid && entry->pc == pc) {
+			bp->BTB_HITS++;
+			return entry->target;
+		}
+		return pc + 4;
+	}
+	return branch_direct_target(pc, d, &target) ? target : pc + 4;
+}
+
+/***************************************************************/
+/* Train the predictor with a branch or jump EX resolved: the counter it   */
+/* was predicted with, found from the history it was fetched under            */
+/***************************************************************/
+void bpred_update(MIPS_Sim* sim, uint32_t pc, const Decoded_Instr* d, int taken, uint32_t target, uint32_t history)
+{
+	bpred_t* bp = &sim->BPRED;
+	btb_entry_t* entry;
+	uint8_t* counter;
+
+	if (d->class == CLASS_BRANCH) {
+		counter = &bp->COUNTERS[bpred_index(bp, pc, history)];
+		if (taken && *counter < 3) {
+			(*counter)++;
+		} else if (!taken && *counter > 0) {
+			(*counter)--;
+		}
+	}
+	if (taken && bp->BTB_ENTRIES > 0) {
+		entry = &bp->BTB[(pc >> 2) & (bp->BTB_ENTRIES - 1)];
+		entry->pc = pc;
+		entry->target = target;
+		entry->valid = TRUE;
+	}
+}
+
+/***************************************************************/
+/* Print the configuration and statistics of the branch predictor        */
+/***************************************************************/
+void bpred_report(const bpred_t* bp, FILE* fp)
+{
+	static const char* const names[] = { "static not-taken", "BTFN", "bimodal", "gshare" };
+
+	fprintf(fp, "Branch predictor\t: %s", names[bp->TYPE]);
+	if (bp->TYPE == BPRED_BIMODAL || bp->TYPE == BPRED_GSHARE) {
+		fprintf(fp, ", %u counters", bp->SIZE);
+	}
+	if (bp->TYPE == BPRED_GSHARE) {
+		fprintf(fp, ", %u history bits", bp->HISTORY_BITS);
+	}
+	if (bp->BTB_ENTRIES > 0) {
+		fprintf(fp, ", %u-entry BTB\n", bp->BTB_ENTRIES);
+	} else {
+		fprintf(fp, ", no BTB\n");
+	}
+	fprintf(fp, "  # Branches\t\t: %llu (%llu taken)\n", (unsigned long long)bp->BRANCHES, (unsigned long long)bp->TAKEN);
+	if (bp->BRANCHES > 0) {
+		fprintf(fp, "  Direction Accuracy\t: %.2f%%\n", 100.0 * (bp->BRANCHES - bp->DIRECTION_MISSES) / bp->BRANCHES);
+	}
+	fprintf(fp, "  # Jumps\t\t: %llu\n", (unsigned long long)bp->JUMPS);
+	fprintf(fp, "  # Mispredicts\t\t: %llu\n", (unsigned long long)bp->MISPREDICTS);
+	fprintf(fp, "  # ID Redirects\t: %llu\n", (unsigned long long)bp->ID_REDIRECTS);
+	if (bp->BTB_ENTRIES > 0) {
+		fprintf(fp, "  # BTB Hits\t\t: %llu / %llu\n", (unsigned long long)bp->BTB_HITS, (unsigned long long)bp->BTB_LOOKUPS);
+	}
+	fprintf(fp, "  # Penalty Cycles\t: %llu\n", (unsigned long long)bp->PENALTY_CYCLES);
+}
+
+/***************************************************************/
+/* EX resolved the branch or jump in an EX/MEM slot: train the predictor    */
+/* and, if fetch went the wrong way, squash IF/ID and redirect fetch           */
+/***************************************************************/
+void branch_resolve(MIPS_Sim* sim, CPU_Pipeline_Reg* reg, int taken, uint32_t target)
+{
+	bpred_t* bp = &sim->BPRED;
+	uint32_t next = taken ? target : reg->PC; // PC holds the address after the branch
+
+	if (reg->D.class == CLASS_BRANCH) {
+		bp->BRANCHES++;
+		bp->TAKEN += (taken != 0);
+		bp->DIRECTION_MISSES += (reg->PRED_TAKEN != (taken != 0));
+	} else {
+		bp->JUMPS++;
+	}
+	bpred_update(sim, reg->PC - 4, &reg->D, taken, target, reg->PRED_HISTORY);
+
+	if (next != reg->PRED_PC) {
+		bpred_repair(bp, reg, taken);
+		bp->MISPREDICTS++;
+		bp->PENALTY_CYCLES += 2;
+		sim->BRANCH_SQUASH = TRUE;
+		sim->BRANCH_REDIRECT = TRUE;
+		sim->REDIRECT_PC = next;
+	}
+}
+
+/***************************************************************/
+/* Execute one cycle                                                                                                              */
+/***************************************************************/
+void cycle(MIPS_Sim* sim) {                                                
+	handle_pipeline(sim);
+	if (PERF_ON(sim)) {
+		perf_sample(sim);
+	}
+	if (TRACE_ON(sim)) {
+		trace_sample(sim);
+	}
+	if (PIPEVIEW_ON(sim)) {
+		pipeview_sample(sim);
+	}
+	if (PROFILE_ON(sim)) {
+		profile_sample(sim);
+	}
+	sim->CURRENT_STATE = sim->NEXT_STATE;
+	sim->CYCLE_COUNT++;
+	if (sim->RUN_FLAG && ((__builtin_expect(sim->CYCLE_LIMIT != 0, 0) && sim->CYCLE_COUNT >= sim->CYCLE_LIMIT) ||
+		(__builtin_expect(sim->INSTRUCTION_LIMIT != 0, 0) && sim->INSTRUCTION_COUNT + sim->FF_INSTRUCTION_COUNT >= sim->INSTRUCTION_LIMIT))) {
+		printf("Stopped: watchdog limit reached (%llu cycles, %llu instructions), PC 0x%08x\n\n", (unsigned long long)sim->CYCLE_COUNT,
+			(unsigned long long)(sim->INSTRUCTION_COUNT + sim->FF_INSTRUCTION_COUNT), sim->CURRENT_STATE.PC);
+		sim_stop(sim, STOP_WATCHDOG);
+	}
+}
+
+/***************************************************************/
+/* Stop a core and record why                                                                            */
+/***************************************************************/
+void sim_stop(MIPS_Sim* sim, stop_reason_t reason)
+{
+	sim->RUN_FLAG = FALSE;
+	sim->STOP_REASON = reason;
+}
+
+/***************************************************************/
+/* Simulate MIPS for n cycles                                                                                       */
+/***************************************************************/
+void run(MIPS_Sim* sim, uint64_t num_cycles) {                                      
+	
+	if (sim->RUN_FLAG == FALSE) {
+		printf("Simulation Stopped\n\n");
+		return;
+	}
+
+	printf("Running simulator for %llu cycles...\n\n", (unsigned long long)num_cycles);
+	uint64_t i;
+	uint64_t start_instructions = sim->INSTRUCTION_COUNT;
+	double start = host_seconds();
+	for (i = 0; i < num_cycles; i++) {
+		if (sim->RUN_FLAG == FALSE) {
+			printf("Simulation Stopped.\n\n");
+			break;
+		}
+		cycle(sim);
+	}
+	report_host_rate(i, sim->INSTRUCTION_COUNT - start_instructions, host_seconds() - start);
+}
+
+/***************************************************************/
+/* Host wall-clock time in seconds                                                                               */
+/***************************************************************/
+double host_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/***************************************************************/
+/* Print simulated throughput for a run                                                                         */
+/***************************************************************/
+void report_host_rate(uint64_t cycles, uint64_t instructions, double seconds) {
+	if (seconds <= 0) {
+		return;
+	}
+	if (cycles == 0) { // functional runs have no cycles
+		printf("Simulated %llu instructions in %.3f s: %.2f MIPS\n\n", (unsigned long long)instructions, seconds, instructions / seconds / 1e6);
+		return;
+	}
+	printf("Simulated %llu cycles (%llu instructions) in %.3f s: %.2f Mcycles/s, %.2f MIPS\n\n",
+		(unsigned long long)cycles, (unsigned long long)instructions, seconds, cycles / seconds / 1e6, instructions / seconds / 1e6);
+}
+
+/***************************************************************/
+/* simulate to completion                                                                                               */
+/***************************************************************/
+void runAll(MIPS_Sim* sim) {                                                     
+	if (sim->RUN_FLAG == FALSE) {
+		printf("Simulation Stopped.\n\n");
+		return;
+	}
+
+	printf("Simulation Started...\n\n");
+	uint64_t start_cycles = sim->CYCLE_COUNT;
+	uint64_t start_instructions = sim->INSTRUCTION_COUNT;
+	double start = host_seconds();
+	while (sim->RUN_FLAG){
+		cycle(sim);
+	}
+	printf("Simulation Finished.\n\n");
+	report_host_rate(sim->CYCLE_COUNT - start_cycles, sim->INSTRUCTION_COUNT - start_instructions, host_seconds() - start);
+}
+
+/***************************************************************/ 
+/* Dump a word-aligned region of memory to the terminal                              */
+/***************************************************************/
+void mdump(MIPS_Sim* sim, uint32_t start, uint32_t stop) {          
+	uint32_t address;
+
+	printf("-------------------------------------------------------------\n");
+	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
+	printf("-------------------------------------------------------------\n");
+	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
+	for (address = start; address <= stop; address += 4){
+		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(sim, address));
+	}
+	printf("\n");
+}
+
+/***************************************************************/
+/* Dump current values of registers to the teminal                                              */   
+/***************************************************************/
+void rdump(MIPS_Sim* sim) {                               
+	int i; 
+	printf("-------------------------------------\n");
+	printf("Dumping Register Content\n");
+	printf("-------------------------------------\n");
+	if (sim->SYSTEM != NULL) {
+		printf("Core\t\t\t: %d of %d\n", sim->CORE_ID, sim->SYSTEM->NUM_CORES);
+	}
+	if (sim->ISSUE_WIDTH > 1) {
+		printf("Issue Width\t\t: %u\n", sim->ISSUE_WIDTH);
+	}
+	printf("# Instructions Executed\t: %llu\n", (unsigned long long)sim->INSTRUCTION_COUNT);
+	printf("# Cycles Executed\t: %llu\n", (unsigned long long)sim->CYCLE_COUNT);
+	printf("# Fast-Forwarded\t: %llu\n", (unsigned long long)sim->FF_INSTRUCTION_COUNT);
+	printf("# Stall Cycles\t\t: %llu\n", (unsigned long long)sim->STALL_COUNT);
+	printf("# Bubbles\t\t: %llu\n", (unsigned long long)sim->BUBBLE_COUNT);
+	printf("# Forwards\t\t: %llu%s\n", (unsigned long long)sim->FORWARD_COUNT, sim->FORWARDING ? "" : " (forwarding off)");
+	printf("PC\t: 0x%08x\n", sim->CURRENT_STATE.PC);
+	printf("-------------------------------------\n");
+	printf("[Register]\t[Value]\n");
+	printf("-------------------------------------\n");
+	for (i = 0; i < MIPS_REGS; i++){
+		printf("[R%d]\t: 0x%08x\n", i, sim->CURRENT_STATE.REGS[i]);
+	}
+	printf("-------------------------------------\n");
+	printf("[HI]\t: 0x%08x\n", sim->CURRENT_STATE.HI);
+	printf("[LO]\t: 0x%08x\n", sim->CURRENT_STATE.LO);
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Performance counters: names for the report                                                       */
+/***************************************************************/
+static const char* const OP_NAMES[NUM_OPS] = {
+	[OP_NOP] = "nop", [OP_INVALID] = "invalid",
+	[OP_SLL] = "sll", [OP_SRL] = "srl", [OP_SRA] = "sra", [OP_JR] = "jr", [OP_JALR] = "jalr", [OP_SYSCALL] = "syscall",
+	[OP_MFHI] = "mfhi", [OP_MTHI] = "mthi", [OP_MFLO] = "mflo", [OP_MTLO] = "mtlo",
+	[OP_MULT] = "mult", [OP_MULTU] = "multu", [OP_DIV] = "div", [OP_DIVU] = "divu",
+	[OP_ADD] = "add", [OP_ADDU] = "addu", [OP_SUB] = "sub", [OP_SUBU] = "subu",
+	[OP_AND] = "and", [OP_OR] = "or", [OP_XOR] = "xor", [OP_NOR] = "nor", [OP_SLT] = "slt",
+	[OP_J] = "j", [OP_JAL] = "jal",
+	[OP_BLTZ] = "bltz", [OP_BGEZ] = "bgez", [OP_BEQ] = "beq", [OP_BNE] = "bne", [OP_BLEZ] = "blez", [OP_BGTZ] = "bgtz",
+	[OP_ADDI] = "addi", [OP_ADDIU] = "addiu", [OP_SLTI] = "slti", [OP_ANDI] = "andi", [OP_ORI] = "ori", [OP_XORI] = "xori",
+	[OP_LUI] = "lui",
+	[OP_LB] = "lb", [OP_LH] = "lh", [OP_LW] = "lw", [OP_SB] = "sb", [OP_SH] = "sh", [OP_SW] = "sw",
+	[OP_LL] = "ll", [OP_SC] = "sc",
+};
+
+static const char* const STALL_NAMES[NUM_STALL_CAUSES] = {
+	[STALL_LOAD_USE] = "load_use",
+	[STALL_NO_FORWARD] = "no_forward",
+	[STALL_ICACHE] = "icache_miss",
+	[STALL_DCACHE] = "dcache_miss",
+};
+
+static const char* const STAGE_NAMES[PIPELINE_DEPTH] = { "IF", "ID", "EX", "MEM", "WB" };
+
+static const char* const ISSUE_NAMES[NUM_ISSUE_LIMITS] = {
+	[ISSUE_EMPTY] = "empty",
+	[ISSUE_OPERAND] = "operand",
+	[ISSUE_MEMORY] = "memory",
+	[ISSUE_DEPENDENCY] = "dependency",
+	[ISSUE_CONTROL] = "control",
+	[ISSUE_HELD] = "held",
+};
+
+/* loads and stores are summed from the per-opcode counts, so they cost nothing per cycle */
+static uint64_t perf_loads(const perf_counters_t* perf)
+{
+	return perf->RETIRED_OP[OP_LB] + perf->RETIRED_OP[OP_LH] + perf->RETIRED_OP[OP_LW] + perf->RETIRED_OP[OP_LL];
+}
+
+static uint64_t perf_stores(const perf_counters_t* perf)
+{
+	return perf->RETIRED_OP[OP_SB] + perf->RETIRED_OP[OP_SH] + perf->RETIRED_OP[OP_SW] + perf->RETIRED_OP[OP_SC];
+}
+
+/***************************************************************/
+/* Turn the detailed counters on or off; turning them on starts a new window */
+/***************************************************************/
+void perf_enable(MIPS_Sim* sim, int enabled) {
+	if (enabled && !sim->PERF.ENABLED) {
+		perf_clear(sim);
+	}
+	sim->PERF.ENABLED = enabled;
+}
+
+/***************************************************************/
+/* Zero the detailed counters, keeping whether they are collected             */
+/***************************************************************/
+void perf_clear(MIPS_Sim* sim) {
+	int enabled = sim->PERF.ENABLED;
+	memset(&sim->PERF, 0, sizeof(sim->PERF));
+	sim->PERF.ENABLED = enabled;
+}
+
+/***************************************************************/
+/* End of a cycle: how many instructions each stage holds (WB counts in WB) */
+/***************************************************************/
+void perf_sample(MIPS_Sim* sim) {
+	uint32_t k;
+
+	sim->PERF.CYCLES++;
+	for (k = 0; k < sim->ISSUE_WIDTH; k++) {
+		sim->PERF.OCCUPANCY[STAGE_IF] += sim->IF_ID[k].VALID;
+		sim->PERF.OCCUPANCY[STAGE_ID] += sim->ID_EX[k].VALID;
+		sim->PERF.OCCUPANCY[STAGE_EX] += sim->EX_MEM[k].VALID;
+		sim->PERF.OCCUPANCY[STAGE_MEM] += sim->MEM_WB[k].VALID;
+	}
+}
+
+/***************************************************************/
+/* Print the counters of one core                                                                         */
+/***************************************************************/
+void perf_report(MIPS_Sim* sim, FILE* fp) {
+	const perf_counters_t* perf = &sim->PERF;
+	uint64_t retired;
+	int i;
+
+	fprintf(fp, "-------------------------------------------------------------\n");
+	if (sim->SYSTEM != NULL) {
+		fprintf(fp, "Performance Counters, core %d of %d\n", sim->CORE_ID, sim->SYSTEM->NUM_CORES);
+	} else {
+		fprintf(fp, "Performance Counters\n");
+	}
+	fprintf(fp, "-------------------------------------------------------------\n");
+	fprintf(fp, "# Cycles\t\t: %llu\n", (unsigned long long)sim->CYCLE_COUNT);
+	fprintf(fp, "# Retired\t\t: %llu\n", (unsigned long long)sim->INSTRUCTION_COUNT);
+	if (sim->INSTRUCTION_COUNT > 0) {
+		fprintf(fp, "CPI\t\t\t: %.3f\n", (double)sim->CYCLE_COUNT / sim->INSTRUCTION_COUNT);
+	}
+	fprintf(fp, "# Stall Cycles\t\t: %llu\n", (unsigned long long)sim->STALL_COUNT);
+	fprintf(fp, "# Bubbles\t\t: %llu\n", (unsigned long long)sim->BUBBLE_COUNT);
+	fprintf(fp, "# Forwards\t\t: %llu\n", (unsigned long long)sim->FORWARD_COUNT);
+	if (sim->ICACHE.ENABLED || sim->DCACHE.ENABLED) {
+		fprintf(fp, "-------------------------------------------------------------\n");
+		cache_report(&sim->ICACHE, "I-cache", fp);
+		cache_report(&sim->DCACHE, "D-cache", fp);
+	}
+	fprintf(fp, "-------------------------------------------------------------\n");
+	bpred_report(&sim->BPRED, fp);
+	fprintf(fp, "-------------------------------------------------------------\n");
+	if (!perf->ENABLED && perf->CYCLES == 0) {
+		fprintf(fp, "Detailed counters are off ('stats on' or --perf).\n\n");
+		return;
+	}
+
+	retired = perf->RETIRED;
+	fprintf(fp, "Since the detailed counters were started%s:\n", perf->ENABLED ? "" : " (now off)");
+	fprintf(fp, "# Cycles\t\t: %llu\n", (unsigned long long)perf->CYCLES);
+	fprintf(fp, "# Retired\t\t: %llu\n", (unsigned long long)retired);
+	if (retired > 0) {
+		fprintf(fp, "CPI\t\t\t: %.3f\n", (double)perf->CYCLES / retired);
+	}
+	fprintf(fp, "# Loads\t\t\t: %llu\n", (unsigned long long)perf_loads(perf));
+	fprintf(fp, "# Stores\t\t: %llu\n", (unsigned long long)perf_stores(perf));
+	for (i = 0; i < NUM_STALL_CAUSES; i++) {
+		fprintf(fp, "# Stalls (%s)\t: %llu\n", STALL_NAMES[i], (unsigned long long)perf->STALLS[i]);
+	}
+	fprintf(fp, "-------------------------------------------------------------\n");
+	fprintf(fp, "[Stage]\t[Occupied]\t[%%]\n");
+	for (i = 0; i < PIPELINE_DEPTH; i++) {
+		uint64_t n = (i == STAGE_WB) ? retired : perf->OCCUPANCY[i];
+		fprintf(fp, "%s\t%llu\t\t%.1f\n", STAGE_NAMES[i], (unsigned long long)n, perf->CYCLES ? 100.0 * n / perf->CYCLES : 0.0);
+	}
+	if (sim->ISSUE_WIDTH > 1) {
+		uint64_t issued = 0;
+		for (i = 1; i <= (int)sim->ISSUE_WIDTH; i++) {
+			issued += i * perf->ISSUED[i];
+		}
+		fprintf(fp, "-------------------------------------------------------------\n");
+		fprintf(fp, "Issue width %u, %.3f issued per cycle, %.1f%% of the slots used\n", sim->ISSUE_WIDTH,
+			perf->CYCLES ? (double)issued / perf->CYCLES : 0.0, perf->CYCLES ? 100.0 * issued / (perf->CYCLES * sim->ISSUE_WIDTH) : 0.0);
+		fprintf(fp, "[Issued]\t[Cycles]\t[%%]\n");
+		for (i = 0; i <= (int)sim->ISSUE_WIDTH; i++) {
+			fprintf(fp, "%d\t\t%llu\t\t%.1f\n", i, (unsigned long long)perf->ISSUED[i],
+				perf->CYCLES ? 100.0 * perf->ISSUED[i] / perf->CYCLES : 0.0);
+		}
+		fprintf(fp, "[Empty Slots]\t[Slots]\t\t[%%]\n");
+		for (i = 0; i < NUM_ISSUE_LIMITS; i++) {
+			fprintf(fp, "%-10s\t%llu\t\t%.1f\n", ISSUE_NAMES[i], (unsigned long long)perf->EMPTY_SLOTS[i],
+				perf->CYCLES ? 100.0 * perf->EMPTY_SLOTS[i] / (perf->CYCLES * sim->ISSUE_WIDTH) : 0.0);
+		}
+	}
+	fprintf(fp, "-------------------------------------------------------------\n");
+	fprintf(fp, "[Instruction]\t[Retired]\t[%%]\n");
+	for (i = 0; i < NUM_OPS; i++) {
+		if (perf->RETIRED_OP[i] == 0) {
+			continue;
+		}
+		fprintf(fp, "%s\t\t%llu\t\t%.1f\n", OP_NAMES[i], (unsigned long long)perf->RETIRED_OP[i],
+			100.0 * perf->RETIRED_OP[i] / retired);
+	}
+	fprintf(fp, "-------------------------------------------------------------\n\n");
+}
+
+/***************************************************************/
+/* Write the counters of every core to a file                                                     */
+/***************************************************************/
+int perf_dump(MIPS_Sim* sim, const char* path) {
+	int num_cores = sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1;
+	FILE* fp = fopen(path, "w");
+	int i;
+
+	if (fp == NULL) {
+		printf("Error: Can't create stats file %s\n", path);
+		return FALSE;
+	}
+	for (i = 0; i < num_cores; i++) {
+		perf_report(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim, fp);
+	}
+	if (fclose(fp) != 0) {
+		printf("Error: Can't write stats file %s\n", path);
+		return FALSE;
+	}
+	printf("Performance counters written to %s\n\n", path);
+	return TRUE;
+}
+
+/***************************************************************/
+/* stats [on|off|clear|<file>]: the argument is optional, so read the line */
+/***************************************************************/
+void stats_command(MIPS_Sim* sim, FILE* in) {
+	char line[256];
+	char arg[256];
+	int num_cores = sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1;
+	int i;
+
+	if (fgets(line, sizeof(line), in) == NULL || sscanf(line, "%255s", arg) != 1) {
+		perf_report(sim, stdout);
+		return;
+	}
+	if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) {
+		for (i = 0; i < num_cores; i++) {
+			perf_enable(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim, arg[1] == 'n');
+		}
+		printf("Detailed performance counters %s.\n", arg[1] == 'n' ? "on" : "off");
+	} else if (strcmp(arg, "clear") == 0) {
+		for (i = 0; i < num_cores; i++) {
+			perf_clear(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim);
+		}
+		printf("Detailed performance counters cleared.\n");
+	} else {
+		perf_dump(sim, arg);
+	}
+}
+
+/***************************************************************/
+/* Write out the records buffered since the last write                                         */
+/***************************************************************/
+static void trace_write(trace_t* trace, const trace_record_t* records, uint32_t n) {
+	if (n > 0 && fwrite(records, sizeof(trace_record_t), n, trace->FP) != n) {
+		printf("Error: Can't write trace file %s, tracing stopped\n", trace->PATH);
+		trace->ENABLED = FALSE;
+	}
+}
+
+/***************************************************************/
+/* Start tracing a core to path: streamed, or only the last ring cycles       */
+/***************************************************************/
+int trace_start(MIPS_Sim* sim, const char* path, uint32_t ring) {
+	trace_t* trace = &sim->TRACE;
+	trace_header_t header;
+
+	trace_stop(sim);
+	trace->CAPACITY = ring > 0 ? ring : TRACE_BUFFER;
+	trace->RECORDS = malloc((size_t)trace->CAPACITY * sizeof(trace_record_t));
+	if (trace->RECORDS == NULL) {
+		printf("Error: Out of memory for a trace of %u cycles\n", trace->CAPACITY);
+		return FALSE;
+	}
+	trace->FP = fopen(path, "wb");
+	if (trace->FP == NULL) {
+		printf("Error: Can't create trace file %s\n", path);
+		free(trace->RECORDS);
+		memset(trace, 0, sizeof(*trace));
+		return FALSE;
+	}
+	snprintf(trace->PATH, sizeof(trace->PATH), "%s", path);
+	trace->RING = ring > 0;
+	trace->HEAD = 0;
+	trace->WRAPPED = FALSE;
+	trace->RECORDED = 0;
+	trace->LAST_MISPREDICTS = sim->BPRED.MISPREDICTS;
+	trace->LAST_REDIRECTS = sim->BPRED.MISPREDICTS + sim->BPRED.ID_REDIRECTS;
+	trace->LAST_EXITING = sim->EXITING;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(trace_record_t);
+	header.core = sim->CORE_ID;
+	header.ring = ring;
+	trace->ENABLED = TRUE;
+	if (fwrite(&header, sizeof(header), 1, trace->FP) != 1) {
+		printf("Error: Can't write trace file %s\n", path);
+		trace_stop(sim);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/***************************************************************/
+/* Stop tracing: write what is buffered (the ring oldest first) and close     */
+/***************************************************************/
+void trace_stop(MIPS_Sim* sim) {
+	trace_t* trace = &sim->TRACE;
+	uint64_t kept;
+
+	if (trace->FP == NULL) {
+		return;
+	}
+	if (trace->ENABLED && trace->WRAPPED) {
+		trace_write(trace, trace->RECORDS + trace->HEAD, trace->CAPACITY - trace->HEAD);
+	}
+	if (trace->ENABLED) {
+		trace_write(trace, trace->RECORDS, trace->HEAD);
+	}
+	kept = trace->RING && trace->RECORDED > trace->CAPACITY ? trace->CAPACITY : trace->RECORDED;
+	if (fclose(trace->FP) != 0) {
+		printf("Error: Can't write trace file %s\n", trace->PATH);
+	} else if (trace->ENABLED) {
+		printf("Pipeline trace: %llu of %llu cycles written to %s\n\n", (unsigned long long)kept,
+			(unsigned long long)trace->RECORDED, trace->PATH);
+	}
+	free(trace->RECORDS);
+	memset(trace, 0, sizeof(*trace));
+}
+
+/***************************************************************/
+/* Record the pipeline registers as this cycle leaves them (the oldest slot)  */
+/***************************************************************/
+void trace_sample(MIPS_Sim* sim) {
+	trace_t* trace = &sim->TRACE;
+	trace_record_t* r = &trace->RECORDS[trace->HEAD];
+	const CPU_Pipeline_Reg* latch[NUM_LATCHES] = { sim->IF_ID, sim->ID_EX, sim->EX_MEM, sim->MEM_WB };
+	uint64_t mispredicts = sim->BPRED.MISPREDICTS;
+	uint64_t redirects = mispredicts + sim->BPRED.ID_REDIRECTS;
+	int exit_flush = sim->EXITING && !trace->LAST_EXITING;
+	int i;
+
+	r->cycle = sim->CYCLE_COUNT + 1; // cycle() counts this one after sampling
+	r->retired = sim->INSTRUCTION_COUNT;
+	r->fetch_pc = sim->NEXT_STATE.PC;
+	r->valid = r->pred_taken = 0;
+	for (i = 0; i < NUM_LATCHES; i++) {
+		r->pc[i] = latch[i]->VALID ? latch[i]->PC - 4 : 0;
+		r->ir[i] = latch[i]->VALID ? latch[i]->IR : 0;
+		r->valid |= (latch[i]->VALID != 0) << i;
+		r->pred_taken |= (latch[i]->VALID && latch[i]->PRED_TAKEN) << i;
+	}
+	r->flags = (sim->HAZARD_STALL ? TRACE_STALL_HAZARD : 0) |
+		(sim->MEM_STALL ? TRACE_STALL_MEM : 0) |
+		(sim->FETCH_FILLED ? TRACE_STALL_FETCH : 0) |
+		(mispredicts != trace->LAST_MISPREDICTS || exit_flush ? TRACE_FLUSH : 0) |
+		(redirects != trace->LAST_REDIRECTS || exit_flush ? TRACE_REDIRECT : 0) |
+		(!sim->FETCH_ENABLED || sim->EXITING ? TRACE_NO_FETCH : 0);
+	r->pad = 0;
+	trace->LAST_MISPREDICTS = mispredicts;
+	trace->LAST_REDIRECTS = redirects;
+	trace->LAST_EXITING = sim->EXITING;
+	trace->RECORDED++;
+
+	if (++trace->HEAD == trace->CAPACITY) {
+		trace->HEAD = 0;
+		if (trace->RING) {
+			trace->WRAPPED = TRUE;
+		} else {
+			trace_write(trace, trace->RECORDS, trace->CAPACITY);
+		}
+	}
+}
+
+/***************************************************************/
+/* Trace every core; with several, core i writes to <path>.<i>                         */
+/***************************************************************/
+static int trace_start_all(MIPS_Sim* sim, const char* path, uint32_t ring) {
+	char core_path[272];
+	int i;
+
+	if (sim->SYSTEM == NULL) {
+		return trace_start(sim, path, ring);
+	}
+	for (i = 0; i < sim->SYSTEM->NUM_CORES; i++) {
+		snprintf(core_path, sizeof(core_path), "%s.%d", path, i);
+		if (!trace_start(sim->SYSTEM->CORES[i], core_path, ring)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/***************************************************************/
+/* trace [<file> [<ring cycles>] | off]: the arguments are optional             */
+/***************************************************************/
+void trace_command(MIPS_Sim* sim, FILE* in) {
+	char line[512];
+	char path[256];
+	uint32_t ring = 0;
+	int num_cores = sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1;
+	int i;
+
+	if (fgets(line, sizeof(line), in) == NULL || sscanf(line, "%255s %u", path, &ring) < 1) {
+		if (!sim->TRACE.ENABLED) {
+			printf("Pipeline trace off.\n\n");
+		} else if (sim->TRACE.RING) {
+			printf("Pipeline trace: last %u cycles kept for %s, %llu recorded.\n\n", sim->TRACE.CAPACITY,
+				sim->TRACE.PATH, (unsigned long long)sim->TRACE.RECORDED);
+		} else {
+			printf("Pipeline trace: streaming to %s, %llu cycles recorded.\n\n", sim->TRACE.PATH,
+				(unsigned long long)sim->TRACE.RECORDED);
+		}
+		return;
+	}
+	if (strcmp(path, "off") == 0) {
+		for (i = 0; i < num_cores; i++) {
+			trace_stop(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim);
+		}
+		return;
+	}
+	trace_start_all(sim, path, ring);
+}
+
+/***************************************************************/
+/* Pipeline view. An instruction in a latch at the end of a cycle is in the  */
+/* stage behind that latch during the next one, stalled if it stays put;     */
+/* one that leaves MEM/WB retires, one that leaves any other latch is squashed. */
+/***************************************************************/
+static const char* const PIPEVIEW_STAGES[2][PIPELINE_DEPTH] = {
+	{ "IF", "ID", "EX", "MEM", "WB" },
+	{ "IF", "ID_stall", "EX_stall", "MEM_stall", "WB" }
+};
+
+/* Konata: advance the cycle cursor */
+static void pipeview_at(pipeview_t* pv, uint64_t cycle) {
+	if (cycle > pv->CURSOR) {
+		fprintf(pv->FP, "C\t%llu\n", (unsigned long long)(cycle - pv->CURSOR));
+		pv->CURSOR = cycle;
+	}
+}
+
+static void pipeview_begin_stage(MIPS_Sim* sim, pipeview_entry_t* e, int stage, int stalled, uint64_t cycle) {
+	pipeview_t* pv = &sim->PIPEVIEW;
+
+	e->stage = stage;
+	e->stalled = stalled;
+	e->start = cycle;
+	if (pv->FORMAT == PIPEVIEW_KONATA) {
+		pipeview_at(pv, cycle);
+		fprintf(pv->FP, "S\t%llu\t0\t%s\n", (unsigned long long)e->id, PIPEVIEW_STAGES[stalled][stage]);
+	}
+}
+
+static void pipeview_end_stage(MIPS_Sim* sim, pipeview_entry_t* e, uint64_t cycle) {
+	pipeview_t* pv = &sim->PIPEVIEW;
+	const char* name;
+
+	if (e->stage >= PIPELINE_DEPTH) {
+		return; // already in flight when the view started, no stage shown yet
+	}
+	name = PIPEVIEW_STAGES[e->stalled][e->stage];
+	if (pv->FORMAT == PIPEVIEW_KONATA) {
+		pipeview_at(pv, cycle);
+		fprintf(pv->FP, "E\t%llu\t0\t%s\n", (unsigned long long)e->id, name);
+	} else {
+		fprintf(pv->FP, "%s\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%u,"
+			"\"args\":{\"seq\":%llu,\"pc\":\"0x%08x\",\"op\":\"%s\"}}", pv->EVENTS++ ? "," : "", name,
+			(unsigned long long)e->start, (unsigned long long)(cycle - e->start), sim->CORE_ID,
+			(unsigned)(e->seq % PIPEVIEW_SLOTS), (unsigned long long)e->seq, e->pc, OP_NAMES[e->op]);
+	}
+}
+
+/* the stage an instruction is in during cycle, if it changed */
+static void pipeview_show(MIPS_Sim* sim, pipeview_entry_t* e, int stage, int stalled, uint64_t cycle) {
+	if (e->stage == stage && e->stalled == stalled) {
+		return;
+	}
+	pipeview_end_stage(sim, e, cycle);
+	pipeview_begin_stage(sim, e, stage, stalled, cycle);
+}
+
+/* start following the instruction in a latch */
+static void pipeview_enter(MIPS_Sim* sim, pipeview_entry_t* e, const CPU_Pipeline_Reg* reg, int latch) {
+	pipeview_t* pv = &sim->PIPEVIEW;
+
+	e->seq = reg->SEQ;
+	e->id = pv->NEXT_ID++;
+	e->pc = reg->PC - 4;
+	e->op = reg->D.op;
+	e->latch = latch;
+	e->stage = PIPELINE_DEPTH;
+	if (pv->FORMAT == PIPEVIEW_KONATA) {
+		fprintf(pv->FP, "I\t%llu\t%llu\t%d\n", (unsigned long long)e->id, (unsigned long long)e->seq, sim->CORE_ID);
+		fprintf(pv->FP, "L\t%llu\t0\t%08x %s\n", (unsigned long long)e->id, e->pc, OP_NAMES[e->op]);
+		fprintf(pv->FP, "L\t%llu\t1\tword 0x%08x\n", (unsigned long long)e->id, reg->IR);
+	}
+}
+
+/* it left the pipeline at the start of cycle */
+static void pipeview_leave(MIPS_Sim* sim, pipeview_entry_t* e, int flushed, uint64_t cycle) {
+	pipeview_t* pv = &sim->PIPEVIEW;
+
+	pipeview_end_stage(sim, e, cycle);
+	if (pv->FORMAT == PIPEVIEW_KONATA) {
+		fprintf(pv->FP, "R\t%llu\t%llu\t%d\n", (unsigned long long)e->id,
+			(unsigned long long)(flushed ? e->id : pv->RETIRED++), flushed);
+	} else if (flushed) {
+		fprintf(pv->FP, ",\n{\"name\":\"flush\",\"cat\":\"flush\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%d,\"tid\":%u,"
+			"\"args\":{\"seq\":%llu,\"pc\":\"0x%08x\"}}", (unsigned long long)cycle, sim->CORE_ID,
+			(unsigned)(e->seq % PIPEVIEW_SLOTS), (unsigned long long)e->seq, e->pc);
+	}
+	e->seq = 0;
+}
+
+/***************************************************************/
+/* Start the pipeline view of a core; what is in flight is picked up as is    */
+/***************************************************************/
+int pipeview_start(MIPS_Sim* sim, const char* path, pipeview_format_t format) {
+	pipeview_t* pv = &sim->PIPEVIEW;
+	const CPU_Pipeline_Reg* latch[NUM_LATCHES] = { sim->IF_ID, sim->ID_EX, sim->EX_MEM, sim->MEM_WB };
+	int i, k;
+
+	pipeview_stop(sim);
+	pv->FP = fopen(path, "w");
+	if (pv->FP == NULL) {
+		printf("Error: Can't create pipeline view file %s\n", path);
+		return FALSE;
+	}
+	snprintf(pv->PATH, sizeof(pv->PATH), "%s", path);
+	pv->FORMAT = format;
+	pv->NOW = pv->CURSOR = (uint64_t)sim->CYCLE_COUNT + 1; // numbered like the trace records
+	pv->NEXT_ID = pv->RETIRED = pv->EVENTS = 0;
+	if (format == PIPEVIEW_KONATA) {
+		fprintf(pv->FP, "Kanata\t0004\nC=\t%llu\n", (unsigned long long)pv->NOW);
+	} else {
+		fprintf(pv->FP, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+		fprintf(pv->FP, "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"core %d (1 us = 1 cycle)\"}}",
+			sim->CORE_ID, sim->CORE_ID);
+		pv->EVENTS++;
+	}
+	for (i = 0; i < NUM_LATCHES; i++) {
+		for (k = 0; k < MAX_ISSUE_WIDTH && latch[i][k].VALID; k++) {
+			pipeview_enter(sim, &pv->SLOTS[i * MAX_ISSUE_WIDTH + k], &latch[i][k], i);
+		}
+	}
+	pv->ENABLED = TRUE;
+	return TRUE;
+}
+
+/***************************************************************/
+/* Close the stages still open and finish the file                                           */
+/***************************************************************/
+void pipeview_stop(MIPS_Sim* sim) {
+	pipeview_t* pv = &sim->PIPEVIEW;
+	int i;
+
+	if (pv->FP == NULL) {
+		return;
+	}
+	for (i = 0; i < PIPEVIEW_SLOTS; i++) {
+		if (pv->SLOTS[i].seq != 0) {
+			pipeview_end_stage(sim, &pv->SLOTS[i], pv->NOW);
+		}
+	}
+	if (pv->FORMAT == PIPEVIEW_CHROME) {
+		fprintf(pv->FP, "\n]}\n");
+	}
+	if (fclose(pv->FP) != 0) {
+		printf("Error: Can't write pipeline view file %s\n", pv->PATH);
+	} else {
+		printf("Pipeline view: %llu instructions written to %s\n\n", (unsigned long long)pv->NEXT_ID, pv->PATH);
+	}
+	memset(pv, 0, sizeof(*pv));
+}
+
+/***************************************************************/
+/* Follow every instruction through the cycle that just ended                       */
+/***************************************************************/
+void pipeview_sample(MIPS_Sim* sim) {
+	pipeview_t* pv = &sim->PIPEVIEW;
+	const CPU_Pipeline_Reg* latch[NUM_LATCHES] = { sim->IF_ID, sim->ID_EX, sim->EX_MEM, sim->MEM_WB };
+	const CPU_Pipeline_Reg* reg;
+	uint8_t seen[PIPEVIEW_SLOTS] = { 0 };
+	uint64_t cycle = pv->NOW++;
+	pipeview_entry_t* e;
+	int i, j, k;
+
+	for (i = 0; i < NUM_LATCHES; i++) {
+		for (k = 0; k < MAX_ISSUE_WIDTH && latch[i][k].VALID; k++) {
+			reg = &latch[i][k];
+			for (j = 0; j < PIPEVIEW_SLOTS && pv->SLOTS[j].seq != reg->SEQ; j++);
+			if (j < PIPEVIEW_SLOTS) {
+				e = &pv->SLOTS[j];
+				pipeview_show(sim, e, e->latch + 1, e->latch == i, cycle);
+				e->latch = i;
+			} else {
+				// fetched this cycle
+				for (j = 0; j < PIPEVIEW_SLOTS && pv->SLOTS[j].seq != 0; j++);
+				if (j == PIPEVIEW_SLOTS) {
+					continue;
+				}
+				e = &pv->SLOTS[j];
+				pipeview_enter(sim, e, reg, i);
+				pipeview_begin_stage(sim, e, STAGE_IF, FALSE, cycle);
+			}
+			seen[j] = TRUE;
+		}
+	}
+
+	// the rest spent this cycle in WB, or were squashed in ID or EX
+	for (j = 0; j < PIPEVIEW_SLOTS; j++) {
+		if (pv->SLOTS[j].seq != 0 && !seen[j]) {
+			pipeview_show(sim, &pv->SLOTS[j], pv->SLOTS[j].latch + 1, FALSE, cycle);
+		}
+	}
+	for (j = 0; j < PIPEVIEW_SLOTS; j++) {
+		if (pv->SLOTS[j].seq != 0 && !seen[j]) {
+			pipeview_leave(sim, &pv->SLOTS[j], pv->SLOTS[j].latch != LATCH_MEM_WB, cycle + 1);
+		}
+	}
+}
+
+/***************************************************************/
+/* View every core; with several, core i writes to <path>.<i>                          */
+/***************************************************************/
+static int pipeview_start_all(MIPS_Sim* sim, const char* path, pipeview_format_t format) {
+	char core_path[272];
+	int i;
+
+	if (sim->SYSTEM == NULL) {
+		return pipeview_start(sim, path, format);
+	}
+	for (i = 0; i < sim->SYSTEM->NUM_CORES; i++) {
+		snprintf(core_path, sizeof(core_path), "%s.%d", path, i);
+		if (!pipeview_start(sim->SYSTEM->CORES[i], core_path, format)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Chrome trace events for a .json file, Konata otherwise */
+static pipeview_format_t pipeview_format_of(const char* path) {
+	size_t len = strlen(path);
+	return len >= 5 && strcasecmp(path + len - 5, ".json") == 0 ? PIPEVIEW_CHROME : PIPEVIEW_KONATA;
+}
+
+/***************************************************************/
+/* pipeview [<file> [konata|chrome] | off]                                                     */
+/***************************************************************/
+void pipeview_command(MIPS_Sim* sim, FILE* in) {
+	char line[512];
+	char path[256];
+	char format[16];
+	int num_cores = sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1;
+	int args, i;
+
+	args = fgets(line, sizeof(line), in) == NULL ? 0 : sscanf(line, "%255s %15s", path, format);
+	if (args < 1) {
+		if (sim->PIPEVIEW.ENABLED) {
+			printf("Pipeline view: %llu instructions so far to %s.\n\n",
+				(unsigned long long)sim->PIPEVIEW.NEXT_ID, sim->PIPEVIEW.PATH);
+		} else {
+			printf("Pipeline view off.\n\n");
+		}
+		return;
+	}
+	if (strcmp(path, "off") == 0) {
+		for (i = 0; i < num_cores; i++) {
+			pipeview_stop(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim);
+		}
+		return;
+	}
+	if (args == 2 && strcasecmp(format, "konata") != 0 && strcasecmp(format, "chrome") != 0) {
+		printf("Error: Unknown pipeline view format %s (konata or chrome)\n", format);
+		return;
+	}
+	pipeview_start_all(sim, path, args == 2 ? (strcasecmp(format, "chrome") == 0 ? PIPEVIEW_CHROME : PIPEVIEW_KONATA)
+		: pipeview_format_of(path));
+}
+
+/***************************************************************/
+/* Start or stop the per-PC profile; counts are kept until cleared              */
+/***************************************************************/
+int profile_enable(MIPS_Sim* sim, int enabled) {
+	profile_t* prof = &sim->PROFILE;
+
+	if (enabled && (prof->PCS == NULL || prof->SIZE != sim->PROGRAM_SIZE)) {
+		free(prof->PCS);
+		prof->SIZE = sim->PROGRAM_SIZE;
+		prof->PCS = calloc(prof->SIZE > 0 ? prof->SIZE : 1, sizeof(profile_entry_t));
+		if (prof->PCS == NULL) {
+			printf("Error: Out of memory for the profile of %u instructions\n", prof->SIZE);
+			prof->SIZE = 0;
+			prof->ENABLED = FALSE;
+			return FALSE;
+		}
+		memset(&prof->OUTSIDE, 0, sizeof(prof->OUTSIDE));
+	}
+	prof->LAST_MISPREDICTS = sim->BPRED.MISPREDICTS;
+	prof->LAST_ID_REDIRECTS = sim->BPRED.ID_REDIRECTS;
+	prof->ENABLED = enabled;
+	return TRUE;
+}
+
+void profile_clear(MIPS_Sim* sim) {
+	profile_t* prof = &sim->PROFILE;
+
+	if (prof->PCS != NULL) {
+		memset(prof->PCS, 0, prof->SIZE * sizeof(profile_entry_t));
+	}
+	memset(&prof->OUTSIDE, 0, sizeof(prof->OUTSIDE));
+}
+
+static profile_entry_t* profile_at(profile_t* prof, uint32_t pc) {
+	uint32_t index = (pc - MEM_TEXT_BEGIN) / 4;
+	return index < prof->SIZE ? &prof->PCS[index] : &prof->OUTSIDE;
+}
+
+/* the instruction of either class in a bundle (a bundle has at most one), else the oldest */
+static uint32_t profile_pc(const MIPS_Sim* sim, const CPU_Pipeline_Reg* latch, uint8_t class, uint8_t other) {
+	uint32_t i;
+	for (i = 0; i < sim->ISSUE_WIDTH; i++) {
+		if (latch[i].VALID && (latch[i].D.class == class || latch[i].D.class == other)) {
+			return latch[i].PC - 4;
+		}
+	}
+	return latch[0].PC - 4;
+}
+
+/***************************************************************/
+/* Charge the stalls and redirects of the cycle that just ended                       */
+/***************************************************************/
+void profile_sample(MIPS_Sim* sim) {
+	profile_t* prof = &sim->PROFILE;
+
+	if (sim->MEM_STALL) {
+		profile_at(prof, profile_pc(sim, sim->EX_MEM, CLASS_LOAD, CLASS_STORE))->stalls[STALL_DCACHE]++;
+	} else if (sim->HAZARD_STALL) {
+		profile_at(prof, sim->IF_ID[0].PC - 4)->stalls[sim->FORWARDING ? STALL_LOAD_USE : STALL_NO_FORWARD]++;
+	}
+	if (sim->FETCH_FILLED) {
+		profile_at(prof, sim->CURRENT_STATE.PC)->stalls[STALL_ICACHE]++;
+	}
+
+	// EX resolved a misprediction (the branch is in EX/MEM now) or ID redirected (in ID/EX)
+	if (sim->BPRED.MISPREDICTS != prof->LAST_MISPREDICTS) {
+		profile_at(prof, profile_pc(sim, sim->EX_MEM, CLASS_BRANCH, CLASS_JUMP))->penalty += 2;
+		prof->LAST_MISPREDICTS = sim->BPRED.MISPREDICTS;
+	}
+	if (sim->BPRED.ID_REDIRECTS != prof->LAST_ID_REDIRECTS) {
+		profile_at(prof, profile_pc(sim, sim->ID_EX, CLASS_BRANCH, CLASS_JUMP))->penalty += 1;
+		prof->LAST_ID_REDIRECTS = sim->BPRED.ID_REDIRECTS;
+	}
+}
+
+typedef struct {
+	uint32_t first, last;	/* word indexes */
+	uint64_t retired, stalls, penalty, cost;
+} profile_block_t;
+
+static uint64_t profile_stalls(const profile_entry_t* e) {
+	uint64_t n = 0;
+	int i;
+	for (i = 0; i < NUM_STALL_CAUSES; i++) {
+		n += e->stalls[i];
+	}
+	return n;
+}
+
+static int profile_block_compare(const void* a, const void* b) {
+	const profile_block_t* x = a;
+	const profile_block_t* y = b;
+	return x->cost < y->cost ? 1 : x->cost > y->cost ? -1 : (x->first > y->first) - (x->first < y->first);
+}
+
+/***************************************************************/
+/* Hot-spot report: basic blocks by cycles spent in them, with the code       */
+/***************************************************************/
+void profile_report(MIPS_Sim* sim, uint32_t max_blocks) {
+	profile_t* prof = &sim->PROFILE;
+	profile_block_t* blocks;
+	uint8_t* leader;
+	uint64_t total = 0, retired = 0, stalls = 0, penalty = 0;
+	uint32_t num_blocks = 0, i, j, target;
+	const Decoded_Instr* d;
+
+	if (prof->PCS == NULL) {
+		printf("Profiling is off ('profile on' or --profile).\n\n");
+		return;
+	}
+	leader = calloc(prof->SIZE + 1, 1);
+	blocks = calloc(prof->SIZE > 0 ? prof->SIZE : 1, sizeof(profile_block_t));
+	if (leader == NULL || blocks == NULL) {
+		printf("Error: Out of memory for the profile report\n");
+		free(leader);
+		free(blocks);
+		return;
+	}
+
+	// blocks start at the entry, at branch and jump targets, and after every control transfer
+	leader[0] = TRUE;
+	if (sim->MEMORY->ENTRY_PC - MEM_TEXT_BEGIN < 4 * prof->SIZE) {
+		leader[(sim->MEMORY->ENTRY_PC - MEM_TEXT_BEGIN) / 4] = TRUE;
+	}
+	for (i = 0; i < prof->SIZE; i++) {
+		d = fetch_decoded(sim, MEM_TEXT_BEGIN + 4 * i);
+		if (d->class == CLASS_BRANCH || d->class == CLASS_JUMP || d->class == CLASS_SYSCALL) {
+			leader[i + 1] = TRUE;
+		}
+		if (branch_direct_target(MEM_TEXT_BEGIN + 4 * i, d, &target) && target - MEM_TEXT_BEGIN < 4 * prof->SIZE) {
+			leader[(target - MEM_TEXT_BEGIN) / 4] = TRUE;
+		}
+	}
+	for (i = 0; i < prof->SIZE; i++) {
+		const profile_entry_t* e = &prof->PCS[i];
+		if (leader[i]) {
+			blocks[num_blocks].first = i;
+			num_blocks++;
+		}
+		blocks[num_blocks - 1].last = i;
+		blocks[num_blocks - 1].retired += e->retired;
+		blocks[num_blocks - 1].stalls += profile_stalls(e);
+		blocks[num_blocks - 1].penalty += e->penalty;
+	}
+	for (i = 0; i < num_blocks; i++) {
+		blocks[i].cost = blocks[i].retired + blocks[i].stalls + blocks[i].penalty;
+		total += blocks[i].cost;
+		retired += blocks[i].retired;
+		stalls += blocks[i].stalls;
+		penalty += blocks[i].penalty;
+	}
+	qsort(blocks, num_blocks, sizeof(profile_block_t), profile_block_compare);
+
+	printf("-------------------------------------------------------------\n");
+	if (sim->SYSTEM != NULL) {
+		printf("Profile, core %d of %d\n", sim->CORE_ID, sim->SYSTEM->NUM_CORES);
+	} else {
+		printf("Profile\n");
+	}
+	printf("-------------------------------------------------------------\n");
+	printf("# Retired\t\t: %llu\n", (unsigned long long)retired);
+	printf("# Stall Cycles\t\t: %llu\n", (unsigned long long)stalls);
+	printf("# Branch Penalty\t: %llu\n", (unsigned long long)penalty);
+	if (prof->OUTSIDE.retired + profile_stalls(&prof->OUTSIDE) + prof->OUTSIDE.penalty > 0) {
+		printf("# Outside the Text\t: %llu retired, %llu stall cycles\n", (unsigned long long)prof->OUTSIDE.retired,
+			(unsigned long long)profile_stalls(&prof->OUTSIDE));
+	}
+	printf("Cost is retirements plus stall cycles plus branch penalty, per block and per instruction.\n");
+	for (i = 0; i < num_blocks && i < max_blocks && blocks[i].cost > 0; i++) {
+		const profile_block_t* b = &blocks[i];
+		printf("-------------------------------------------------------------\n");
+		printf("Block 0x%08x-0x%08x\tcost %llu (%.1f%%), entered %llu times, CPI %.2f\n",
+			MEM_TEXT_BEGIN + 4 * b->first, MEM_TEXT_BEGIN + 4 * b->last, (unsigned long long)b->cost,
+			total ? 100.0 * b->cost / total : 0.0, (unsigned long long)prof->PCS[b->first].retired,
+			b->retired ? (double)b->cost / b->retired : 0.0);
+		printf("[PC]\t\t[Retired]\t[Stalls]\t[Penalty]\t[Instruction]\n");
+		for (j = b->first; j <= b->last; j++) {
+			const profile_entry_t* e = &prof->PCS[j];
+			printf("0x%08x\t%llu\t\t%llu\t\t%llu\t\t", MEM_TEXT_BEGIN + 4 * j, (unsigned long long)e->retired,
+				(unsigned long long)profile_stalls(e), (unsigned long long)e->penalty);
+			print_instruction(sim, MEM_TEXT_BEGIN + 4 * j);
+		}
+	}
+	printf("-------------------------------------------------------------\n\n");
+	free(leader);
+	free(blocks);
+}
+
+/***************************************************************/
+/* profile [on|off|clear|<blocks>]: the argument is optional                           */
+/***************************************************************/
+void profile_command(MIPS_Sim* sim, FILE* in) {
+	char line[256];
+	char arg[256];
+	int num_cores = sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1;
+	int i;
+
+	if (fgets(line, sizeof(line), in) == NULL || sscanf(line, "%255s", arg) != 1) {
+		profile_report(sim, PROFILE_DEFAULT_BLOCKS);
+		return;
+	}
+	if (strcmp(arg, "on") == 0 || strcmp(arg, "off") == 0) {
+		for (i = 0; i < num_cores; i++) {
+			profile_enable(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim, arg[1] == 'n');
+		}
+		printf("Profiling %s.\n", arg[1] == 'n' ? "on" : "off");
+	} else if (strcmp(arg, "clear") == 0) {
+		for (i = 0; i < num_cores; i++) {
+			profile_clear(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim);
+		}
+		printf("Profile cleared.\n");
+	} else {
+		profile_report(sim, strtoul(arg, NULL, 0));
+	}
+}
+
+/***************************************************************/
+/* simpoint [<spec>]: sampled run of the whole program from the start             */
+/***************************************************************/
+void simpoint_command(MIPS_Sim* sim, FILE* in) {
+	char line[256];
+	char arg[256];
+
+	if (fgets(line, sizeof(line), in) == NULL || sscanf(line, "%255s", arg) != 1) {
+		simpoint_run(sim, NULL);
+		return;
+	}
+	simpoint_run(sim, arg);
+}
+
+/***************************************************************/
+/* The detailed counters of one core as a JSON object                                      */
+/***************************************************************/
+static void perf_write_json(const perf_counters_t* perf, uint32_t width, FILE* fp) {
+	int i, first = TRUE;
+
+	fprintf(fp, "      \"perf\": {\n        \"cycles\": %llu,\n        \"retired\": %llu,\n",
+		(unsigned long long)perf->CYCLES, (unsigned long long)perf->RETIRED);
+	fprintf(fp, "        \"loads\": %llu,\n        \"stores\": %llu,\n        \"stalls\": {",
+		(unsigned long long)perf_loads(perf), (unsigned long long)perf_stores(perf));
+	for (i = 0; i < NUM_STALL_CAUSES; i++) {
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : " ", STALL_NAMES[i], (unsigned long long)perf->STALLS[i]);
+	}
+	fprintf(fp, " },\n        \"occupancy\": {");
+	for (i = 0; i < PIPELINE_DEPTH; i++) {
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : " ", STAGE_NAMES[i],
+			(unsigned long long)(i == STAGE_WB ? perf->RETIRED : perf->OCCUPANCY[i]));
+	}
+	fprintf(fp, " },\n        \"issued\": [");
+	for (i = 0; i <= (int)width; i++) {
+		fprintf(fp, "%s%llu", i ? ", " : " ", (unsigned long long)perf->ISSUED[i]);
+	}
+	fprintf(fp, " ],\n        \"empty_slots\": {");
+	for (i = 0; i < NUM_ISSUE_LIMITS; i++) {
+		fprintf(fp, "%s\"%s\": %llu", i ? ", " : " ", ISSUE_NAMES[i], (unsigned long long)perf->EMPTY_SLOTS[i]);
+	}
+	fprintf(fp, " },\n        \"retired_op\": {");
+	for (i = 0; i < NUM_OPS; i++) {
+		if (perf->RETIRED_OP[i] != 0) {
+			fprintf(fp, "%s\"%s\": %llu", first ? " " : ", ", OP_NAMES[i], (unsigned long long)perf->RETIRED_OP[i]);
+			first = FALSE;
+		}
+	}
+	fprintf(fp, " }\n      },\n");
+}
+
+/***************************************************************/
+/* Statistics of one cache as a JSON object                                                          */
+/***************************************************************/
+static void cache_write_json(const cache_t* cache, const char* name, FILE* fp) {
+	fprintf(fp, "      \"%s\": { \"reads\": %llu, \"writes\": %llu, \"read_misses\": %llu, \"write_misses\": %llu, "
+		"\"evictions\": %llu, \"memory_writes\": %llu },\n", name,
+		(unsigned long long)cache->READS, (unsigned long long)cache->WRITES,
+		(unsigned long long)cache->READ_MISSES, (unsigned long long)cache->WRITE_MISSES,
+		(unsigned long long)cache->EVICTIONS, (unsigned long long)cache->MEMORY_WRITES);
+}
+
+/***************************************************************/
+/* Statistics of the branch predictor as a JSON object                                      */
+/***************************************************************/
+static void bpred_write_json(const bpred_t* bp, FILE* fp) {
+	fprintf(fp, "      \"bpred\": { \"branches\": %llu, \"taken\": %llu, \"direction_misses\": %llu, \"jumps\": %llu, "
+		"\"mispredicts\": %llu, \"id_redirects\": %llu, \"btb_lookups\": %llu, \"btb_hits\": %llu, \"penalty_cycles\": %llu },\n",
+		(unsigned long long)bp->BRANCHES, (unsigned long long)bp->TAKEN, (unsigned long long)bp->DIRECTION_MISSES,
+		(unsigned long long)bp->JUMPS, (unsigned long long)bp->MISPREDICTS, (unsigned long long)bp->ID_REDIRECTS,
+		(unsigned long long)bp->BTB_LOOKUPS, (unsigned long long)bp->BTB_HITS, (unsigned long long)bp->PENALTY_CYCLES);
+}
+
+static const char* const stop_reason_names[] = { "none", "exit", "watchdog", "bad_fetch", "diverged" };
+
+/***************************************************************/
+/* Write final registers, counters and exit status as JSON                            */
+/***************************************************************/
+void write_stats_json(MIPS_Sim* sim, FILE* fp, const char* status, double seconds) {
+	MIPS_Sim* core;
+	const char* c;
+	int num_cores = sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1;
+	int i, j;
+
+	fprintf(fp, "{\n  \"program\": \"");
+	for (c = sim->prog_file; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			fputc('\\', fp);
+		}
+		if ((unsigned char)*c >= 0x20) {
+			fputc(*c, fp);
+		}
+	}
+	fprintf(fp, "\",\n  \"status\": \"%s\",\n  \"host_seconds\": %.6f,\n  \"cores\": [\n", status, seconds);
+	for (i = 0; i < num_cores; i++) {
+		core = sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim;
+		fprintf(fp, "    {\n      \"core\": %d,\n      \"running\": %s,\n      \"stop\": \"%s\",\n", i,
+			core->RUN_FLAG ? "true" : "false", stop_reason_names[core->STOP_REASON]);
+		fprintf(fp, "      \"cycles\": %llu,\n      \"instructions\": %llu,\n      \"ff_instructions\": %llu,\n",
+			(unsigned long long)core->CYCLE_COUNT, (unsigned long long)core->INSTRUCTION_COUNT, (unsigned long long)core->FF_INSTRUCTION_COUNT);
+		fprintf(fp, "      \"forwarding\": %s,\n      \"issue_width\": %u,\n      \"stalls\": %llu,\n      \"bubbles\": %llu,\n      \"forwards\": %llu,\n",
+			core->FORWARDING ? "true" : "false", core->ISSUE_WIDTH, (unsigned long long)core->STALL_COUNT,
+			(unsigned long long)core->BUBBLE_COUNT, (unsigned long long)core->FORWARD_COUNT);
+		if (core->PERF.ENABLED) {
+			perf_write_json(&core->PERF, core->ISSUE_WIDTH, fp);
+		}
+		if (core->ICACHE.ENABLED) {
+			cache_write_json(&core->ICACHE, "icache", fp);
+		}
+		if (core->DCACHE.ENABLED) {
+			cache_write_json(&core->DCACHE, "dcache", fp);
+		}
+		bpred_write_json(&core->BPRED, fp);
+		if (core->CHECK.ENABLED) {
+			fprintf(fp, "      \"check\": { \"checked\": %llu, \"diverged\": %s },\n",
+				(unsigned long long)core->CHECK.CHECKED, core->CHECK.DIVERGED ? "true" : "false");
+		}
+		fprintf(fp, "      \"pc\": %u,\n      \"hi\": %u,\n      \"lo\": %u,\n      \"regs\": [",
+			core->CURRENT_STATE.PC, core->CURRENT_STATE.HI, core->CURRENT_STATE.LO);
+		for (j = 0; j < MIPS_REGS; j++) {
+			fprintf(fp, "%s%u", j ? ", " : "", core->CURRENT_STATE.REGS[j]);
+		}
+		fprintf(fp, "]\n    }%s\n", i + 1 < num_cores ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+}
+
+/***************************************************************/
+/* Read and run one command; FALSE once the input ends or on quit            */  
+/***************************************************************/
+int handle_command(MIPS_Sim* sim, FILE* in, int prompt) {                         
+	char buffer[20];
+	char path[256];
+	uint32_t start, stop, cycles;
+	unsigned long long cycle_limit, instruction_limit;
+	uint32_t register_no;
+	int register_value;
+	int hi_reg_value, lo_reg_value;
+	int i;
+
+	if (prompt) {
+		printf("MU-MIPS SIM:> ");
+	}
+
+	if (fscanf(in, "%19s", buffer) == EOF){
+		return FALSE;
+	}
+
+	switch(buffer[0]) {
+		case 'S':
+		case 's':
+			if (strcasecmp(buffer, "simpoint") == 0) {
+				simpoint_command(sim, in);
+				break;
+			}
+			if (buffer[1] == 'h' || buffer[1] == 'H'){
+				show_pipeline(sim);
+			}else if (buffer[1] == 't' || buffer[1] == 'T'){
+				stats_command(sim, in);
+			}else if (sim->SYSTEM != NULL) {
+				system_run(sim->SYSTEM, -1);
+			}else {
+				runAll(sim); 
+			}
+			break;
+		case 'M':
+		case 'm':
+			if (fscanf(in, "%x %x", &start, &stop) != 2){
+				break;
+			}
+			mdump(sim, start, stop);
+			break;
+		case '?':
+			help();
+			break;
+		case 'Q':
+		case 'q':
+			printf("**************************\n");
+			printf("Exiting MU-MIPS! Good Bye...\n");
+			printf("**************************\n");
+			return FALSE;
+		case 'R':
+		case 'r':
+			if (buffer[1] == 'd' || buffer[1] == 'D'){
+				rdump(sim);
+			}else if((buffer[1] == 'e' || buffer[1] == 'E') && buffer[2] != '\0' && (buffer[3] == 't' || buffer[3] == 'T')){
+				if (fscanf(in, "%255s", path) != 1) {
+					break;
+				}
+				checkpoint_restore(sim, path);
+			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
+				if (sim->SYSTEM != NULL) {
+					system_reset(sim->SYSTEM);
+				} else {
+					reset(sim);
+				}
+			}
+			else {
+				if (fscanf(in, "%u", &cycles) != 1) {
+					break;
+				}
+				if (sim->SYSTEM != NULL) {
+					system_run(sim->SYSTEM, cycles);
+				} else {
+					run(sim, cycles);
+				}
+			}
+			break;
+		case 'I':
+		case 'i':
+			if (fscanf(in, "%u %i", &register_no, &register_value) != 2){
+				break;
+			}
+			sim->CURRENT_STATE.REGS[register_no] = register_value;
+			sim->NEXT_STATE.REGS[register_no] = register_value;
+			break;
+		case 'H':
+		case 'h':
+			if (fscanf(in, "%i", &hi_reg_value) != 1){
+				break;
+			}
+			sim->CURRENT_STATE.HI = hi_reg_value; 
+			sim->NEXT_STATE.HI = hi_reg_value; 
+			break;
+		case 'L':
+		case 'l':
+			if (fscanf(in, "%i", &lo_reg_value) != 1){
+				break;
+			}
+			sim->CURRENT_STATE.LO = lo_reg_value;
+			sim->NEXT_STATE.LO = lo_reg_value;
+			break;
+		case 'P':
+		case 'p':
+			if (strcasecmp(buffer, "pipeview") == 0) {
+				pipeview_command(sim, in);
+				break;
+			}
+			if (strcasecmp(buffer, "profile") == 0) {
+				profile_command(sim, in);
+				break;
+			}
+			print_program(sim); 
+			break;
+		case 'J':
+		case 'j':
+			if (sim->JIT.CODE == NULL) {
+				printf("Binary translation is not available on this host.\n");
+				break;
+			}
+			sim->JIT.ENABLED = !sim->JIT.ENABLED;
+			printf("Binary translation %s.\n", sim->JIT.ENABLED ? "enabled" : "disabled");
+			break;
+		case 'T':
+		case 't':
+			trace_command(sim, in);
+			break;
+		case 'W':
+		case 'w':
+			if (strcasecmp(buffer, "width") == 0) {
+				if (fscanf(in, "%u", &cycles) != 1) {
+					break;
+				}
+				for (i = 0; i < (sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1); i++) {
+					if (!issue_width_set(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim, cycles)) {
+						break;
+					}
+				}
+				if (i > 0) {
+					printf("Issue width %u.\n", sim->ISSUE_WIDTH);
+				}
+				break;
+			}
+			if (fscanf(in, "%llu %llu", &cycle_limit, &instruction_limit) != 2) {
+				break;
+			}
+			for (i = 0; i < (sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1); i++) {
+				(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim)->CYCLE_LIMIT = cycle_limit;
+				(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim)->INSTRUCTION_LIMIT = instruction_limit;
+			}
+			printf("Watchdog: stop at %llu cycles, %llu instructions (0 = no limit).\n", cycle_limit, instruction_limit);
+			break;
+		case 'B':
+		case 'b':
+			bpred_report(&sim->BPRED, stdout);
+			printf("\n");
+			break;
+		case 'F':
+		case 'f':
+			if (buffer[1] == 'o' || buffer[1] == 'O'){
+				int forwarding = !sim->FORWARDING;
+				for (i = 0; i < (sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1); i++) {
+					(sim->SYSTEM != NULL ? sim->SYSTEM->CORES[i] : sim)->FORWARDING = forwarding;
+				}
+				printf("Forwarding %s.\n", forwarding ? "enabled" : "disabled");
+			} else if (buffer[1] == 'u' || buffer[1] == 'U'){
+				if (fscanf(in, "%x", &stop) != 1) {
+					break;
+				}
+				fast_forward(sim, UINT64_MAX, TRUE, stop);
+			} else {
+				unsigned long long count;
+				if (fscanf(in, "%llu", &count) != 1) {
+					break;
+				}
+				fast_forward(sim, count, FALSE, 0);
+			}
+			break;
+		case 'C':
+		case 'c':
+			if (strcasecmp(buffer, "check") == 0) {
+				check_enable(sim, !sim->CHECK.ENABLED);
+				printf("Lockstep checking %s.\n", sim->CHECK.ENABLED ? "enabled" : "disabled");
+				break;
+			}
+			if (buffer[1] == 'h' || buffer[1] == 'H'){
+				if (fscanf(in, "%255s", path) != 1) {
+					break;
+				}
+				checkpoint_save(sim, path);
+				break;
+			}
+			if (buffer[1] == 'a' || buffer[1] == 'A'){
+				cache_report(&sim->ICACHE, "I-cache", stdout);
+				cache_report(&sim->DCACHE, "D-cache", stdout);
+				printf("\n");
+				break;
+			}
+			if (sim->SYSTEM == NULL) {
+				printf("Not a multi-core system (start with -c <cores>).\n");
+				break;
+			}
+			if (strlen(buffer) == 5 && (buffer[4] == 's' || buffer[4] == 'S')){
+				system_report(sim->SYSTEM);
+			} else {
+				int core;
+				if (fscanf(in, "%d", &core) != 1) {
+					break;
+				}
+				if (core < 0 || core >= sim->SYSTEM->NUM_CORES) {
+					printf("No core %d.\n", core);
+					break;
+				}
+				sim->SYSTEM->CURRENT_CORE = core;
+				printf("Commands now act on core %d.\n", core);
+			}
+			break;
+		default:
+			printf("Invalid Command.\n");
+			break;
+	}
+	return TRUE;
+}
+
+/***************************************************************/
+/* reset registers/memory and reload program                                                    */
+/***************************************************************/
+void reset(MIPS_Sim* sim) {   
+	if (sim->MEMORY->PRISTINE_DATA != NULL) {
+		/* undo only what the run wrote, from the copy kept at load time */
+		mem_reset_dirty(sim);
+	} else {
+		free_memory(sim);
+	
+		/*load program*/
+		load_program(sim);
+	}
+	
+	reset_state(sim);
+}
+
+/***************************************************************/
+/* Zero the architectural state and counters, PC back to the text segment   */
+/***************************************************************/
+void reset_state(MIPS_Sim* sim) {
+	int i;
+	/*reset registers*/
+	for (i = 0; i < MIPS_REGS; i++){
+		sim->CURRENT_STATE.REGS[i] = 0;
+	}
+	sim->CURRENT_STATE.REGS[27] = sim->CORE_ID; // $k1 tells a program which core it runs on
+	sim->CURRENT_STATE.HI = 0;
+	sim->CURRENT_STATE.LO = 0;
+
+	/*reset PC*/
+	sim->INSTRUCTION_COUNT = 0;
+	sim->FF_INSTRUCTION_COUNT = 0;
+	sim->STALL_COUNT = 0;
+	sim->BUBBLE_COUNT = 0;
+	sim->FORWARD_COUNT = 0;
+	perf_clear(sim);
+	cache_invalidate(&sim->ICACHE);
+	cache_invalidate(&sim->DCACHE);
+	bpred_reset(&sim->BPRED);
+	sim->FETCH_WAIT = sim->MEM_WAIT = 0;
+	sim->FETCH_FILLED = sim->MEM_FILLED = FALSE;
+	sim->BRANCH_SQUASH = sim->BRANCH_REDIRECT = FALSE;
+	sim->HAZARD_STALL = sim->MEM_STALL = FALSE;
+	sim->EXITING = FALSE;
+	sim->STOP_REASON = STOP_NONE;
+	memset(&sim->IF_ID, 0, sizeof(sim->IF_ID));
+	memset(&sim->ID_EX, 0, sizeof(sim->ID_EX));
+	memset(&sim->EX_MEM, 0, sizeof(sim->EX_MEM));
+	memset(&sim->MEM_WB, 0, sizeof(sim->MEM_WB));
+	sim->CURRENT_STATE.PC = sim->MEMORY->ENTRY_PC;
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	sim->RUN_FLAG = TRUE;
+	if (sim->CHECK.ENABLED) {
+		check_enable(sim, TRUE);
+		sim->CHECK.CHECKED = 0;
+	}
+}
+
+/***************************************************************/
+/* Set up an empty sparse memory (pages are allocated on first write)            */
+/***************************************************************/
+void init_memory(MIPS_Sim* sim) {                                           
+	sim->MEMORY = calloc(1, sizeof(MIPS_Memory));
+	if (sim->MEMORY == NULL) {
+		printf("Error: Out of memory allocating guest memory\n");
+		exit(-1);
+	}
+	sim->MEMORY->ENTRY_PC = MEM_TEXT_BEGIN;
+	pthread_mutex_init(&sim->MEMORY->ALLOC_LOCK, NULL);
+	pthread_mutex_init(&sim->MEMORY->LINK_LOCK, NULL);
+	mem_tlb_flush(sim);
+}
+
+/***************************************************************/
+/* Release every allocated page, leaving memory all zero                                    */
+/***************************************************************/
+void free_memory(MIPS_Sim* sim) {
+	int i, j;
+	for (i = 0; i < MEM_DIR_ENTRIES; i++) {
+		if (sim->MEMORY->PAGE_DIR[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+			free(sim->MEMORY->PAGE_DIR[i][j]);
+		}
+		free(sim->MEMORY->PAGE_DIR[i]);
+		sim->MEMORY->PAGE_DIR[i] = NULL;
+	}
+	sim->MEMORY->PAGES_ALLOCATED = 0;
+	free_decoded(sim);
+	mem_tlb_flush(sim);
+
+	/* no page is left to be dirty */
+	for (i = 0; i < MEM_DIR_ENTRIES; i++) {
+		free(sim->MEMORY->DIRTY_DIR[i]);
+		sim->MEMORY->DIRTY_DIR[i] = NULL;
+	}
+	sim->MEMORY->NUM_DIRTY = 0;
+
+	/* no word survives, so neither does any link */
+	for (i = 0; i < MAX_CORES; i++) {
+		mem_clear_link(sim->MEMORY, i);
+	}
+	sim->MEMORY->CODE_GENERATION++;
+}
+
+/**************************************************************/
+/* Copy bytes of a little-endian program image into guest memory, page at a */
+/* time                                                                                                          */
+/**************************************************************/
+static void load_image(MIPS_Sim* sim, uint32_t address, const uint8_t* data, uint32_t size)
+{
+	uint32_t done = 0, chunk;
+	uint8_t *page;
+
+	if (size == 0) {
+		return;
+	}
+	if (!mem_region_valid(address) || !mem_region_valid(address + size - 1)) {
+		printf("Error: Program image 0x%08x..0x%08x is outside guest memory\n", address, address + size - 1);
+		exit(-1);
+	}
+	while (done < size) {
+		page = mem_page_alloc(sim, address + done);
+		chunk = MEM_PAGE_SIZE - ((address + done) & MEM_PAGE_MASK);
+		if (chunk > size - done) {
+			chunk = size - done;
+		}
+		memcpy(page + ((address + done) & MEM_PAGE_MASK), data + done, chunk);
+		done += chunk;
+	}
+}
+
+/* little-endian ELF fields */
+static uint32_t elf_get32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t elf_get16(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+/**************************************************************/
+/* Little-endian MIPS ELF32 executable: every PT_LOAD segment goes to its  */
+/* link address (.text, .data; the .bss tail is left to the zero-filled      */
+/* pages). Guest memory is little-endian, so big-endian (mips, not mipsel)   */
+/* executables are rejected. Returns the entry point.                          */
+/**************************************************************/
+static uint32_t load_elf(MIPS_Sim* sim, const uint8_t* file, size_t size)
+{
+	uint32_t entry, phoff, offset, vaddr, filesz, memsz, flags, text_end = 0, loaded = 0;
+	uint16_t phentsize, phnum, i;
+	const uint8_t *ph;
+	int segments = 0;
+
+	if (size < ELF_EHDR_SIZE || file[ELF_EI_CLASS] != ELF_CLASS_32 ||
+		(file[ELF_EI_DATA] != ELF_DATA_LSB && file[ELF_EI_DATA] != ELF_DATA_MSB)) {
+		printf("Error: %s is not a 32-bit ELF file\n", sim->prog_file);
+		exit(-1);
+	}
+	if (file[ELF_EI_DATA] == ELF_DATA_MSB) {
+		printf("Error: %s is a big-endian executable; only little-endian (mipsel) is supported\n", sim->prog_file);
+		exit(-1);
+	}
+	if (elf_get16(file + 18) != ELF_MACHINE_MIPS || elf_get16(file + 16) != ELF_TYPE_EXEC) {
+		printf("Error: %s is not a MIPS executable\n", sim->prog_file);
+		exit(-1);
+	}
+	entry = elf_get32(file + 24);
+	phoff = elf_get32(file + 28);
+	phentsize = elf_get16(file + 42);
+	phnum = elf_get16(file + 44);
+	if (phentsize < ELF_PHDR_SIZE || phoff > size || (size - phoff) / phentsize < phnum) {
+		printf("Error: %s has a corrupt program header table\n", sim->prog_file);
+		exit(-1);
+	}
+
+	for (i = 0; i < phnum; i++) {
+		ph = file + phoff + (size_t)i * phentsize;
+		if (elf_get32(ph) != ELF_PT_LOAD) {
+			continue;
+		}
+		offset = elf_get32(ph + 4);
+		vaddr = elf_get32(ph + 8);
+		filesz = elf_get32(ph + 16);
+		memsz = elf_get32(ph + 20);
+		flags = elf_get32(ph + 24);
+		if (offset > size || filesz > size - offset || filesz > memsz) {
+			printf("Error: %s has a segment outside the file\n", sim->prog_file);
+			exit(-1);
+		}
+		load_image(sim, vaddr, file + offset, filesz);
+		loaded += filesz;
+		segments++;
+
+		/* code at MEM_TEXT_BEGIN is what print_program lists and load_program predecodes */
+		if ((flags & ELF_PF_X) && vaddr >= MEM_TEXT_BEGIN && vaddr <= MEM_TEXT_END && vaddr + filesz > text_end) {
+			text_end = vaddr + filesz;
+		}
+	}
+	sim->PROGRAM_SIZE = text_end > MEM_TEXT_BEGIN ? (text_end - MEM_TEXT_BEGIN) / 4 : 0;
+	printf("Program loaded into memory.\nELF32, %d segments, %u bytes, entry 0x%08x.\n\n", segments, loaded, entry);
+	return entry;
+}
+
+/**************************************************************/
+/* Text format: one hex word per line, placed from MEM_TEXT_BEGIN                */
+/**************************************************************/
+static void load_hex(MIPS_Sim* sim, const char* text, size_t size)
+{
+	const char *p = text, *end = text + size;
+	uint32_t address = MEM_TEXT_BEGIN, word, digit, digits, line = 1;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+			if (*p == '\n') {
+				line++;
+			}
+			p++;
+		}
+		if (p == end) {
+			break;
+		}
+		if (end - p > 1 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+			p += 2;
+		}
+		for (word = 0, digits = 0; p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'; p++, digits++) {
+			if (*p >= '0' && *p <= '9') {
+				digit = *p - '0';
+			} else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+				digit = (*p | 0x20) - 'a' + 10;
+			} else {
+				printf("Error: %s line %u: '%c' is not a hex digit\n", sim->prog_file, line, *p);
+				exit(-1);
+			}
+			word = (word << 4) | digit;
+		}
+		if (digits == 0 || digits > 8) {
+			printf("Error: %s line %u: a word needs 1 to 8 hex digits\n", sim->prog_file, line);
+			exit(-1);
+		}
+		mem_write_32(sim, address, word);
+		address += 4;
+	}
+	sim->PROGRAM_SIZE = (address - MEM_TEXT_BEGIN) / 4;
+	printf("Program loaded into memory.\n%d words written into memory.\n\n", sim->PROGRAM_SIZE);
+}
+
+/* anything that is not ELF and holds only hex words and whitespace is the text format */
+static int is_hex_text(const uint8_t* data, size_t size)
+{
+	size_t i;
+	for (i = 0; i < size; i++) {
+		uint8_t c = data[i];
+		if (!((c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') ||
+			c == 'x' || c == 'X' || c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**************************************************************/
+/* load program into memory: little-endian MIPS ELF32, hex text, or a raw   */
+/* little-endian image at MEM_TEXT_BEGIN. The file is mapped, not read,       */
+/* and only a summary is printed.                                                                 */
+/**************************************************************/
+void load_program(MIPS_Sim* sim) {                   
+	struct stat st;
+	uint8_t *file;
+	uint32_t address, entry = MEM_TEXT_BEGIN;
+	int fd, i;
+
+	/* Open program file. */
+	fd = open(sim->prog_file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("Error: Can't open program file %s\n", sim->prog_file);
+		exit(-1);
+	}
+	if (st.st_size == 0) {
+		printf("Error: Program file %s is empty\n", sim->prog_file);
+		exit(-1);
+	}
+	if ((uint64_t)st.st_size > UINT32_MAX) {
+		printf("Error: Program file %s is too large\n", sim->prog_file);
+		exit(-1);
+	}
+	file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file == MAP_FAILED) {
+		printf("Error: Can't map program file %s\n", sim->prog_file);
+		exit(-1);
+	}
+
+	/* Read in the program. */
+	if (st.st_size >= 4 && memcmp(file, ELF_MAGIC, 4) == 0) {
+		entry = load_elf(sim, file, st.st_size);
+	} else if (is_hex_text(file, st.st_size)) {
+		load_hex(sim, (const char *)file, st.st_size);
+	} else {
+		load_image(sim, MEM_TEXT_BEGIN, file, st.st_size);
+		sim->PROGRAM_SIZE = (st.st_size + 3) / 4;
+		printf("Program loaded into memory.\nRaw image, %lld bytes.\n\n", (long long)st.st_size);
+	}
+	munmap(file, st.st_size);
+
+	/* Predecode the text segment once so the pipeline never re-extracts fields. */
+	for (address = MEM_TEXT_BEGIN; address < MEM_TEXT_BEGIN + 4 * sim->PROGRAM_SIZE; address += MEM_PAGE_SIZE) {
+		predecode_page(sim, address);
+	}
+
+	/* every core starts at the entry point */
+	sim->MEMORY->ENTRY_PC = entry;
+	sim->CURRENT_STATE.PC = entry;
+	sim->NEXT_STATE.PC = entry;
+	if (sim->SYSTEM != NULL) {
+		for (i = 0; i < sim->SYSTEM->NUM_CORES; i++) {
+			sim->SYSTEM->CORES[i]->PROGRAM_SIZE = sim->PROGRAM_SIZE;
+			sim->SYSTEM->CORES[i]->CURRENT_STATE.PC = entry;
+			sim->SYSTEM->CORES[i]->NEXT_STATE.PC = entry;
+		}
+	}
+
+	/* later resets copy back only the pages a run dirtied */
+	mem_snapshot_pristine(sim);
+}
+
+/**************************************************************/
+/* Checkpoints: the architectural and pipeline state of every core plus the  */
+/* non-zero pages of guest memory, each page PackBits-compressed. All fields */
+/* are little-endian so a checkpoint moves between hosts.                        */
+/**************************************************************/
+static void ckpt_put32(FILE* fp, uint32_t v)
+{
+	uint8_t b[4] = { v, v >> 8, v >> 16, v >> 24 };
+	fwrite(b, 1, 4, fp);
+}
+
+static void ckpt_put64(FILE* fp, uint64_t v)
+{
+	ckpt_put32(fp, (uint32_t)v);
+	ckpt_put32(fp, (uint32_t)(v >> 32));
+}
+
+static void ckpt_put_state(FILE* fp, const CPU_State* state)
+{
+	int i;
+	ckpt_put32(fp, state->PC);
+	for (i = 0; i < MIPS_REGS; i++) {
+		ckpt_put32(fp, state->REGS[i]);
+	}
+	ckpt_put32(fp, state->HI);
+	ckpt_put32(fp, state->LO);
+}
+
+/* the predecoded form is not stored, it is rebuilt from IR on restore */
+static void ckpt_put_pipeline(FILE* fp, const CPU_Pipeline_Reg* reg)
+{
+	ckpt_put32(fp, reg->PC);
+	ckpt_put32(fp, reg->IR);
+	ckpt_put32(fp, reg->A);
+	ckpt_put32(fp, reg->B);
+	ckpt_put32(fp, reg->imm);
+	ckpt_put32(fp, reg->ALUOutput);
+	ckpt_put32(fp, reg->LMD);
+	ckpt_put32(fp, reg->VALID);
+	ckpt_put32(fp, reg->PRED_TAKEN);
+	ckpt_put32(fp, reg->PRED_PC);
+	ckpt_put32(fp, reg->PRED_HISTORY);
+	ckpt_put64(fp, reg->SEQ);
+}
+
+/* PackBits: n in 0..127 copies n+1 literal bytes, n in 129..255 repeats the next byte 257-n times */
+static uint32_t ckpt_pack_page(const uint8_t* page, uint8_t* out)
+{
+	uint32_t in = 0, len = 0, run, lit;
+
+	while (in < MEM_PAGE_SIZE) {
+		for (run = 1; in + run < MEM_PAGE_SIZE && run < 128 && page[in + run] == page[in]; run++);
+		if (run >= 3) {
+			out[len++] = 257 - run;
+			out[len++] = page[in];
+			in += run;
+			continue;
+		}
+		/* literals until the next run of three or the 128 byte limit */
+		for (lit = 0; in + lit < MEM_PAGE_SIZE && lit < 128; lit++) {
+			if (in + lit + 2 < MEM_PAGE_SIZE && page[in + lit] == page[in + lit + 1] && page[in + lit] == page[in + lit + 2]) {
+				break;
+			}
+		}
+		out[len++] = lit - 1;
+		memcpy(&out[len], &page[in], lit);
+		len += lit;
+		in += lit;
+	}
+	return len;
+}
+
+/**************************************************************/
+/* Write a checkpoint of a simulator (every core of a multi-core system)         */
+/**************************************************************/
+int checkpoint_save(MIPS_Sim* sim, const char* path)
+{
+	MIPS_Sim* cores[MAX_CORES];
+	int num_cores = 1, i, j, k;
+	uint32_t pages = 0, bytes = 0, len;
+	uint8_t packed[MEM_PAGE_SIZE + MEM_PAGE_SIZE / 128 + 1];
+	uint8_t *page;
+	FILE* fp;
+
+	cores[0] = sim;
+	if (sim->SYSTEM != NULL) {
+		num_cores = sim->SYSTEM->NUM_CORES;
+		memcpy(cores, sim->SYSTEM->CORES, num_cores * sizeof(MIPS_Sim *));
+	}
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		printf("Error: Can't create checkpoint file %s\n", path);
+		return FALSE;
+	}
+
+	fwrite(CHECKPOINT_MAGIC, 1, 8, fp);
+	ckpt_put32(fp, CHECKPOINT_VERSION);
+	ckpt_put32(fp, num_cores);
+	ckpt_put32(fp, sim->PROGRAM_SIZE);
+	for (i = 0; i < num_cores; i++) {
+		ckpt_put_state(fp, &cores[i]->CURRENT_STATE);
+		ckpt_put_state(fp, &cores[i]->NEXT_STATE);
+		ckpt_put32(fp, cores[i]->ISSUE_WIDTH);
+		for (j = 0; j < (int)cores[i]->ISSUE_WIDTH; j++) {
+			ckpt_put_pipeline(fp, &cores[i]->IF_ID[j]);
+			ckpt_put_pipeline(fp, &cores[i]->ID_EX[j]);
+			ckpt_put_pipeline(fp, &cores[i]->EX_MEM[j]);
+			ckpt_put_pipeline(fp, &cores[i]->MEM_WB[j]);
+		}
+		ckpt_put64(fp, cores[i]->INSTRUCTION_COUNT);
+		ckpt_put64(fp, cores[i]->CYCLE_COUNT);
+		ckpt_put64(fp, cores[i]->FF_INSTRUCTION_COUNT);
+		ckpt_put32(fp, cores[i]->RUN_FLAG);
+		ckpt_put32(fp, cores[i]->STOP_REASON);
+		ckpt_put32(fp, cores[i]->FETCH_ENABLED);
+		ckpt_put64(fp, cores[i]->STALL_COUNT);
+		ckpt_put64(fp, cores[i]->BUBBLE_COUNT);
+		ckpt_put64(fp, cores[i]->FORWARD_COUNT);
+		ckpt_put64(fp, cores[i]->FETCH_SEQ);
+	}
+
+	/* pages that were allocated but hold only zeros are left out */
+	for (i = 0; i < MEM_DIR_ENTRIES; i++) {
+		if (sim->MEMORY->PAGE_DIR[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+			page = sim->MEMORY->PAGE_DIR[i][j];
+			if (page == NULL) {
+				continue;
+			}
+			for (k = 0; k < MEM_PAGE_SIZE && page[k] == 0; k++);
+			if (k == MEM_PAGE_SIZE) {
+				continue;
+			}
+			uint32_t address = ((uint32_t)i << MEM_DIR_SHIFT) | ((uint32_t)j << MEM_PAGE_SHIFT);
+			len = ckpt_pack_page(page, packed);
+			ckpt_put32(fp, address);
+			ckpt_put32(fp, decoded_page_lookup(sim, address) != NULL);
+			ckpt_put32(fp, len);
+			fwrite(packed, 1, len, fp);
+			pages++;
+			bytes += len;
+		}
+	}
+	ckpt_put32(fp, CHECKPOINT_END);
+
+	if (fclose(fp) != 0) {
+		printf("Error: Can't write checkpoint file %s\n", path);
+		return FALSE;
+	}
+	printf("Checkpoint written to %s: %d core(s), %u pages (%u bytes compressed).\n\n", path, num_cores, pages, bytes);
+	return TRUE;
+}
+
+/* bounds-checked reader over a checkpoint loaded in memory */
+typedef struct {
+	const uint8_t *p, *end;
+	int ok;
+} ckpt_reader_t;
+
+static uint32_t ckpt_get32(ckpt_reader_t* r)
+{
+	uint32_t v;
+	if (r->end - r->p < 4) {
+		r->ok = FALSE;
+		return 0;
+	}
+	v = r->p[0] | (r->p[1] << 8) | (r->p[2] << 16) | ((uint32_t)r->p[3] << 24);
+	r->p += 4;
+	return v;
+}
+
+static uint64_t ckpt_get64(ckpt_reader_t* r)
+{
+	uint64_t lo = ckpt_get32(r);
+	return lo | ((uint64_t)ckpt_get32(r) << 32);
+}
+
+static void ckpt_get_state(ckpt_reader_t* r, CPU_State* state)
+{
+	int i;
+	state->PC = ckpt_get32(r);
+	for (i = 0; i < MIPS_REGS; i++) {
+		state->REGS[i] = ckpt_get32(r);
+	}
+	state->HI = ckpt_get32(r);
+	state->LO = ckpt_get32(r);
+}
+
+static void ckpt_get_pipeline(ckpt_reader_t* r, CPU_Pipeline_Reg* reg)
+{
+	reg->PC = ckpt_get32(r);
+	reg->IR = ckpt_get32(r);
+	predecode_instruction(reg->IR, &reg->D);
+	reg->A = ckpt_get32(r);
+	reg->B = ckpt_get32(r);
+	reg->imm = ckpt_get32(r);
+	reg->ALUOutput = ckpt_get32(r);
+	reg->LMD = ckpt_get32(r);
+	reg->VALID = ckpt_get32(r) != 0;
+	reg->PRED_TAKEN = ckpt_get32(r) != 0;
+	reg->PRED_PC = ckpt_get32(r);
+	reg->PRED_HISTORY = ckpt_get32(r);
+	reg->SEQ = ckpt_get64(r);
+}
+
+static int ckpt_unpack_page(ckpt_reader_t* r, uint32_t len, uint8_t* page)
+{
+	const uint8_t *in = r->p, *end = r->p + len;
+	uint32_t out = 0, n;
+
+	if ((uint32_t)(r->end - r->p) < len) {
+		return FALSE;
+	}
+	while (in < end) {
+		n = *in++;
+		if (n < 128) {
+			n++;
+			if (end - in < n || out + n > MEM_PAGE_SIZE) {
+				return FALSE;
+			}
+			memcpy(&page[out], in, n);
+			in += n;
+			out += n;
+		} else if (n > 128) {
+			n = 257 - n;
+			if (in == end || out + n > MEM_PAGE_SIZE) {
+				return FALSE;
+			}
+			memset(&page[out], *in++, n);
+			out += n;
+		}
+	}
+	r->p = end;
+	return out == MEM_PAGE_SIZE;
+}
+
+/**************************************************************/
+/* Restore a checkpoint into a simulator. The file is fully checked before   */
+/* anything is replaced, so a bad file leaves the simulation untouched.       */
+/**************************************************************/
+int checkpoint_restore(MIPS_Sim* sim, const char* path)
+{
+	MIPS_Sim* cores[MAX_CORES];
+	MIPS_Sim* saved = NULL;
+	int num_cores = 1, i, j;
+	uint32_t program_size, address, pages = 0, capacity = 0;
+	uint32_t *addresses = NULL;
+	uint8_t *data = NULL, *code = NULL, *file = NULL;
+	ckpt_reader_t r;
+	long size;
+	FILE* fp;
+	int ok = FALSE;
+
+	cores[0] = sim;
+	if (sim->SYSTEM != NULL) {
+		num_cores = sim->SYSTEM->NUM_CORES;
+		memcpy(cores, sim->SYSTEM->CORES, num_cores * sizeof(MIPS_Sim *));
+	}
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Error: Can't open checkpoint file %s\n", path);
+		return FALSE;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	file = malloc(size > 0 ? size : 1);
+	if (file == NULL || fread(file, 1, size, fp) != (size_t)size) {
+		printf("Error: Can't read checkpoint file %s\n", path);
+		fclose(fp);
+		free(file);
+		return FALSE;
+	}
+	fclose(fp);
+	r.p = file;
+	r.end = file + size;
+	r.ok = TRUE;
+
+	if (size < 8 || memcmp(file, CHECKPOINT_MAGIC, 8) != 0) {
+		printf("Error: %s is not a checkpoint\n", path);
+		goto done;
+	}
+	r.p += 8;
+	if (ckpt_get32(&r) != CHECKPOINT_VERSION) {
+		printf("Error: Checkpoint %s has an unsupported version\n", path);
+		goto done;
+	}
+	if (ckpt_get32(&r) != (uint32_t)num_cores) {
+		printf("Error: Checkpoint %s was taken with a different number of cores\n", path);
+		goto done;
+	}
+	program_size = ckpt_get32(&r);
+
+	/* cores go to scratch copies first */
+	saved = calloc(num_cores, sizeof(MIPS_Sim));
+	if (saved == NULL) {
+		printf("Error: Out of memory restoring checkpoint\n");
+		goto done;
+	}
+	for (i = 0; i < num_cores; i++) {
+		ckpt_get_state(&r, &saved[i].CURRENT_STATE);
+		ckpt_get_state(&r, &saved[i].NEXT_STATE);
+		saved[i].ISSUE_WIDTH = ckpt_get32(&r);
+		if (saved[i].ISSUE_WIDTH == 0 || saved[i].ISSUE_WIDTH > MAX_ISSUE_WIDTH) {
+			r.ok = FALSE;
+			break;
+		}
+		for (j = 0; j < (int)saved[i].ISSUE_WIDTH; j++) {
+			ckpt_get_pipeline(&r, &saved[i].IF_ID[j]);
+			ckpt_get_pipeline(&r, &saved[i].ID_EX[j]);
+			ckpt_get_pipeline(&r, &saved[i].EX_MEM[j]);
+			ckpt_get_pipeline(&r, &saved[i].MEM_WB[j]);
+		}
+		saved[i].INSTRUCTION_COUNT = ckpt_get64(&r);
+		saved[i].CYCLE_COUNT = ckpt_get64(&r);
+		saved[i].FF_INSTRUCTION_COUNT = ckpt_get64(&r);
+		saved[i].RUN_FLAG = ckpt_get32(&r);
+		saved[i].STOP_REASON = ckpt_get32(&r);
+		if (saved[i].STOP_REASON > STOP_DIVERGED) {
+			r.ok = FALSE;
+			break;
+		}
+		saved[i].FETCH_ENABLED = ckpt_get32(&r);
+		saved[i].STALL_COUNT = ckpt_get64(&r);
+		saved[i].BUBBLE_COUNT = ckpt_get64(&r);
+		saved[i].FORWARD_COUNT = ckpt_get64(&r);
+		saved[i].FETCH_SEQ = ckpt_get64(&r);
+	}
+
+	/* then the pages */
+	while (r.ok && (address = ckpt_get32(&r)) != CHECKPOINT_END) {
+		if (pages == capacity) {
+			uint32_t grown = capacity ? 2 * capacity : 64;
+			uint32_t *new_addresses = realloc(addresses, grown * sizeof(uint32_t));
+			uint8_t *new_code, *new_data;
+			if (new_addresses != NULL) {
+				addresses = new_addresses;
+			}
+			new_code = realloc(code, grown);
+			if (new_code != NULL) {
+				code = new_code;
+			}
+			new_data = realloc(data, (size_t)grown * MEM_PAGE_SIZE);
+			if (new_data != NULL) {
+				data = new_data;
+			}
+			/* a failed realloc leaves the old buffer in place for done: to free */
+			if (new_addresses == NULL || new_code == NULL || new_data == NULL) {
+				printf("Error: Out of memory restoring checkpoint\n");
+				goto done;
+			}
+			capacity = grown;
+		}
+		addresses[pages] = address;
+		code[pages] = ckpt_get32(&r) != 0;
+		if (!r.ok || (address & MEM_PAGE_MASK) != 0 ||
+			!ckpt_unpack_page(&r, ckpt_get32(&r), &data[(size_t)pages * MEM_PAGE_SIZE])) {
+			r.ok = FALSE;
+			break;
+		}
+		pages++;
+	}
+	if (!r.ok) {
+		printf("Error: Checkpoint %s is truncated or corrupt\n", path);
+		goto done;
+	}
+
+	/* everything parsed: replace memory, then the cores */
+	free_memory(sim);
+	for (i = 0; i < pages; i++) {
+		memcpy(mem_page_alloc(sim, addresses[i]), &data[(size_t)i * MEM_PAGE_SIZE], MEM_PAGE_SIZE);
+		mem_mark_dirty(sim, addresses[i]); // differs from the loaded program as far as reset knows
+	}
+	for (i = 0; i < pages; i++) {
+		if (code[i]) {
+			predecode_page(sim, addresses[i]);
+		}
+	}
+	for (i = 0; i < num_cores; i++) {
+		MIPS_Sim* core = cores[i];
+		core->CURRENT_STATE = saved[i].CURRENT_STATE;
+		core->NEXT_STATE = saved[i].NEXT_STATE;
+		memcpy(core->IF_ID, saved[i].IF_ID, sizeof(core->IF_ID));
+		memcpy(core->ID_EX, saved[i].ID_EX, sizeof(core->ID_EX));
+		memcpy(core->EX_MEM, saved[i].EX_MEM, sizeof(core->EX_MEM));
+		memcpy(core->MEM_WB, saved[i].MEM_WB, sizeof(core->MEM_WB));
+		core->ISSUE_WIDTH = saved[i].ISSUE_WIDTH;
+		core->INSTRUCTION_COUNT = saved[i].INSTRUCTION_COUNT;
+		core->CYCLE_COUNT = saved[i].CYCLE_COUNT;
+		core->FF_INSTRUCTION_COUNT = saved[i].FF_INSTRUCTION_COUNT;
+		core->RUN_FLAG = saved[i].RUN_FLAG;
+		core->FETCH_ENABLED = saved[i].FETCH_ENABLED;
+		core->STALL_COUNT = saved[i].STALL_COUNT;
+		core->BUBBLE_COUNT = saved[i].BUBBLE_COUNT;
+		core->FORWARD_COUNT = saved[i].FORWARD_COUNT;
+		core->FETCH_SEQ = saved[i].FETCH_SEQ;
+		core->PROGRAM_SIZE = program_size;
+		/* caches and branch predictor are not saved: the run continues with them cold */
+		cache_invalidate(&core->ICACHE);
+		cache_invalidate(&core->DCACHE);
+		bpred_reset(&core->BPRED);
+		/* an exit syscall past EX still has to keep IF quiet */
+		core->EXITING = FALSE;
+		for (j = 0; j < (int)core->ISSUE_WIDTH; j++) {
+			core->EXITING |= (core->EX_MEM[j].VALID && core->EX_MEM[j].D.class == CLASS_SYSCALL && core->EX_MEM[j].ALUOutput == 0xA) ||
+				(core->MEM_WB[j].VALID && core->MEM_WB[j].D.class == CLASS_SYSCALL && core->MEM_WB[j].ALUOutput == 0xA);
+		}
+		core->STOP_REASON = core->RUN_FLAG ? STOP_NONE : saved[i].STOP_REASON;
+		if (core->CHECK.ENABLED) {
+			check_enable(core, TRUE);
+		}
+		core->FETCH_WAIT = core->MEM_WAIT = 0;
+		core->FETCH_FILLED = core->MEM_FILLED = FALSE;
+		sync_code(core);
+	}
+	printf("Checkpoint %s restored: %d core(s), %u pages.\n\n", path, num_cores, pages);
+	ok = TRUE;
+
+done:
+	free(saved);
+	free(addresses);
+	free(code);
+	free(data);
+	free(file);
+	return ok;
+}
+
+/************************************************************/
+/* Start (or stop) lockstep checking. The pipeline drains first so the         */
+/* reference starts from a retirement boundary with the same state.           */
+/************************************************************/
+void check_enable(MIPS_Sim* sim, int enabled)
+{
+	sim->CHECK.ENABLED = FALSE;
+	if (enabled) {
+		pipeline_drain(sim);
+		sim->CHECK.STATE = sim->CURRENT_STATE;
+		sim->CHECK.DIVERGED = FALSE;
+		sim->CHECK.ENABLED = TRUE;
+	}
+}
+
+static int writes_hilo(uint8_t op)
+{
+	return op == OP_MULT || op == OP_MULTU || op == OP_DIV || op == OP_DIVU || op == OP_MTHI || op == OP_MTLO;
+}
+
+/* first mismatch: report it with the instruction and stop the run */
+static void check_diverged(MIPS_Sim* sim, uint32_t pc, const char* what, uint32_t pipeline, uint32_t reference)
+{
+	printf("Lockstep check failed at retirement %llu (cycle %llu), PC 0x%08x: ",
+		(unsigned long long)sim->CHECK.CHECKED, (unsigned long long)sim->CYCLE_COUNT, pc);
+	print_instruction(sim, pc);
+	printf("  %s: pipeline 0x%08x, reference 0x%08x\n\n", what, pipeline, reference);
+	sim->CHECK.DIVERGED = TRUE;
+	sim_stop(sim, STOP_DIVERGED);
+}
+
+/************************************************************/
+/* WB just retired a MEM/WB slot: run the same instruction on the reference */
+/* and compare its PC, destination register, HI/LO and memory write.         */
+/* Memory is not written twice: loads re-read what the pipeline left (the   */
+/* instruction's own value, younger stores haven't reached MEM), stores are  */
+/* compared by address and data.                                                                */
+/************************************************************/
+void check_retire(MIPS_Sim* sim, const CPU_Pipeline_Reg* wb)
+{
+	const CPU_Pipeline_Reg* behind;
+	const Decoded_Instr* d = &wb->D;
+	CPU_State* ref = &sim->CHECK.STATE;
+	uint32_t pc = wb->PC - 4;
+	uint32_t address = ref->REGS[d->rs] + d->imm;
+	uint32_t mask;
+	Decoded_Instr plain;
+	char what[16];
+
+	if (sim->CHECK.DIVERGED) {
+		return; // only a drain can retire more; the reference stopped at the mismatch
+	}
+	sim->CHECK.CHECKED++;
+	if (ref->PC != pc) {
+		check_diverged(sim, pc, "PC", pc, ref->PC);
+		return;
+	}
+
+	switch (d->class) {
+		case (CLASS_LOAD):
+			if (wb->ALUOutput != address) {
+				check_diverged(sim, pc, "load address", wb->ALUOutput, address);
+				return;
+			}
+			// other cores may have written since MEM, and ll must not link again
+			if (sim->SYSTEM != NULL) {
+				ref->REGS[d->dest] = wb->LMD;
+			} else {
+				plain = *d;
+				plain.op = (d->op == OP_LL) ? OP_LW : d->op;
+				ref->REGS[d->dest] = mem_load(sim, &plain, address);
+			}
+			ref->PC += 4;
+		break;
+
+		case (CLASS_STORE):
+			mask = (d->op == OP_SB) ? 0xFF : (d->op == OP_SH) ? 0xFFFF : 0xFFFFFFFF;
+			if (wb->ALUOutput != address) {
+				check_diverged(sim, pc, "store address", wb->ALUOutput, address);
+				return;
+			}
+			if ((wb->B ^ ref->REGS[d->rt]) & mask) {
+				check_diverged(sim, pc, "store data", wb->B & mask, ref->REGS[d->rt] & mask);
+				return;
+			}
+			if (d->op == OP_SC) {
+				ref->REGS[d->dest] = wb->LMD; // the link belongs to the pipeline
+			}
+			ref->PC += 4;
+		break;
+
+		default:
+			functional_execute(sim, ref);
+		break;
+	}
+	ref->REGS[0] = 0;
+
+	if (ref->REGS[d->dest] != sim->NEXT_STATE.REGS[d->dest]) {
+		decode_machine_register(d->dest, what);
+		check_diverged(sim, pc, what, sim->NEXT_STATE.REGS[d->dest], ref->REGS[d->dest]);
+		return;
+	}
+
+	// HI/LO are written in EX: compare unless an instruction behind has already changed them
+	for (behind = wb + 1; behind < &sim->MEM_WB[sim->ISSUE_WIDTH] && !writes_hilo(behind->D.op); behind++);
+	if (behind == &sim->MEM_WB[sim->ISSUE_WIDTH]) {
+		for (behind = sim->EX_MEM; behind < &sim->EX_MEM[sim->ISSUE_WIDTH] && !writes_hilo(behind->D.op); behind++);
+	}
+	if (behind == &sim->EX_MEM[sim->ISSUE_WIDTH]) {
+		if (ref->HI != sim->NEXT_STATE.HI) {
+			check_diverged(sim, pc, "HI", sim->NEXT_STATE.HI, ref->HI);
+		} else if (ref->LO != sim->NEXT_STATE.LO) {
+			check_diverged(sim, pc, "LO", sim->NEXT_STATE.LO, ref->LO);
+		}
+	}
+}
+
+/* The stages below are inlined into handle_pipeline once per issue width */
+#define PIPELINE_STAGE	static inline __attribute__((always_inline))
+
+/************************************************************/
+/* writeback (WB) pipeline stage: retires the MEM/WB slots in order                */
+/************************************************************/
+PIPELINE_STAGE void WB(MIPS_Sim* sim, const uint32_t width)
+{
+	CPU_Pipeline_Reg* wb;
+	uint32_t i;
+
+	for (i = 0; i < width; i++) {
+		wb = &sim->MEM_WB[i];
+		WB_populate_destination(sim, wb, &wb->D);
+
+		// bubbles retire nothing, and only bubbles follow one
+		if (!wb->VALID) {
+			return;
+		}
+		sim->INSTRUCTION_COUNT++;
+		if (PERF_ON(sim)) {
+			sim->PERF.RETIRED++;
+			sim->PERF.RETIRED_OP[wb->D.op]++;
+		}
+		if (CHECK_ON(sim)) {
+			check_retire(sim, wb);
+		}
+		if (PROFILE_ON(sim)) {
+			profile_at(&sim->PROFILE, wb->PC - 4)->retired++;
+		}
+
+		// a runaway jump or fall-through: what retired was never part of the program
+		if (__builtin_expect(wb->PC - 4 - MEM_TEXT_BEGIN >= 4 * sim->PROGRAM_SIZE, 0)) {
+			printf("Stopped: fetched outside the loaded program (PC 0x%08x, text 0x%08x..0x%08x)\n\n",
+				wb->PC - 4, MEM_TEXT_BEGIN, MEM_TEXT_BEGIN + 4 * sim->PROGRAM_SIZE);
+			sim_stop(sim, STOP_BAD_FETCH);
+			return;
+		} else if (wb->D.class == CLASS_SYSCALL && wb->ALUOutput == 0xA) {
+			sim_stop(sim, STOP_EXIT); // everything older has retired; EXITING keeps IF quiet until a reset
+		}
+	}
+}
+
+/* The youngest instruction in a pipeline register that writes reg, or NULL */
+PIPELINE_STAGE const CPU_Pipeline_Reg* pipeline_writer(const CPU_Pipeline_Reg* latch, uint32_t width, uint8_t reg)
+{
+	while (width-- > 0) {
+		if (latch[width].D.dest == reg) {
+			return &latch[width];
+		}
+	}
+	return NULL;
+}
+
+/************************************************************/
+/* memory access (MEM) pipeline stage:                                                          */
+/************************************************************/
+PIPELINE_STAGE void MEM(MIPS_Sim* sim, const uint32_t width)
+{
+	CPU_Pipeline_Reg* access = NULL;
+	const CPU_Pipeline_Reg* retired;
+	CPU_Pipeline_Reg* ex_mem;
+	CPU_Pipeline_Reg* mem_wb;
+	uint32_t i;
+
+	// ID lets at most one load/store into a bundle
+	for (i = 0; i < width; i++) {
+		if (sim->EX_MEM[i].D.class == CLASS_LOAD || sim->EX_MEM[i].D.class == CLASS_STORE) {
+			access = &sim->EX_MEM[i];
+			break;
+		}
+	}
+
+	if (access != NULL) {
+		// Store data loaded by an instruction just ahead: MEM/WB -> MEM forward, ID didn't stall for it.
+		// MEM/WB still holds what WB just retired until it is overwritten below.
+		if (sim->FORWARDING && access->D.class == CLASS_STORE && access->D.rt != 0) {
+			retired = pipeline_writer(sim->MEM_WB, width, access->D.rt);
+			if (retired != NULL && (retired->D.class == CLASS_LOAD || retired->D.class == CLASS_STORE)) {
+				access->B = retired->LMD;
+				sim->FORWARD_COUNT++;
+			}
+		}
+
+		// D-cache miss: the access waits in EX/MEM, WB gets bubbles and the stages behind hold
+		if (sim->DCACHE.ENABLED && !sim->MEM_FILLED) {
+			sim->MEM_WAIT = cache_access(&sim->DCACHE, access->ALUOutput, access->D.class == CLASS_STORE);
+		}
+	}
+	sim->MEM_STALL = (sim->MEM_WAIT > 0);
+	if (sim->MEM_STALL) {
+		sim->MEM_WAIT--;
+		sim->MEM_FILLED = TRUE;
+		memset(&sim->MEM_WB, 0, sizeof(sim->MEM_WB));
+		sim->STALL_COUNT++;
+		sim->BUBBLE_COUNT++;
+		if (PERF_ON(sim)) {
+			sim->PERF.STALLS[STALL_DCACHE]++;
+		}
+		return;
+	}
+	sim->MEM_FILLED = FALSE;
+
+	for (i = 0; i < width; i++) {
+		ex_mem = &sim->EX_MEM[i];
+		mem_wb = &sim->MEM_WB[i];
+
+		// Get the current instruction
+		mem_wb->IR = ex_mem->IR;
+		mem_wb->D = ex_mem->D;
+		mem_wb->ALUOutput = ex_mem->ALUOutput;
+		mem_wb->B = ex_mem->B;
+		mem_wb->PC = ex_mem->PC;
+		mem_wb->SEQ = ex_mem->SEQ;
+		mem_wb->VALID = ex_mem->VALID;
+
+		// Perform the current memory operation
+		MEM_access(sim, mem_wb, &mem_wb->D, mem_wb->ALUOutput);
+	}
+}
+
+/************************************************************/
+/* execution (EX) pipeline stage:                                                                          */
+/************************************************************/
+PIPELINE_STAGE void EX(MIPS_Sim* sim, const uint32_t width)
+{
+	CPU_Pipeline_Reg* id_ex;
+	CPU_Pipeline_Reg* ex_mem;
+	uint32_t i;
+
+	if (sim->MEM_STALL) {
+		return;
+	}
+
+	for (i = 0; i < width; i++) {
+		id_ex = &sim->ID_EX[i];
+		ex_mem = &sim->EX_MEM[i];
+
+		// Get the current instruction & operands
+		ex_mem->IR = id_ex->IR;
+		ex_mem->D = id_ex->D;
+		ex_mem->A = id_ex->A;
+		ex_mem->B = id_ex->B;
+		ex_mem->imm = id_ex->imm;
+		ex_mem->PC = id_ex->PC;
+		ex_mem->PRED_TAKEN = id_ex->PRED_TAKEN;
+		ex_mem->PRED_PC = id_ex->PRED_PC;
+		ex_mem->PRED_HISTORY = id_ex->PRED_HISTORY;
+		ex_mem->SEQ = id_ex->SEQ;
+		ex_mem->VALID = id_ex->VALID;
+
+		// Perform the current operation and store the values
+		EX_perform_operation(sim, ex_mem, &ex_mem->D, ex_mem->A, ex_mem->B, ex_mem->imm);
+	}
+
+	return;
+}
+
+/************************************************************/
+/* Hazard unit: the value of a source register for an instruction in ID.         */
+/* Returns 1 if it was forwarded from EX/MEM or MEM/WB, 0 if it came from  */
+/* the register file, -1 if it isn't ready and ID must stall. late marks      */
+/* store data, which a load just ahead can still forward in MEM.                */
+/************************************************************/
+PIPELINE_STAGE int hazard_operand(MIPS_Sim* sim, const uint32_t width, uint8_t reg, int late, uint32_t* value)
+{
+	const CPU_Pipeline_Reg* ex_mem;
+	const CPU_Pipeline_Reg* mem_wb;
+
+	// WB wrote NEXT_STATE earlier this cycle: written in the first half, read in the second
+	*value = sim->NEXT_STATE.REGS[reg];
+	if (reg == 0) {
+		return 0;
+	}
+
+	// the bundle just ahead, EX done
+	ex_mem = pipeline_writer(sim->EX_MEM, width, reg);
+	if (ex_mem != NULL) {
+		if (!sim->FORWARDING) {
+			return -1;
+		}
+		if (ex_mem->D.class == CLASS_LOAD || ex_mem->D.class == CLASS_STORE) {
+			return late ? 0 : -1; // load-use: LMD arrives with MEM
+		}
+		*value = ex_mem->ALUOutput;
+		return 1;
+	}
+
+	// two ahead, MEM done
+	mem_wb = pipeline_writer(sim->MEM_WB, width, reg);
+	if (mem_wb != NULL) {
+		if (!sim->FORWARDING) {
+			return -1;
+		}
+		*value = (mem_wb->D.class == CLASS_LOAD || mem_wb->D.class == CLASS_STORE) ? mem_wb->LMD : mem_wb->ALUOutput;
+		return 1;
+	}
+	return 0;
+}
+
+/************************************************************/
+/* Pairing rules: can IF/ID slot n issue with slots 0..n-1, which are issuing? */
+/* Returns -1 if so, or the perf_issue_t that stops it.                                 */
+/************************************************************/
+static int issue_pairing(MIPS_Sim* sim, uint32_t n)
+{
+	const Decoded_Instr* d = &sim->IF_ID[n].D;
+	const Decoded_Instr* older;
+	uint8_t last = sim->IF_ID[n - 1].D.class;
+	int memory = (d->class == CLASS_LOAD || d->class == CLASS_STORE);
+	uint32_t i;
+
+	// a redirect resolved in EX only has to squash younger bundles
+	if (last == CLASS_BRANCH || last == CLASS_JUMP || last == CLASS_SYSCALL) {
+		return ISSUE_CONTROL;
+	}
+	for (i = 0; i < n; i++) {
+		older = &sim->IF_ID[i].D;
+		if (memory && (older->class == CLASS_LOAD || older->class == CLASS_STORE)) {
+			return ISSUE_MEMORY;
+		}
+		// nothing forwards within a bundle; HI/LO are read and written in EX
+		if (older->dest != 0 && (((d->reads & READS_RS) && d->rs == older->dest) || ((d->reads & READS_RT) && d->rt == older->dest))) {
+			return ISSUE_DEPENDENCY;
+		}
+		if ((d->op == OP_MFHI || d->op == OP_MFLO) && writes_hilo(older->op)) {
+			return ISSUE_DEPENDENCY;
+		}
+	}
+	return -1;
+}
+
+/************************************************************/
+/* instruction decode (ID) pipeline stage: issues IF/ID in order, as many    */
+/* slots as the pairing rules allow; the rest wait at the front of IF/ID       */
+/************************************************************/
+PIPELINE_STAGE void ID(MIPS_Sim* sim, const uint32_t width)
+{
+	CPU_Pipeline_Reg* in;
+	CPU_Pipeline_Reg* out;
+	uint32_t A, B, target, issued, i;
+	int a, b, limit = ISSUE_EMPTY;
+
+	if (sim->MEM_STALL) {
+		if (PERF_ON(sim)) {
+			sim->PERF.ISSUED[0]++;
+			sim->PERF.EMPTY_SLOTS[ISSUE_HELD] += width;
+		}
+		return;
+	}
+
+	// EX just found a misprediction: IF/ID was fetched down the wrong path
+	if (sim->BRANCH_SQUASH) {
+		sim->BRANCH_SQUASH = FALSE;
+		sim->HAZARD_STALL = FALSE;
+		memset(&sim->ID_EX, 0, sizeof(sim->ID_EX));
+		sim->BUBBLE_COUNT++;
+		if (PERF_ON(sim)) {
+			sim->PERF.ISSUED[0]++;
+			sim->PERF.EMPTY_SLOTS[ISSUE_HELD] += width;
+		}
+		return;
+	}
+
+	for (issued = 0; issued < width; issued++) {
+		in = &sim->IF_ID[issued];
+		if (!in->VALID) {
+			limit = ISSUE_EMPTY;
+			break;
+		}
+		if (issued > 0 && (limit = issue_pairing(sim, issued)) >= 0) {
+			break;
+		}
+
+		// ID/EX.A <= REGS[ IF/ID.IR[rs] ], ID/EX.B <= REGS[ IF/ID.IR[rt] ], through the hazard unit
+		A = B = 0;
+		a = b = 0;
+		if (in->D.reads & READS_RS) {
+			a = hazard_operand(sim, width, in->D.rs, FALSE, &A);
+		}
+		if (in->D.reads & READS_RT) {
+			b = hazard_operand(sim, width, in->D.rt, in->D.class == CLASS_STORE, &B);
+		}
+		if (a < 0 || b < 0) {
+			limit = ISSUE_OPERAND;
+			break;
+		}
+		sim->FORWARD_COUNT += a + b;
+
+		// Get the current instruction, already decoded at fetch
+		out = &sim->ID_EX[issued];
+		out->IR = in->IR;
+		out->D = in->D;
+		out->PC = in->PC;
+		out->A = A;
+		out->B = B;
+		out->PRED_TAKEN = in->PRED_TAKEN;
+		out->PRED_PC = in->PRED_PC;
+		out->PRED_HISTORY = in->PRED_HISTORY;
+		out->SEQ = in->SEQ;
+		out->VALID = TRUE;
+
+		// ID/EX.imm <= sign-extend( IF/ID.IR[imm. Field] )
+		out->imm = in->D.imm;
+
+		// Predicted taken but the BTB had no target: decode knows it for direct branches and jumps
+		if (in->PRED_TAKEN && branch_direct_target(in->PC - 4, &in->D, &target) && in->PRED_PC != target) {
+			out->PRED_PC = target;
+			bpred_repair(&sim->BPRED, in, TRUE);
+			sim->BPRED.ID_REDIRECTS++;
+			sim->BPRED.PENALTY_CYCLES++;
+			sim->BRANCH_REDIRECT = TRUE;
+			sim->REDIRECT_PC = target;
+		}
+	}
+	if (issued < width) {
+		memset(&sim->ID_EX[issued], 0, (width - issued) * sizeof(CPU_Pipeline_Reg));
+	}
+	if (PERF_ON(sim)) {
+		sim->PERF.ISSUED[issued]++;
+		sim->PERF.EMPTY_SLOTS[limit] += width - issued;
+	}
+
+	// An operand of the oldest isn't ready: hold IF/ID and the PC, send a bubble to EX
+	sim->HAZARD_STALL = (issued == 0 && limit == ISSUE_OPERAND);
+	if (sim->HAZARD_STALL) {
+		sim->STALL_COUNT++;
+		sim->BUBBLE_COUNT++;
+		if (PERF_ON(sim)) {
+			sim->PERF.STALLS[sim->FORWARDING ? STALL_LOAD_USE : STALL_NO_FORWARD]++;
+		}
+		return;
+	}
+
+	// what didn't issue moves to the front of IF/ID, IF refills the slots behind it
+	if (issued < width) {
+		memmove(&sim->IF_ID[0], &sim->IF_ID[issued], (width - issued) * sizeof(CPU_Pipeline_Reg));
+	}
+	for (i = width - issued; i < width; i++) {
+		sim->IF_ID[i].VALID = FALSE;
+	}
+
+	return;
+}
+
+/************************************************************/
+/* instruction fetch (IF) pipeline stage: fills the free IF/ID slots with        */
+/* sequential instructions, up to a predicted-taken branch or jump or the end */
+/* of the I-cache line                                                                                    */
+/************************************************************/
+PIPELINE_STAGE void IF(MIPS_Sim* sim, const uint32_t width)
+{
+	uint32_t pc = sim->CURRENT_STATE.PC;
+	CPU_Pipeline_Reg* reg;
+	uint32_t slot;
+
+	if (sim->BRANCH_REDIRECT) {
+		// a branch ahead redirected fetch: IF/ID is on the wrong path, drop any fill in progress
+		sim->BRANCH_REDIRECT = FALSE;
+		sim->NEXT_STATE.PC = sim->REDIRECT_PC;
+		sim->FETCH_WAIT = 0;
+		sim->FETCH_FILLED = FALSE;
+		memset(&sim->IF_ID, 0, sizeof(sim->IF_ID));
+		sim->BUBBLE_COUNT++;
+		return;
+	}
+
+	if (sim->HAZARD_STALL || sim->MEM_STALL) {
+		// ID is holding IF/ID, fetch it again next cycle
+		return;
+	}
+
+	if (!sim->FETCH_ENABLED || sim->EXITING) {
+		// draining, or the exit syscall is on its way to WB: feed bubbles and hold the PC
+		return;
+	}
+
+	// ID left what it couldn't issue at the front
+	for (slot = 0; slot < width && sim->IF_ID[slot].VALID; slot++);
+	if (slot == width) {
+		return;
+	}
+
+	// I-cache miss: bubbles until the line arrives, the PC stays put
+	if (sim->ICACHE.ENABLED && !sim->FETCH_FILLED) {
+		sim->FETCH_WAIT = cache_access(&sim->ICACHE, pc, FALSE);
+	}
+	if (sim->FETCH_WAIT > 0) {
+		sim->FETCH_WAIT--;
+		sim->FETCH_FILLED = TRUE;
+		sim->STALL_COUNT++;
+		sim->BUBBLE_COUNT++;
+		if (PERF_ON(sim)) {
+			sim->PERF.STALLS[STALL_ICACHE]++;
+		}
+		return;
+	}
+	sim->FETCH_FILLED = FALSE;
+
+	for (; slot < width; slot++) {
+		reg = &sim->IF_ID[slot];
+
+		// IR <= Mem[PC], taken from the predecoded copy of the text
+		reg->D = *fetch_decoded(sim, pc);
+		reg->IR = reg->D.word;
+		reg->VALID = TRUE;
+		reg->SEQ = ++sim->FETCH_SEQ;
+
+		// PC <= PC + 4, or wherever the branch predictor sends it
+		reg->PC = pc + 4;
+		reg->PRED_TAKEN = FALSE;
+		reg->PRED_PC = pc + 4;
+		if (reg->D.class == CLASS_BRANCH || reg->D.class == CLASS_JUMP) {
+			reg->PRED_PC = bpred_predict(sim, pc, &reg->D, &reg->PRED_TAKEN, &reg->PRED_HISTORY);
+		}
+		pc = reg->PRED_PC;
+		if (reg->PRED_TAKEN || pc != reg->PC || (sim->ICACHE.ENABLED && (pc >> sim->ICACHE.LINE_SHIFT) != (reg->PC - 4) >> sim->ICACHE.LINE_SHIFT)) {
+			break;
+		}
+	}
+	sim->NEXT_STATE.PC = pc;
+}
+
+/************************************************************/
+/* maintain the pipeline: each issue width runs its own copy of the stages,  */
+/* with the slot loops unrolled                                                                      */
+/************************************************************/
+void handle_pipeline(MIPS_Sim* sim)
+{
+	switch (sim->ISSUE_WIDTH) {
+		case 1:
+			WB(sim, 1);
+			MEM(sim, 1);
+			EX(sim, 1);
+			ID(sim, 1);
+			IF(sim, 1);
+		break;
+
+		case 2:
+			WB(sim, 2);
+			MEM(sim, 2);
+			EX(sim, 2);
+			ID(sim, 2);
+			IF(sim, 2);
+		break;
+
+		default:
+			WB(sim, MAX_ISSUE_WIDTH);
+			MEM(sim, MAX_ISSUE_WIDTH);
+			EX(sim, MAX_ISSUE_WIDTH);
+			ID(sim, MAX_ISSUE_WIDTH);
+			IF(sim, MAX_ISSUE_WIDTH);
+		break;
+	}
+}
+
+/************************************************************/
+/* Set the issue width, between bundles: the pipeline drains first               */
+/************************************************************/
+int issue_width_set(MIPS_Sim* sim, uint32_t width)
+{
+	if (width != 1 && width != 2 && width != 4) {
+		printf("Error: Issue width must be 1, 2 or 4\n");
+		return FALSE;
+	}
+	if (width != sim->ISSUE_WIDTH) {
+		pipeline_drain(sim);
+		sim->ISSUE_WIDTH = width;
+	}
+	return TRUE;
+}
+
+/************************************************************/
+/* Retire everything in flight without fetching, leaving empty pipeline regs  */
+/************************************************************/
+void pipeline_drain(MIPS_Sim* sim)
+{
+	static const CPU_Pipeline_Reg empty[MAX_ISSUE_WIDTH];
+
+	if (memcmp(sim->IF_ID, empty, sizeof(empty)) == 0 && memcmp(sim->ID_EX, empty, sizeof(empty)) == 0 &&
+		memcmp(sim->EX_MEM, empty, sizeof(empty)) == 0 && memcmp(sim->MEM_WB, empty, sizeof(empty)) == 0) {
+		return;
+	}
+
+	// stalls can stretch the drain past PIPELINE_DEPTH - 1 cycles
+	sim->FETCH_ENABLED = FALSE;
+	while (sim->IF_ID[0].VALID || sim->ID_EX[0].VALID || sim->EX_MEM[0].VALID || sim->MEM_WB[0].VALID) {
+		cycle(sim);
+	}
+	sim->FETCH_ENABLED = TRUE;
+	sim->FETCH_WAIT = 0; // a fetch the drain cut short starts over
+	sim->FETCH_FILLED = FALSE;
+	memset(&sim->IF_ID, 0, sizeof(sim->IF_ID));
+	memset(&sim->ID_EX, 0, sizeof(sim->ID_EX));
+	memset(&sim->EX_MEM, 0, sizeof(sim->EX_MEM));
+	memset(&sim->MEM_WB, 0, sizeof(sim->MEM_WB));
+}
+
+/************************************************************/
+/* Functional model: execute the instruction at PC to completion                  */
+/* directly against an architectural state and memory. Returns FALSE on exit. */
+/************************************************************/
+int functional_execute(MIPS_Sim* sim, CPU_State* state)
+{
+	const Decoded_Instr *d = fetch_decoded(sim, state->PC);
+	uint32_t *R = state->REGS;
+	uint32_t A = R[d->rs];
+	uint32_t B = R[d->rt];
+	uint32_t pc_next = state->PC + 4;
+	uint32_t branch_target = pc_next + (d->imm << 2);
+
+	switch (d->op) {
+		case (OP_NOP):
+		break;
+
+		case (OP_ADD):
+		case (OP_ADDU):		R[d->dest] = A + B; break;
+		case (OP_SUB):
+		case (OP_SUBU):		R[d->dest] = A - B; break;
+		case (OP_AND):		R[d->dest] = A & B; break;
+		case (OP_OR):		R[d->dest] = A | B; break;
+		case (OP_XOR):		R[d->dest] = A ^ B; break;
+		case (OP_NOR):		R[d->dest] = ~(A | B); break;
+		case (OP_SLT):		R[d->dest] = ((int32_t)A < (int32_t)B) ? 1 : 0; break;
+		case (OP_SLL):		R[d->dest] = B << d->shamt; break;
+		case (OP_SRL):		R[d->dest] = B >> d->shamt; break;
+		case (OP_SRA):		R[d->dest] = (uint32_t)((int32_t)B >> d->shamt); break;
+
+		case (OP_MULT): {
+			int64_t result = (int64_t)(int32_t)A * (int32_t)B;
+			state->HI = (uint64_t)result >> 32;
+			state->LO = (uint32_t)result;
+		break; }
+
+		case (OP_MULTU): {
+			uint64_t result = (uint64_t)A * B;
+			state->HI = result >> 32;
+			state->LO = (uint32_t)result;
+		break; }
+
+		case (OP_DIV):
+			if (A == 0x80000000 && B == 0xFFFFFFFF) {
+				state->LO = 0x80000000; // the quotient overflows, and would trap on the host
+				state->HI = 0;
+			} else if (B != 0) {
+				state->LO = (int32_t)A / (int32_t)B;
+				state->HI = (int32_t)A % (int32_t)B;
+			}
+		break;
+
+		case (OP_DIVU):
+			if (B != 0) {
+				state->LO = A / B;
+				state->HI = A % B;
+			}
+		break;
+
+		case (OP_MFHI):		R[d->dest] = state->HI; break;
+		case (OP_MFLO):		R[d->dest] = state->LO; break;
+		case (OP_MTHI):		state->HI = A; break;
+		case (OP_MTLO):		state->LO = A; break;
+
+		case (OP_JR):
+			pc_next = A;
+		break;
+
+		case (OP_JALR):
+			R[d->dest] = pc_next;
+			pc_next = A;
+		break;
+
+		case (OP_J):
+			pc_next = (pc_next & 0xF0000000) | (d->target << 2);
+		break;
+
+		case (OP_JAL):
+			R[31] = pc_next;
+			pc_next = (pc_next & 0xF0000000) | (d->target << 2);
+		break;
+
+		case (OP_BEQ):		if (A == B) pc_next = branch_target; break;
+		case (OP_BNE):		if (A != B) pc_next = branch_target; break;
+		case (OP_BLEZ):		if ((int32_t)A <= 0) pc_next = branch_target; break;
+		case (OP_BGTZ):		if ((int32_t)A > 0) pc_next = branch_target; break;
+		case (OP_BLTZ):		if ((int32_t)A < 0) pc_next = branch_target; break;
+		case (OP_BGEZ):		if ((int32_t)A >= 0) pc_next = branch_target; break;
+
+		case (OP_ADDI):
+		case (OP_ADDIU):	R[d->dest] = A + d->imm; break;
+		case (OP_SLTI):		R[d->dest] = ((int32_t)A < (int32_t)d->imm) ? 1 : 0; break;
+		case (OP_ANDI):		R[d->dest] = A & d->imm; break;
+		case (OP_ORI):		R[d->dest] = A | d->imm; break;
+		case (OP_XORI):		R[d->dest] = A ^ d->imm; break;
+		case (OP_LUI):		R[d->dest] = d->imm << 16; break;
+
+		case (OP_LB):
+		case (OP_LH):
+		case (OP_LW):
+		case (OP_LL):
+			R[d->dest] = mem_load(sim, d, A + d->imm);
+		break;
+
+		case (OP_SB):
+		case (OP_SH):
+		case (OP_SW):
+			mem_store(sim, d, A + d->imm, B);
+		break;
+
+		case (OP_SC):
+			R[d->dest] = mem_store_conditional(sim, A + d->imm, B);
+		break;
+
+		case (OP_SYSCALL):
+			if (R[2] == 0xA) { // SPIM exit
+				R[0] = 0;
+				state->PC = pc_next;
+				return FALSE;
+			}
+		break;
+
+		default:
+			printf("Error[functional_execute]: Invalid instruction 0x%08x at 0x%08x\n", d->word, state->PC);
+		break;
+	}
+
+	R[0] = 0;
+	state->PC = pc_next;
+	return TRUE;
+}
+
+/************************************************************/
+/* Functional model on CURRENT_STATE                                                                 */
+/************************************************************/
+int functional_step(MIPS_Sim* sim)
+{
+	return functional_execute(sim, &sim->CURRENT_STATE);
+}
+
+/************************************************************/
+/* Fast-forward with the functional model, then hand the architectural     */
+/* state back to the pipeline with empty pipeline registers                        */
+/************************************************************/
+void fast_forward(MIPS_Sim* sim, uint64_t max_instructions, int use_stop_pc, uint32_t stop_pc)
+{
+	uint64_t n = 0;
+	int exited = FALSE;
+	double start;
+
+	if (sim->RUN_FLAG == FALSE) {
+		printf("Simulation Stopped.\n\n");
+		return;
+	}
+
+	/* finish what the pipeline already started so nothing is lost or replayed */
+	pipeline_drain(sim);
+	sim->CURRENT_STATE = sim->NEXT_STATE;
+	if (sim->SYSTEM != NULL) {
+		sync_code(sim);
+	}
+	if (sim->RUN_FLAG == FALSE) { // the drain retired an exit, or hit a watchdog
+		return;
+	}
+	if (sim->INSTRUCTION_LIMIT != 0) {
+		uint64_t done = sim->INSTRUCTION_COUNT + sim->FF_INSTRUCTION_COUNT;
+		uint64_t left = done < sim->INSTRUCTION_LIMIT ? sim->INSTRUCTION_LIMIT - done : 0;
+		if (max_instructions > left) {
+			max_instructions = left;
+		}
+	}
+
+	start = host_seconds();
+	if (sim->JIT.ENABLED) {
+		n = jit_fast_forward(sim, max_instructions, use_stop_pc, stop_pc, &exited);
+	} else {
+		while (n < max_instructions) {
+			if (use_stop_pc && sim->CURRENT_STATE.PC == stop_pc) {
+				break;
+			}
+			n++;
+			if (!functional_step(sim)) {
+				exited = TRUE;
+				break;
+			}
+		}
+	}
+	if (exited) {
+		sim_stop(sim, STOP_EXIT);
+	}
+	sim->FF_INSTRUCTION_COUNT += n;
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	if (sim->CHECK.ENABLED && !sim->CHECK.DIVERGED) {
+		sim->CHECK.STATE = sim->CURRENT_STATE; // the reference skips ahead too
+	}
+
+	printf("Fast-forwarded %llu instructions, PC = 0x%08x%s\n", (unsigned long long)n,
+		sim->CURRENT_STATE.PC, sim->RUN_FLAG ? "" : " (program exited)");
+	report_host_rate(0, n, host_seconds() - start);
+	if (sim->RUN_FLAG && sim->INSTRUCTION_LIMIT != 0 && sim->INSTRUCTION_COUNT + sim->FF_INSTRUCTION_COUNT >= sim->INSTRUCTION_LIMIT) {
+		printf("Stopped: watchdog limit reached (%llu instructions), PC 0x%08x\n\n",
+			(unsigned long long)(sim->INSTRUCTION_COUNT + sim->FF_INSTRUCTION_COUNT), sim->CURRENT_STATE.PC);
+		sim_stop(sim, STOP_WATCHDOG);
+	}
+}
+
+/************************************************************/
+/* Configure sampling from "key=value,..." (see SIMPOINT_DEFAULT_SPEC)     */
+/************************************************************/
+int simpoint_configure(simpoint_config_t* cfg, const char* spec)
+{
+	char buffer[256], *key, *value, *end, *save = NULL;
+	const char* specs[2] = { SIMPOINT_DEFAULT_SPEC, spec };
+	unsigned long long n;
+	int i;
+
+	memset(cfg, 0, sizeof(*cfg));
+	for (i = 0; i < 2; i++) {
+		snprintf(buffer, sizeof(buffer), "%s", specs[i] != NULL ? specs[i] : "");
+		for (key = strtok_r(buffer, ",", &save); key != NULL; key = strtok_r(NULL, ",", &save)) {
+			value = strchr(key, '=');
+			if (value == NULL) {
+				printf("Error: Sampling option '%s' needs a value\n", key);
+				return FALSE;
+			}
+			*value++ = '\0';
+			n = strtoull(value, &end, 0);
+			if (*end == 'k' || *end == 'K') {
+				n *= 1000;
+				end++;
+			} else if (*end == 'm' || *end == 'M') {
+				n *= 1000000;
+				end++;
+			}
+			if (*end != '\0' || end == value) {
+				printf("Error: Bad value '%s' for sampling option %s\n", value, key);
+				return FALSE;
+			} else if (strcmp(key, "interval") == 0) {
+				cfg->INTERVAL = n;
+			} else if (strcmp(key, "maxk") == 0) {
+				cfg->MAX_K = n;
+			} else if (strcmp(key, "warmup") == 0) {
+				cfg->WARMUP = n;
+			} else if (strcmp(key, "samples") == 0) {
+				cfg->SAMPLES = n;
+			} else if (strcmp(key, "seed") == 0) {
+				cfg->SEED = n;
+			} else if (strcmp(key, "verify") == 0) {
+				cfg->VERIFY = n != 0;
+			} else {
+				printf("Error: Unknown sampling option '%s'\n", key);
+				return FALSE;
+			}
+		}
+	}
+	if (cfg->INTERVAL == 0 || cfg->MAX_K == 0 || cfg->SAMPLES == 0) {
+		printf("Error: Sampling needs interval, maxk and samples of at least 1\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static uint64_t simpoint_random(uint64_t* state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/* weight of a block in one projected dimension: fixed for a seed, uniform in [-1, 1) */
+static double simpoint_projection(uint64_t seed, uint32_t block, int dim)
+{
+	uint64_t z = seed * 0x9E3779B97F4A7C15ULL + (uint64_t)block * SIMPOINT_DIMS + dim + 1;
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return (z >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+}
+
+static double simpoint_distance(const double* a, const double* b)
+{
+	double d = 0;
+	int j;
+	for (j = 0; j < SIMPOINT_DIMS; j++) {
+		d += (a[j] - b[j]) * (a[j] - b[j]);
+	}
+	return d;
+}
+
+/************************************************************/
+/* Functional pass over the whole program: the basic-block vector of each   */
+/* full interval, projected to SIMPOINT_DIMS. Blocks are named by their first */
+/* word; PCs outside the text share one block. Returns the interval count.     */
+/************************************************************/
+static uint32_t simpoint_profile(MIPS_Sim* sim, const simpoint_config_t* cfg, double** vectors, uint64_t* executed)
+{
+	uint32_t size = sim->PROGRAM_SIZE + 1;
+	uint32_t *counts = calloc(size, sizeof(uint32_t));
+	uint32_t *touched = malloc(size * sizeof(uint32_t));
+	uint32_t num_touched = 0, capacity = 0, n = 0, block, i;
+	uint64_t in_interval = 0;
+	double *v = NULL, w;
+	uint8_t class;
+	int running = TRUE, j;
+
+	if (counts == NULL || touched == NULL) {
+		printf("Error: Out of memory for basic-block vectors\n");
+		exit(-1);
+	}
+	*executed = 0;
+	block = sim->CURRENT_STATE.PC - MEM_TEXT_BEGIN < 4 * sim->PROGRAM_SIZE ? (sim->CURRENT_STATE.PC - MEM_TEXT_BEGIN) / 4 : size - 1;
+	while (running) {
+		class = fetch_decoded(sim, sim->CURRENT_STATE.PC)->class;
+		if (counts[block]++ == 0) {
+			touched[num_touched++] = block;
+		}
+		running = functional_step(sim);
+		(*executed)++;
+		if (__builtin_expect(sim->INSTRUCTION_LIMIT != 0, 0) && running && *executed >= sim->INSTRUCTION_LIMIT) {
+			printf("Stopped: watchdog limit reached while profiling (%llu instructions), PC 0x%08x\n\n",
+				(unsigned long long)*executed, sim->CURRENT_STATE.PC);
+			sim_stop(sim, STOP_WATCHDOG);
+			running = FALSE;
+		}
+
+		// the next instruction starts a block
+		if (class == CLASS_BRANCH || class == CLASS_JUMP || class == CLASS_SYSCALL) {
+			block = sim->CURRENT_STATE.PC - MEM_TEXT_BEGIN < 4 * sim->PROGRAM_SIZE ?
+				(sim->CURRENT_STATE.PC - MEM_TEXT_BEGIN) / 4 : size - 1;
+		}
+		if (++in_interval < cfg->INTERVAL) {
+			continue;
+		}
+		if (n == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			v = realloc(v, (size_t)capacity * SIMPOINT_DIMS * sizeof(double));
+			if (v == NULL) {
+				printf("Error: Out of memory for basic-block vectors\n");
+				exit(-1);
+			}
+		}
+		memset(&v[(size_t)n * SIMPOINT_DIMS], 0, SIMPOINT_DIMS * sizeof(double));
+		for (i = 0; i < num_touched; i++) {
+			w = (double)counts[touched[i]] / cfg->INTERVAL;
+			for (j = 0; j < SIMPOINT_DIMS; j++) {
+				v[(size_t)n * SIMPOINT_DIMS + j] += w * simpoint_projection(cfg->SEED, touched[i], j);
+			}
+			counts[touched[i]] = 0;
+		}
+		num_touched = 0;
+		in_interval = 0;
+		n++;
+	}
+	free(counts);
+	free(touched);
+	*vectors = v;
+	return n;
+}
+
+/************************************************************/
+/* k-means with k-means++ seeding; returns the summed squared distance        */
+/************************************************************/
+static double simpoint_kmeans(const double* x, uint32_t n, uint32_t k, uint64_t* rng, uint32_t* assign, double* centers)
+{
+	double *nearest = malloc(n * sizeof(double));
+	uint32_t *sizes = malloc(k * sizeof(uint32_t));
+	double total, pick, d, best, sse = 0;
+	uint32_t i, c, worst, iteration, changed = TRUE;
+	int j;
+
+	if (nearest == NULL || sizes == NULL) {
+		printf("Error: Out of memory clustering\n");
+		exit(-1);
+	}
+	memcpy(centers, &x[(simpoint_random(rng) % n) * SIMPOINT_DIMS], SIMPOINT_DIMS * sizeof(double));
+	for (i = 0; i < n; i++) {
+		nearest[i] = simpoint_distance(&x[(size_t)i * SIMPOINT_DIMS], centers);
+	}
+	for (c = 1; c < k; c++) {
+		// next center with probability proportional to the squared distance to the closest one so far
+		for (total = 0, i = 0; i < n; i++) {
+			total += nearest[i];
+		}
+		pick = total * (simpoint_random(rng) >> 11) * (1.0 / 9007199254740992.0);
+		for (i = 0; i + 1 < n && pick >= nearest[i]; i++) {
+			pick -= nearest[i];
+		}
+		memcpy(&centers[c * SIMPOINT_DIMS], &x[(size_t)i * SIMPOINT_DIMS], SIMPOINT_DIMS * sizeof(double));
+		for (i = 0; i < n; i++) {
+			d = simpoint_distance(&x[(size_t)i * SIMPOINT_DIMS], &centers[c * SIMPOINT_DIMS]);
+			if (d < nearest[i]) {
+				nearest[i] = d;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		assign[i] = k;
+	}
+	for (iteration = 0; iteration < SIMPOINT_KMEANS_ITERATIONS && changed; iteration++) {
+		changed = FALSE;
+		for (i = 0; i < n; i++) {
+			for (best = -1, c = 0; c < k; c++) {
+				d = simpoint_distance(&x[(size_t)i * SIMPOINT_DIMS], &centers[c * SIMPOINT_DIMS]);
+				if (best < 0 || d < best) {
+					best = d;
+					if (assign[i] != c) {
+						assign[i] = c;
+						changed = TRUE;
+					}
+				}
+			}
+			nearest[i] = best;
+		}
+		memset(centers, 0, k * SIMPOINT_DIMS * sizeof(double));
+		memset(sizes, 0, k * sizeof(uint32_t));
+		for (i = 0; i < n; i++) {
+			sizes[assign[i]]++;
+			for (j = 0; j < SIMPOINT_DIMS; j++) {
+				centers[assign[i] * SIMPOINT_DIMS + j] += x[(size_t)i * SIMPOINT_DIMS + j];
+			}
+		}
+		for (c = 0; c < k; c++) {
+			if (sizes[c] == 0) {
+				// empty: restart it on the point worst served by its center
+				for (worst = 0, i = 1; i < n; i++) {
+					if (nearest[i] > nearest[worst]) {
+						worst = i;
+					}
+				}
+				memcpy(&centers[c * SIMPOINT_DIMS], &x[(size_t)worst * SIMPOINT_DIMS], SIMPOINT_DIMS * sizeof(double));
+				nearest[worst] = 0;
+				changed = TRUE;
+				continue;
+			}
+			for (j = 0; j < SIMPOINT_DIMS; j++) {
+				centers[c * SIMPOINT_DIMS + j] /= sizes[c];
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		sse += simpoint_distance(&x[(size_t)i * SIMPOINT_DIMS], &centers[assign[i] * SIMPOINT_DIMS]);
+	}
+	free(nearest);
+	free(sizes);
+	return sse;
+}
+
+/* Bayesian information criterion of a clustering under spherical Gaussians (X-means) */
+static double simpoint_bic(uint32_t n, uint32_t k, const uint32_t* assign, double sse)
+{
+	double variance, l = 0, rc;
+	uint32_t *sizes = calloc(k, sizeof(uint32_t));
+	uint32_t i, c;
+
+	if (sizes == NULL) {
+		printf("Error: Out of memory clustering\n");
+		exit(-1);
+	}
+	for (i = 0; i < n; i++) {
+		sizes[assign[i]]++;
+	}
+	variance = n > k ? sse / (n - k) : 0;
+	if (variance < 1e-12) {
+		variance = 1e-12; // a perfect fit: every further cluster only costs parameters
+	}
+	for (c = 0; c < k; c++) {
+		rc = sizes[c];
+		if (rc > 0) {
+			l += -rc / 2 * log(2 * M_PI) - rc * SIMPOINT_DIMS / 2 * log(variance) - (rc - k) / 2 + rc * log(rc) - rc * log(n);
+		}
+	}
+	free(sizes);
+	return l - k * (SIMPOINT_DIMS + 1) / 2.0 * log(n);
+}
+
+/************************************************************/
+/* Simulate [start, start + length) in detail, after warmup detailed           */
+/* instructions; returns its CPI, or -1 if the program ended before it        */
+/************************************************************/
+static double simpoint_measure(MIPS_Sim* sim, uint64_t start, uint64_t warmup, uint64_t length)
+{
+	uint64_t position, cycles, retired, begin = start > warmup ? start - warmup : 0;
+
+	position = sim->INSTRUCTION_COUNT + sim->FF_INSTRUCTION_COUNT;
+	if (position > start) {
+		reset(sim); // the previous sample ran past this one's start
+		position = 0;
+	}
+	if (begin > position) {
+		// a sample right after the last one just keeps the warm pipeline going
+		pipeline_drain(sim);
+		sim->CURRENT_STATE = sim->NEXT_STATE;
+		position = sim->INSTRUCTION_COUNT + sim->FF_INSTRUCTION_COUNT;
+		if (begin > position) {
+			fast_forward(sim, begin - position, FALSE, 0);
+		}
+	}
+	while (sim->RUN_FLAG && sim->INSTRUCTION_COUNT + sim->FF_INSTRUCTION_COUNT < start) {
+		cycle(sim);
+	}
+	cycles = sim->CYCLE_COUNT;
+	retired = sim->INSTRUCTION_COUNT;
+	while (sim->RUN_FLAG && sim->INSTRUCTION_COUNT - retired < length) {
+		cycle(sim);
+	}
+	if (sim->INSTRUCTION_COUNT == retired) {
+		return -1;
+	}
+	return (double)(sim->CYCLE_COUNT - cycles) / (sim->INSTRUCTION_COUNT - retired);
+}
+
+typedef struct {
+	uint32_t interval;
+	uint32_t cluster;
+	double cpi;
+} simpoint_sample_t;
+
+static int simpoint_sample_compare(const void* a, const void* b)
+{
+	const simpoint_sample_t* x = a;
+	const simpoint_sample_t* y = b;
+	return (x->interval > y->interval) - (x->interval < y->interval);
+}
+
+/************************************************************/
+/* Sampled simulation of the whole program: profile, cluster, simulate the */
+/* chosen intervals in detail and extrapolate the CPI                              */
+/************************************************************/
+int simpoint_run(MIPS_Sim* sim, const char* spec)
+{
+	simpoint_config_t cfg;
+	double *x = NULL, *centers, *best_centers, *bic, *distance;
+	uint32_t *assign, *best_assign, *all_assign, *sizes, *taken;
+	simpoint_sample_t *samples;
+	uint32_t n, k, max_k, chosen, c, i, s, run, num_samples = 0;
+	uint64_t executed, rng, detailed, cycles;
+	double sse, best_sse, lo, hi, estimate = 0, variance = 0, cpi, sum, sum2, t0, t1, t2, t3;
+	int error_known = TRUE;
+
+	if (sim->SYSTEM != NULL) {
+		printf("Error: Sampled simulation needs a single core\n");
+		return FALSE;
+	}
+	if (!simpoint_configure(&cfg, spec)) {
+		return FALSE;
+	}
+
+	/* 1: basic-block vectors from a functional run of the whole program */
+	t0 = host_seconds();
+	reset(sim);
+	n = simpoint_profile(sim, &cfg, &x, &executed);
+	if (sim->STOP_REASON == STOP_WATCHDOG) {
+		free(x);
+		return TRUE; // not a usage error: the watchdog stop is the run's status
+	}
+	reset(sim);
+	t1 = host_seconds();
+	printf("Profiled %llu instructions: %u intervals of %llu (%llu left in the last, not sampled)\n",
+		(unsigned long long)executed, n, (unsigned long long)cfg.INTERVAL, (unsigned long long)(executed - (uint64_t)n * cfg.INTERVAL));
+	if (n == 0) {
+		printf("Error: The program is shorter than one interval\n");
+		free(x);
+		return FALSE;
+	}
+
+	/* 2: k-means for k = 1..maxk, keep the smallest k that scores close to the best BIC */
+	max_k = cfg.MAX_K < n ? cfg.MAX_K : n;
+	centers = malloc((size_t)max_k * SIMPOINT_DIMS * sizeof(double));
+	best_centers = malloc((size_t)max_k * max_k * SIMPOINT_DIMS * sizeof(double));
+	assign = malloc(n * sizeof(uint32_t));
+	best_assign = malloc((size_t)n * max_k * sizeof(uint32_t));
+	bic = malloc(max_k * sizeof(double));
+	if (centers == NULL || best_centers == NULL || assign == NULL || best_assign == NULL || bic == NULL) {
+		printf("Error: Out of memory clustering\n");
+		exit(-1);
+	}
+	rng = cfg.SEED * 0x9E3779B97F4A7C15ULL + 1;
+	for (k = 1; k <= max_k; k++) {
+		best_sse = -1;
+		for (run = 0; run < SIMPOINT_KMEANS_RUNS; run++) {
+			sse = simpoint_kmeans(x, n, k, &rng, assign, centers);
+			if (best_sse < 0 || sse < best_sse) {
+				best_sse = sse;
+				memcpy(&best_assign[(size_t)(k - 1) * n], assign, n * sizeof(uint32_t));
+				memcpy(&best_centers[(size_t)(k - 1) * max_k * SIMPOINT_DIMS], centers, k * SIMPOINT_DIMS * sizeof(double));
+			}
+		}
+		bic[k - 1] = simpoint_bic(n, k, &best_assign[(size_t)(k - 1) * n], best_sse);
+	}
+	for (lo = hi = bic[0], k = 1; k < max_k; k++) {
+		lo = bic[k] < lo ? bic[k] : lo;
+		hi = bic[k] > hi ? bic[k] : hi;
+	}
+	for (chosen = 1; chosen < max_k && bic[chosen - 1] < lo + SIMPOINT_BIC_THRESHOLD * (hi - lo); chosen++);
+	all_assign = &best_assign[(size_t)(chosen - 1) * n];
+	centers = memcpy(centers, &best_centers[(size_t)(chosen - 1) * max_k * SIMPOINT_DIMS], chosen * SIMPOINT_DIMS * sizeof(double));
+	t2 = host_seconds();
+
+	/* 3: the intervals closest to each centroid, simulated in program order */
+	sizes = calloc(chosen, sizeof(uint32_t));
+	taken = calloc(n, sizeof(uint32_t));
+	distance = malloc(n * sizeof(double));
+	samples = malloc((size_t)chosen * cfg.SAMPLES * sizeof(simpoint_sample_t));
+	if (sizes == NULL || taken == NULL || distance == NULL || samples == NULL) {
+		printf("Error: Out of memory clustering\n");
+		exit(-1);
+	}
+	for (i = 0; i < n; i++) {
+		sizes[all_assign[i]]++;
+		distance[i] = simpoint_distance(&x[(size_t)i * SIMPOINT_DIMS], &centers[all_assign[i] * SIMPOINT_DIMS]);
+	}
+	for (c = 0; c < chosen; c++) {
+		for (s = 0; s < cfg.SAMPLES && s < sizes[c]; s++) {
+			uint32_t closest = n;
+			for (i = 0; i < n; i++) {
+				if (all_assign[i] == c && !taken[i] && (closest == n || distance[i] < distance[closest])) {
+					closest = i;
+				}
+			}
+			taken[closest] = TRUE;
+			samples[num_samples].interval = closest;
+			samples[num_samples].cluster = c;
+			num_samples++;
+		}
+	}
+	qsort(samples, num_samples, sizeof(simpoint_sample_t), simpoint_sample_compare);
+	for (i = 0; i < num_samples; i++) {
+		samples[i].cpi = simpoint_measure(sim, (uint64_t)samples[i].interval * cfg.INTERVAL, cfg.WARMUP, cfg.INTERVAL);
+	}
+	t3 = host_seconds();
+
+	/* 4: weighted CPI; a cluster's spread comes from its samples (finite population) */
+	printf("\n-------------------------------------------------------------\n");
+	printf("Sampled Simulation: %u clusters (k by BIC, maxk %u)\n", chosen, max_k);
+	printf("-------------------------------------------------------------\n");
+	printf("[Cluster]\t[Weight]\t[Intervals (CPI)]\n");
+	for (c = 0; c < chosen; c++) {
+		uint32_t m = 0;
+		for (sum = sum2 = 0, i = 0; i < num_samples; i++) {
+			if (samples[i].cluster == c && samples[i].cpi >= 0) {
+				sum += samples[i].cpi;
+				sum2 += samples[i].cpi * samples[i].cpi;
+				m++;
+			}
+		}
+		printf("%u\t\t%.4f\t\t", c, (double)sizes[c] / n);
+		for (i = 0; i < num_samples; i++) {
+			if (samples[i].cluster == c) {
+				printf("%u (%.3f) ", samples[i].interval, samples[i].cpi);
+			}
+		}
+		printf("\n");
+		if (m == 0) {
+			error_known = FALSE;
+			continue;
+		}
+		cpi = sum / m;
+		estimate += (double)sizes[c] / n * cpi;
+		if (m < sizes[c]) {
+			if (m < 2) {
+				error_known = FALSE;
+			} else {
+				variance += ((double)sizes[c] / n) * ((double)sizes[c] / n) * ((sum2 - m * cpi * cpi) / (m - 1)) / m *
+					(1.0 - (double)m / sizes[c]);
+			}
+		}
+	}
+	detailed = (uint64_t)num_samples * (cfg.INTERVAL + cfg.WARMUP);
+	printf("-------------------------------------------------------------\n");
+	if (error_known) {
+		printf("Estimated CPI\t\t: %.4f +- %.4f (95%%, %.2f%%)\n", estimate, 1.96 * sqrt(variance),
+			estimate > 0 ? 100.0 * 1.96 * sqrt(variance) / estimate : 0.0);
+	} else {
+		printf("Estimated CPI\t\t: %.4f (no error estimate: needs samples=2 or more)\n", estimate);
+	}
+	printf("Detailed Instructions\t: %llu of %llu (%.2f%%, 1/%.0f)\n", (unsigned long long)detailed,
+		(unsigned long long)executed, 100.0 * detailed / executed, (double)executed / detailed);
+	printf("Host Time\t\t: profile %.3f s, clustering %.3f s, detailed %.3f s\n", t1 - t0, t2 - t1, t3 - t2);
+
+	if (cfg.VERIFY) {
+		reset(sim);
+		t0 = host_seconds();
+		cycles = sim->CYCLE_COUNT;
+		while (sim->RUN_FLAG) {
+			cycle(sim);
+		}
+		cpi = (double)(sim->CYCLE_COUNT - cycles) / sim->INSTRUCTION_COUNT;
+		printf("Full Detailed CPI\t: %.4f in %.3f s, sampling error %+.2f%%\n", cpi, host_seconds() - t0,
+			100.0 * (estimate - cpi) / cpi);
+	}
+	printf("-------------------------------------------------------------\n\n");
+
+	free(x);
+	free(centers);
+	free(best_centers);
+	free(assign);
+	free(best_assign);
+	free(bic);
+	free(sizes);
+	free(taken);
+	free(distance);
+	free(samples);
+	return TRUE;
+}
+
+/************************************************************/
+/* Interpret up to the end of the current basic block                                     */
+/************************************************************/
+uint64_t interpret_block(MIPS_Sim* sim, uint64_t max_instructions, int use_stop_pc, uint32_t stop_pc, int* exited)
+{
+	uint64_t n = 0;
+	uint8_t class;
+
+	while (n < max_instructions) {
+		if (use_stop_pc && sim->CURRENT_STATE.PC == stop_pc) {
+			break;
+		}
+		class = fetch_decoded(sim, sim->CURRENT_STATE.PC)->class;
+		n++;
+		if (!functional_step(sim)) {
+			*exited = TRUE;
+			break;
+		}
+		if (class == CLASS_BRANCH || class == CLASS_JUMP || class == CLASS_SYSCALL) {
+			break;
+		}
+	}
+	return n;
+}
+
+#ifdef JIT_SUPPORTED
+/************************************************************/
+/* x86-64 emitter. Translated code keeps no guest state in host registers:   */
+/* rbx = &sim->CURRENT_STATE, r12 = &sim->JIT.CTX, r13 = sim,                   */
+/* eax/ecx/edx/esi/edi are scratch.                                                               */
+/************************************************************/
+#define JIT_PC_OFF		((int32_t)offsetof(CPU_State, PC))
+#define JIT_REG_OFF(r)	((int32_t)(offsetof(CPU_State, REGS) + 4 * (r)))
+#define JIT_HI_OFF		((int32_t)offsetof(CPU_State, HI))
+#define JIT_LO_OFF		((int32_t)offsetof(CPU_State, LO))
+
+static void jit_emit8(MIPS_Sim* sim, uint8_t b) { *sim->JIT.EMIT++ = b; }
+
+static void jit_emit32(MIPS_Sim* sim, uint32_t v) { memcpy(sim->JIT.EMIT, &v, 4); sim->JIT.EMIT += 4; }
+
+static void jit_emit64(MIPS_Sim* sim, uint64_t v) { memcpy(sim->JIT.EMIT, &v, 8); sim->JIT.EMIT += 8; }
+
+/* <op> reg32, [rbx + disp32], e.g. 0x8B = mov, 0x03 = add; reg 0 = eax, 1 = ecx, 6 = esi, 7 = edi */
+static void jit_emit_rbx(MIPS_Sim* sim, uint8_t op, int reg, int32_t disp)
+{
+	jit_emit8(sim, op);
+	jit_emit8(sim, 0x83 | (reg << 3));
+	jit_emit32(sim, disp);
+}
+
+/* jcc/jmp rel32 with an unresolved target; returns the rel32 to patch */
+static uint8_t* jit_emit_jump(MIPS_Sim* sim, uint8_t cc)
+{
+	if (cc == 0) {
+		jit_emit8(sim, 0xE9);
+	} else {
+		jit_emit8(sim, 0x0F);
+		jit_emit8(sim, cc);
+	}
+	jit_emit32(sim, 0);
+	return sim->JIT.EMIT - 4;
+}
+
+static void jit_patch(uint8_t *rel32, uint8_t *target)
+{
+	int32_t rel = (int32_t)(target - (rel32 + 4));
+	memcpy(rel32, &rel, 4);
+}
+
+/* PC <= pc; return to the dispatcher */
+static void jit_emit_bail(MIPS_Sim* sim, uint32_t pc)
+{
+	jit_emit8(sim, 0xC7); jit_emit8(sim, 0x83); jit_emit32(sim, JIT_PC_OFF); jit_emit32(sim, pc);
+	jit_patch(jit_emit_jump(sim, 0), sim->JIT.EPILOGUE);
+}
+
+/* PC <= target; jump straight to the target's block once it is translated */
+static void jit_emit_exit(MIPS_Sim* sim, uint32_t target)
+{
+	jit_entry_t *entry;
+	uint8_t *rel32;
+
+	jit_emit8(sim, 0xC7); jit_emit8(sim, 0x83); jit_emit32(sim, JIT_PC_OFF); jit_emit32(sim, target);
+	rel32 = jit_emit_jump(sim, 0);
+	entry = jit_lookup(sim, target, FALSE);
+	if (entry != NULL && entry->code != NULL) {
+		jit_patch(rel32, entry->code);
+		return;
+	}
+	jit_patch(rel32, sim->JIT.EPILOGUE);
+	if (sim->JIT.NUM_EXITS < JIT_MAX_EXITS) {
+		sim->JIT.EXITS[sim->JIT.NUM_EXITS].target = target;
+		sim->JIT.EXITS[sim->JIT.NUM_EXITS].patch = rel32;
+		sim->JIT.NUM_EXITS++;
+	}
+}
+
+/* fn(sim, esi, edx): mov rdi, r13; movabs rax, fn; call rax */
+static void jit_emit_call(MIPS_Sim* sim, void *fn)
+{
+	jit_emit8(sim, 0x4C); jit_emit8(sim, 0x89); jit_emit8(sim, 0xEF);
+	jit_emit8(sim, 0x48); jit_emit8(sim, 0xB8); jit_emit64(sim, (uint64_t)(uintptr_t)fn);
+	jit_emit8(sim, 0xFF); jit_emit8(sim, 0xD0);
+}
+
+/* mov [rbx + REGS[dest]], eax unless dest is $zero */
+static void jit_emit_writeback(MIPS_Sim* sim, int dest)
+{
+	if (dest != 0) {
+		jit_emit_rbx(sim, 0x89, 0, JIT_REG_OFF(dest));
+	}
+}
+
+/* Can this instruction be translated (branches and jumps end the block) */
+static int jit_can_translate(const Decoded_Instr *d)
+{
+	switch (d->op) {
+		case (OP_NOP):
+		case (OP_ADD): case (OP_ADDU): case (OP_SUB): case (OP_SUBU):
+		case (OP_AND): case (OP_OR): case (OP_XOR): case (OP_NOR):
+		case (OP_SLT): case (OP_SLL): case (OP_SRL): case (OP_SRA):
+		case (OP_MULT): case (OP_MULTU):
+		case (OP_MFHI): case (OP_MFLO): case (OP_MTHI): case (OP_MTLO):
+		case (OP_ADDI): case (OP_ADDIU): case (OP_SLTI):
+		case (OP_ANDI): case (OP_ORI): case (OP_XORI): case (OP_LUI):
+		case (OP_LW): case (OP_SW):
+		case (OP_J): case (OP_JAL): case (OP_JR): case (OP_JALR):
+		case (OP_BEQ): case (OP_BNE): case (OP_BLEZ): case (OP_BGTZ):
+		case (OP_BLTZ): case (OP_BGEZ):
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/* Emit host code for one non-control-flow instruction at pc */
+static void jit_emit_instruction(MIPS_Sim* sim, const Decoded_Instr *d, uint32_t pc)
+{
+	switch (d->op) {
+		case (OP_NOP):
+		break;
+
+		case (OP_ADD): case (OP_ADDU):
+		case (OP_SUB): case (OP_SUBU):
+		case (OP_AND): case (OP_OR): case (OP_XOR): case (OP_NOR): {
+			static const uint8_t alu[NUM_OPS] = {
+				[OP_ADD] = 0x03, [OP_ADDU] = 0x03, [OP_SUB] = 0x2B, [OP_SUBU] = 0x2B,
+				[OP_AND] = 0x23, [OP_OR] = 0x0B, [OP_XOR] = 0x33, [OP_NOR] = 0x0B,
+			};
+			if (d->dest == 0) {
+				break;
+			}
+			jit_emit_rbx(sim, 0x8B, 0, JIT_REG_OFF(d->rs));
+			jit_emit_rbx(sim, alu[d->op], 0, JIT_REG_OFF(d->rt));
+			if (d->op == OP_NOR) {
+				jit_emit8(sim, 0xF7); jit_emit8(sim, 0xD0);	// not eax
+			}
+			jit_emit_writeback(sim, d->dest);
+		break; }
+
+		case (OP_SLT):
+			if (d->dest == 0) {
+				break;
+			}
+			jit_emit_rbx(sim, 0x8B, 1, JIT_REG_OFF(d->rs));		// mov ecx, rs
+			jit_emit8(sim, 0x31); jit_emit8(sim, 0xC0);				// xor eax, eax
+			jit_emit_rbx(sim, 0x3B, 1, JIT_REG_OFF(d->rt));		// cmp ecx, rt
+			jit_emit8(sim, 0x0F); jit_emit8(sim, 0x9C); jit_emit8(sim, 0xC0);	// setl al
+			jit_emit_writeback(sim, d->dest);
+		break;
+
+		case (OP_SLL): case (OP_SRL): case (OP_SRA): {
+			static const uint8_t shift[NUM_OPS] = { [OP_SLL] = 0xE0, [OP_SRL] = 0xE8, [OP_SRA] = 0xF8 };
+			if (d->dest == 0) {
+				break;
+			}
+			jit_emit_rbx(sim, 0x8B, 0, JIT_REG_OFF(d->rt));
+			jit_emit8(sim, 0xC1); jit_emit8(sim, shift[d->op]); jit_emit8(sim, d->shamt);
+			jit_emit_writeback(sim, d->dest);
+		break; }
+
+		case (OP_MULT):
+			jit_emit8(sim, 0x48); jit_emit_rbx(sim, 0x63, 0, JIT_REG_OFF(d->rs));	// movsxd rax, rs
+			jit_emit8(sim, 0x48); jit_emit_rbx(sim, 0x63, 1, JIT_REG_OFF(d->rt));	// movsxd rcx, rt
+			jit_emit8(sim, 0x48); jit_emit8(sim, 0x0F); jit_emit8(sim, 0xAF); jit_emit8(sim, 0xC1);	// imul rax, rcx
+			jit_emit_rbx(sim, 0x89, 0, JIT_LO_OFF);
+			jit_emit8(sim, 0x48); jit_emit8(sim, 0xC1); jit_emit8(sim, 0xE8); jit_emit8(sim, 32);	// shr rax, 32
+			jit_emit_rbx(sim, 0x89, 0, JIT_HI_OFF);
+		break;
+
+		case (OP_MULTU):
+			jit_emit_rbx(sim, 0x8B, 0, JIT_REG_OFF(d->rs));	// zero-extends into rax
+			jit_emit_rbx(sim, 0x8B, 1, JIT_REG_OFF(d->rt));
+			jit_emit8(sim, 0x48); jit_emit8(sim, 0x0F); jit_emit8(sim, 0xAF); jit_emit8(sim, 0xC1);
+			jit_emit_rbx(sim, 0x89, 0, JIT_LO_OFF);
+			jit_emit8(sim, 0x48); jit_emit8(sim, 0xC1); jit_emit8(sim, 0xE8); jit_emit8(sim, 32);
+			jit_emit_rbx(sim, 0x89, 0, JIT_HI_OFF);
+		break;
+
+		case (OP_MFHI):
+		case (OP_MFLO):
+			if (d->dest == 0) {
+				break;
+			}
+			jit_emit_rbx(sim, 0x8B, 0, d->op == OP_MFHI ? JIT_HI_OFF : JIT_LO_OFF);
+			jit_emit_writeback(sim, d->dest);
+		break;
+
+		case (OP_MTHI):
+		case (OP_MTLO):
+			jit_emit_rbx(sim, 0x8B, 0, JIT_REG_OFF(d->rs));
+			jit_emit_rbx(sim, 0x89, 0, d->op == OP_MTHI ? JIT_HI_OFF : JIT_LO_OFF);
+		break;
+
+		case (OP_ADDI): case (OP_ADDIU):
+		case (OP_ANDI): case (OP_ORI): case (OP_XORI): {
+			static const uint8_t alu_imm[NUM_OPS] = {
+				[OP_ADDI] = 0x05, [OP_ADDIU] = 0x05, [OP_ANDI] = 0x25, [OP_ORI] = 0x0D, [OP_XORI] = 0x35,
+			};
+			if (d->dest == 0) {
+				break;
+			}
+			jit_emit_rbx(sim, 0x8B, 0, JIT_REG_OFF(d->rs));
+			jit_emit8(sim, alu_imm[d->op]); jit_emit32(sim, d->imm);	// <op> eax, imm32
+			jit_emit_writeback(sim, d->dest);
+		break; }
+
+		case (OP_SLTI):
+			if (d->dest == 0) {
+				break;
+			}
+			jit_emit_rbx(sim, 0x8B, 1, JIT_REG_OFF(d->rs));
+			jit_emit8(sim, 0x31); jit_emit8(sim, 0xC0);
+			jit_emit8(sim, 0x81); jit_emit8(sim, 0xF9); jit_emit32(sim, d->imm);	// cmp ecx, imm32
+			jit_emit8(sim, 0x0F); jit_emit8(sim, 0x9C); jit_emit8(sim, 0xC0);
+			jit_emit_writeback(sim, d->dest);
+		break;
+
+		case (OP_LUI):
+			if (d->dest == 0) {
+				break;
+			}
+			jit_emit8(sim, 0xB8); jit_emit32(sim, d->imm << 16);	// mov eax, imm32
+			jit_emit_writeback(sim, d->dest);
+		break;
+
+		case (OP_LW):
+			jit_emit_rbx(sim, 0x8B, 6, JIT_REG_OFF(d->rs));				// mov esi, rs
+			jit_emit8(sim, 0x81); jit_emit8(sim, 0xC6); jit_emit32(sim, d->imm);	// add esi, imm32
+			jit_emit_call(sim, (void *)mem_read_32);
+			jit_emit_writeback(sim, d->dest);
+		break;
+
+		case (OP_SW): {
+			uint8_t *rel32;
+			jit_emit_rbx(sim, 0x8B, 6, JIT_REG_OFF(d->rs));
+			jit_emit8(sim, 0x81); jit_emit8(sim, 0xC6); jit_emit32(sim, d->imm);
+			jit_emit_rbx(sim, 0x8B, 2, JIT_REG_OFF(d->rt));				// mov edx, rt
+			jit_emit_call(sim, (void *)mem_write_32);
+			// a store into code flushed the cache: stop before running stale code
+			jit_emit8(sim, 0x41); jit_emit8(sim, 0x80); jit_emit8(sim, 0x7C); jit_emit8(sim, 0x24);
+			jit_emit8(sim, offsetof(jit_ctx_t, flushed)); jit_emit8(sim, 0x00);	// cmp byte [r12+flushed], 0
+			rel32 = jit_emit_jump(sim, 0x84);							// je continue
+			jit_emit_bail(sim, pc + 4);
+			jit_patch(rel32, sim->JIT.EMIT);
+		break; }
+
+		default:
+		break;
+	}
+}
+
+/* Emit the control-flow instruction ending a block */
+static void jit_emit_terminator(MIPS_Sim* sim, const Decoded_Instr *d, uint32_t pc)
+{
+	uint32_t pc_next = pc + 4;
+	uint32_t branch_target = pc_next + (d->imm << 2);
+	uint8_t *not_taken;
+
+	switch (d->op) {
+		case (OP_J):
+			jit_emit_exit(sim, (pc_next & 0xF0000000) | (d->target << 2));
+		break;
+
+		case (OP_JAL):
+			jit_emit8(sim, 0xC7); jit_emit8(sim, 0x83); jit_emit32(sim, JIT_REG_OFF(31)); jit_emit32(sim, pc_next);
+			jit_emit_exit(sim, (pc_next & 0xF0000000) | (d->target << 2));
+		break;
+
+		case (OP_JR):
+		case (OP_JALR):
+			jit_emit_rbx(sim, 0x8B, 0, JIT_REG_OFF(d->rs));
+			if (d->op == OP_JALR && d->dest != 0) {
+				jit_emit8(sim, 0xC7); jit_emit8(sim, 0x83); jit_emit32(sim, JIT_REG_OFF(d->dest)); jit_emit32(sim, pc_next);
+			}
+			jit_emit_rbx(sim, 0x89, 0, JIT_PC_OFF);
+			jit_patch(jit_emit_jump(sim, 0), sim->JIT.EPILOGUE);
+		break;
+
+		case (OP_BEQ):
+		case (OP_BNE):
+			jit_emit_rbx(sim, 0x8B, 0, JIT_REG_OFF(d->rs));
+			jit_emit_rbx(sim, 0x3B, 0, JIT_REG_OFF(d->rt));
+			not_taken = jit_emit_jump(sim, d->op == OP_BEQ ? 0x85 : 0x84);	// jne / je
+			jit_emit_exit(sim, branch_target);
+			jit_patch(not_taken, sim->JIT.EMIT);
+			jit_emit_exit(sim, pc_next);
+		break;
+
+		case (OP_BLEZ):
+		case (OP_BGTZ):
+		case (OP_BLTZ):
+		case (OP_BGEZ): {
+			static const uint8_t skip[NUM_OPS] = {
+				[OP_BLEZ] = 0x8F, [OP_BGTZ] = 0x8E, [OP_BLTZ] = 0x8D, [OP_BGEZ] = 0x8C,	// jg/jle/jge/jl
+			};
+			jit_emit8(sim, 0x83); jit_emit8(sim, 0xBB); jit_emit32(sim, JIT_REG_OFF(d->rs)); jit_emit8(sim, 0);	// cmp dword rs, 0
+			not_taken = jit_emit_jump(sim, skip[d->op]);
+			jit_emit_exit(sim, branch_target);
+			jit_patch(not_taken, sim->JIT.EMIT);
+			jit_emit_exit(sim, pc_next);
+		break; }
+
+		default:
+		break;
+	}
+}
+
+/************************************************************/
+/* Map the code cache and emit the C <-> translated code trampoline          */
+/************************************************************/
+void jit_init(MIPS_Sim* sim)
+{
+	sim->JIT.CODE = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (sim->JIT.CODE == MAP_FAILED) {
+		printf("Warning: Can't map the translation cache, fast-forward will interpret\n");
+		sim->JIT.CODE = NULL;
+		sim->JIT.ENABLED = FALSE;
+		return;
+	}
+	sim->JIT.ENABLED = TRUE;
+	jit_flush(sim);
+}
+
+/************************************************************/
+/* Unmap the code cache                                                                                         */
+/************************************************************/
+void jit_release(MIPS_Sim* sim)
+{
+	if (sim->JIT.CODE != NULL) {
+		munmap(sim->JIT.CODE, JIT_CODE_SIZE);
+		sim->JIT.CODE = NULL;
+	}
+	sim->JIT.ENABLED = FALSE;
+}
+
+/************************************************************/
+/* Drop every translation (on code writes, reset, or a full cache)             */
+/************************************************************/
+void jit_flush(MIPS_Sim* sim)
+{
+	if (sim->JIT.CODE == NULL) {
+		return;
+	}
+	if (sim->JIT.BLOCKS > 0) {
+		memset(sim->JIT.TABLE, 0, sizeof(sim->JIT.TABLE));
+	}
+	sim->JIT.BLOCKS = 0;
+	sim->JIT.NUM_EXITS = 0;
+	sim->JIT.CTX.flushed = TRUE;
+
+	/* jit_enter(state = rdi, ctx = rsi, code = rdx, sim = rcx) */
+	sim->JIT.EMIT = sim->JIT.CODE;
+	jit_emit8(sim, 0x53);								// push rbx
+	jit_emit8(sim, 0x41); jit_emit8(sim, 0x54);				// push r12
+	jit_emit8(sim, 0x41); jit_emit8(sim, 0x55);				// push r13 (also keeps calls 16-byte aligned)
+	jit_emit8(sim, 0x48); jit_emit8(sim, 0x89); jit_emit8(sim, 0xFB);	// mov rbx, rdi
+	jit_emit8(sim, 0x49); jit_emit8(sim, 0x89); jit_emit8(sim, 0xF4);	// mov r12, rsi
+	jit_emit8(sim, 0x49); jit_emit8(sim, 0x89); jit_emit8(sim, 0xCD);	// mov r13, rcx
+	jit_emit8(sim, 0xFF); jit_emit8(sim, 0xE2);				// jmp rdx
+	sim->JIT.EPILOGUE = sim->JIT.EMIT;
+	jit_emit8(sim, 0x41); jit_emit8(sim, 0x5D);				// pop r13
+	jit_emit8(sim, 0x41); jit_emit8(sim, 0x5C);				// pop r12
+	jit_emit8(sim, 0x5B);								// pop rbx
+	jit_emit8(sim, 0xC3);								// ret
+	sim->JIT.CODE_USED = sim->JIT.EMIT - sim->JIT.CODE;
+}
+
+/************************************************************/
+/* Find (or create) the lookup table slot of a guest block                            */
+/************************************************************/
+jit_entry_t* jit_lookup(MIPS_Sim* sim, uint32_t pc, int insert)
+{
+	uint32_t i = (pc >> 2) & (JIT_TABLE_SIZE - 1);
+
+	while (sim->JIT.TABLE[i].pc != 0) {
+		if (sim->JIT.TABLE[i].pc == pc) {
+			return &sim->JIT.TABLE[i];
+		}
+		i = (i + 1) & (JIT_TABLE_SIZE - 1);
+	}
+	if (!insert) {
+		return NULL;
+	}
+	if (sim->JIT.BLOCKS >= JIT_TABLE_SIZE / 2) {
+		jit_flush(sim);
+		return jit_lookup(sim, pc, insert);
+	}
+	sim->JIT.BLOCKS++;
+	sim->JIT.TABLE[i].pc = pc;
+	return &sim->JIT.TABLE[i];
+}
+
+/************************************************************/
+/* Translate the basic block at pc; NULL if its first instruction can't be  */
+/************************************************************/
+uint8_t* jit_translate(MIPS_Sim* sim, uint32_t pc)
+{
+	const Decoded_Instr *d;
+	jit_entry_t *entry;
+	uint8_t *code, *bail, *stop;
+	uint32_t addr, n, i;
+
+	if (sim->JIT.CODE_USED + JIT_MAX_BLOCK_CODE > JIT_CODE_SIZE || sim->JIT.NUM_EXITS + 2 > JIT_MAX_EXITS ||
+		sim->JIT.BLOCKS + 1 >= JIT_TABLE_SIZE / 2) {
+		jit_flush(sim);
+	}
+
+	/* size the block: straight-line code up to and including a branch/jump */
+	for (n = 0, addr = pc; n < JIT_MAX_BLOCK; n++, addr += 4) {
+		if (n > 0 && addr == sim->JIT.CTX.stop_pc) {
+			break;
+		}
+		d = fetch_decoded(sim, addr);
+		if (!jit_can_translate(d)) {
+			break;
+		}
+		if (d->class == CLASS_BRANCH || d->class == CLASS_JUMP) {
+			n++;
+			break;
+		}
+	}
+	if (n == 0) {
+		return NULL;
+	}
+
+	code = sim->JIT.EMIT = sim->JIT.CODE + sim->JIT.CODE_USED;
+
+	/* entry: bail unless the budget covers the whole block and this isn't the stop PC */
+	jit_emit8(sim, 0x49); jit_emit8(sim, 0x81); jit_emit8(sim, 0x3C); jit_emit8(sim, 0x24); jit_emit32(sim, n);	// cmp qword [r12], n
+	bail = jit_emit_jump(sim, 0x8C);														// jl bail
+	jit_emit8(sim, 0x41); jit_emit8(sim, 0x81); jit_emit8(sim, 0x7C); jit_emit8(sim, 0x24);
+	jit_emit8(sim, offsetof(jit_ctx_t, stop_pc)); jit_emit32(sim, pc);						// cmp dword [r12+stop_pc], pc
+	stop = jit_emit_jump(sim, 0x84);														// je bail
+	jit_emit8(sim, 0x49); jit_emit8(sim, 0x81); jit_emit8(sim, 0x2C); jit_emit8(sim, 0x24); jit_emit32(sim, n);	// sub qword [r12], n
+
+	for (i = 0, addr = pc; i < n; i++, addr += 4) {
+		d = fetch_decoded(sim, addr);
+		if (d->class == CLASS_BRANCH || d->class == CLASS_JUMP) {
+			break;
+		}
+		jit_emit_instruction(sim, d, addr);
+	}
+	if (i < n) {
+		jit_emit_terminator(sim, d, addr);
+	} else {
+		jit_emit_exit(sim, addr);	// block ended before an untranslatable instruction
+	}
+
+	jit_patch(bail, sim->JIT.EMIT);
+	jit_patch(stop, sim->JIT.EMIT);
+	jit_emit_bail(sim, pc);
+
+	sim->JIT.CODE_USED = sim->JIT.EMIT - sim->JIT.CODE;
+	entry = jit_lookup(sim, pc, TRUE);
+	entry->code = code;
+
+	/* chain every earlier exit that was waiting for this block */
+	for (i = 0; i < sim->JIT.NUM_EXITS; i++) {
+		if (sim->JIT.EXITS[i].target == pc && sim->JIT.EXITS[i].patch != NULL) {
+			jit_patch(sim->JIT.EXITS[i].patch, code);
+			sim->JIT.EXITS[i].patch = NULL;
+		}
+	}
+	return code;
+}
+
+typedef void (*jit_enter_fn)(CPU_State *state, jit_ctx_t *ctx, uint8_t *code, MIPS_Sim *sim);
+
 /************************************************************/
-/* instruction fetch (IF) pipeline stage:                                                              */ 
-/************************************************************/
-void IF()
+/* Fast-forward through translated code, interpreting cold blocks                */
+/************************************************************/
+uint64_t jit_fast_forward(MIPS_Sim* sim, uint64_t max_instructions, int use_stop_pc, uint32_t stop_pc, int* exited)
 {
-	// IR <= Mem[PC] 
-	IF_ID.IR = mem_read_32(CURRENT_STATE.PC);
+	jit_enter_fn jit_enter = (jit_enter_fn)sim->JIT.CODE;
+	jit_entry_t *entry;
+	uint64_t n = 0;
+	int64_t budget, ran;
+	uint8_t *code;
+
+	if (!use_stop_pc) {
+		stop_pc = JIT_NO_STOP_PC;
+	}
+	if (sim->JIT.CTX.stop_pc != stop_pc) {
+		jit_flush(sim);	/* blocks may run through the new stop PC */
+		sim->JIT.CTX.stop_pc = stop_pc;
+	}
+
+	while (n < max_instructions && !*exited) {
+		if (sim->CURRENT_STATE.PC == stop_pc) {
+			break;
+		}
+		code = NULL;
+		if (sim->CURRENT_STATE.PC >= MEM_TEXT_BEGIN && sim->CURRENT_STATE.PC <= MEM_TEXT_END) {
+			entry = jit_lookup(sim, sim->CURRENT_STATE.PC, TRUE);
+			if (entry->code == NULL && entry->count >= 0 && ++entry->count >= JIT_HOT_THRESHOLD) {
+				entry->code = jit_translate(sim, sim->CURRENT_STATE.PC);
+				entry = jit_lookup(sim, sim->CURRENT_STATE.PC, TRUE);	/* the table may have been flushed */
+				if (entry->code == NULL) {
+					entry->count = -1;
+				}
+			}
+			code = entry->code;
+		}
+
+		ran = 0;
+		if (code != NULL) {
+			budget = max_instructions - n > INT64_MAX ? INT64_MAX : (int64_t)(max_instructions - n);
+			sim->JIT.CTX.budget = budget;
+			sim->JIT.CTX.flushed = FALSE;
+			jit_enter(&sim->CURRENT_STATE, &sim->JIT.CTX, code, sim);
+			ran = budget - sim->JIT.CTX.budget;
+			sim->JIT.TRANSLATED_INSTRUCTIONS += ran;
+			n += ran;
+		}
+		if (ran == 0) {	/* cold block, or not enough budget left for the whole block */
+			n += interpret_block(sim, max_instructions - n, use_stop_pc, stop_pc, exited);
+		}
+	}
+	return n;
+}
+
+#else
+
+void jit_init(MIPS_Sim* sim) { sim->JIT.ENABLED = FALSE; }
+
+void jit_release(MIPS_Sim* sim) { }
+
+void jit_flush(MIPS_Sim* sim) { }
+
+jit_entry_t* jit_lookup(MIPS_Sim* sim, uint32_t pc, int insert) { return NULL; }
+
+uint8_t* jit_translate(MIPS_Sim* sim, uint32_t pc) { return NULL; }
 
-	// PC <= PC + 4
-	IF_ID.PC = CURRENT_STATE.PC + 4;
+uint64_t jit_fast_forward(MIPS_Sim* sim, uint64_t max_instructions, int use_stop_pc, uint32_t stop_pc, int* exited)
+{
+	uint64_t n = 0;
+	while (n < max_instructions && !*exited) {
+		if (use_stop_pc && sim->CURRENT_STATE.PC == stop_pc) {
+			break;
+		}
+		n += interpret_block(sim, max_instructions - n, use_stop_pc, stop_pc, exited);
+	}
+	return n;
 }
 
+#endif
+
 void decode_all_operands(const uint32_t instruction,
 				uint32_t* opcode,
 				uint32_t* rs, 
@@ -468,107 +5215,218 @@ void decode_all_operands(const uint32_t instruction,
 }
 
 /**************************************************************/
-/* Isolates portions of 32-bit binary instruction to determine operands                                  */
-/* needed for Decode stage of pipeline       								                             */
+/* Predecode one instruction word into the form carried down the pipeline              */
 /**************************************************************/
-void ID_decode_operands(uint32_t instruction,
-				uint32_t* rs, 
-				uint32_t* rt, 
-				uint32_t* immediate)
-		{
-	uint32_t temp;
-	temp = instruction;
-	temp <<= 6;
-	temp >>= 27;
-	*rs = temp;
+void predecode_instruction(uint32_t instruction, Decoded_Instr* d) {
+	uint32_t opcode, rs, rt, rd, shamt, funct, immediate, address;
 
-	temp = instruction;
-	temp <<= 11;
-	temp >>= 27;
-	*rt = temp;
+	decode_all_operands(instruction, &opcode, &rs, &rt, &rd, &shamt, &funct, &immediate, &address);
 
-	temp = instruction;
-	temp <<= 16;
-	temp >>= 16;
-	*immediate = temp;		
+	memset(d, 0, sizeof(*d));
+	d->word = instruction;
+	d->rs = rs;
+	d->rt = rt;
+	d->rd = rd;
+	d->shamt = shamt;
+	d->target = address;
+	d->imm = (uint32_t)(int32_t)(int16_t)immediate;
+	d->op = OP_INVALID;
+	d->class = CLASS_NONE;
+
+	if (instruction == 0) {
+		d->op = OP_NOP;
+		return;
+	}
+
+	switch (opcode) {
+		// R-format
+		case (0x0):
+			d->class = CLASS_ALU;
+			d->dest = rd;
+			d->reads = READS_RS | READS_RT;
+			switch (funct) {
+				case (0x00): d->op = OP_SLL; d->reads = READS_RT; break;
+				case (0x02): d->op = OP_SRL; d->reads = READS_RT; break;
+				case (0x03): d->op = OP_SRA; d->reads = READS_RT; break;
+				case (0x20): d->op = OP_ADD; break;
+				case (0x21): d->op = OP_ADDU; break;
+				case (0x22): d->op = OP_SUB; break;
+				case (0x23): d->op = OP_SUBU; break;
+				case (0x24): d->op = OP_AND; break;
+				case (0x25): d->op = OP_OR; break;
+				case (0x26): d->op = OP_XOR; break;
+				case (0x27): d->op = OP_NOR; break;
+				case (0x2A): d->op = OP_SLT; break;
+
+				case (0x08): d->op = OP_JR; d->class = CLASS_JUMP; d->dest = 0; d->reads = READS_RS; break;
+				case (0x09): d->op = OP_JALR; d->class = CLASS_JUMP; d->reads = READS_RS; break;
+				case (0x0C): d->op = OP_SYSCALL; d->class = CLASS_SYSCALL; d->dest = 0; d->rs = 2; d->reads = READS_RS; break; // code in $v0
+
+				case (0x10): d->op = OP_MFHI; d->class = CLASS_HILO; d->reads = 0; break;
+				case (0x12): d->op = OP_MFLO; d->class = CLASS_HILO; d->reads = 0; break;
+				case (0x11): d->op = OP_MTHI; d->class = CLASS_HILO; d->dest = 0; d->reads = READS_RS; break;
+				case (0x13): d->op = OP_MTLO; d->class = CLASS_HILO; d->dest = 0; d->reads = READS_RS; break;
+				case (0x18): d->op = OP_MULT; d->class = CLASS_HILO; d->dest = 0; break;
+				case (0x19): d->op = OP_MULTU; d->class = CLASS_HILO; d->dest = 0; break;
+				case (0x1A): d->op = OP_DIV; d->class = CLASS_HILO; d->dest = 0; break;
+				case (0x1B): d->op = OP_DIVU; d->class = CLASS_HILO; d->dest = 0; break;
+
+				default:
+					d->class = CLASS_NONE;
+					d->dest = 0;
+					d->reads = 0;
+				break;
+			}
+		break;
+
+		// J-format
+		case (0x2): d->op = OP_J; d->class = CLASS_JUMP; break;
+		case (0x3): d->op = OP_JAL; d->class = CLASS_JUMP; d->dest = 31; break;
+
+		// I-format
+		case (0x1):  // bltz or bgez
+			d->op = (rt == 1) ? OP_BGEZ : OP_BLTZ;
+			d->class = CLASS_BRANCH;
+			d->reads = READS_RS;
+		break;
+		case (0x4): d->op = OP_BEQ; d->class = CLASS_BRANCH; d->reads = READS_RS | READS_RT; break;
+		case (0x5): d->op = OP_BNE; d->class = CLASS_BRANCH; d->reads = READS_RS | READS_RT; break;
+		case (0x6): d->op = OP_BLEZ; d->class = CLASS_BRANCH; d->reads = READS_RS; break;
+		case (0x7): d->op = OP_BGTZ; d->class = CLASS_BRANCH; d->reads = READS_RS; break;
+
+		case (0x8): d->op = OP_ADDI; d->class = CLASS_ALU; d->dest = rt; d->reads = READS_RS; break;
+		case (0x9): d->op = OP_ADDIU; d->class = CLASS_ALU; d->dest = rt; d->reads = READS_RS; break;
+		case (0xA): d->op = OP_SLTI; d->class = CLASS_ALU; d->dest = rt; d->reads = READS_RS; break;
+		// logical immediates are zero-extended
+		case (0xC): d->op = OP_ANDI; d->class = CLASS_ALU; d->dest = rt; d->imm = immediate; d->reads = READS_RS; break;
+		case (0xD): d->op = OP_ORI; d->class = CLASS_ALU; d->dest = rt; d->imm = immediate; d->reads = READS_RS; break;
+		case (0xE): d->op = OP_XORI; d->class = CLASS_ALU; d->dest = rt; d->imm = immediate; d->reads = READS_RS; break;
+		case (0xF): d->op = OP_LUI; d->class = CLASS_ALU; d->dest = rt; d->imm = immediate; break;
+
+		case (0x20): d->op = OP_LB; d->class = CLASS_LOAD; d->dest = rt; d->reads = READS_RS; break;
+		case (0x21): d->op = OP_LH; d->class = CLASS_LOAD; d->dest = rt; d->reads = READS_RS; break;
+		case (0x23): d->op = OP_LW; d->class = CLASS_LOAD; d->dest = rt; d->reads = READS_RS; break;
+		case (0x28): d->op = OP_SB; d->class = CLASS_STORE; d->reads = READS_RS | READS_RT; break;
+		case (0x29): d->op = OP_SH; d->class = CLASS_STORE; d->reads = READS_RS | READS_RT; break;
+		case (0x2B): d->op = OP_SW; d->class = CLASS_STORE; d->reads = READS_RS | READS_RT; break;
+		case (0x30): d->op = OP_LL; d->class = CLASS_LOAD; d->dest = rt; d->reads = READS_RS; break;
+		case (0x38): d->op = OP_SC; d->class = CLASS_STORE; d->dest = rt; d->reads = READS_RS | READS_RT; break; // rt <= success
+
+		default:
+		break;
+	}
 }
 
 /**************************************************************/
-/* Isolates portions of 32-bit binary instruction to determine operands                                  */
-/* needed for Execute stage of pipeline       								                             */
+/* Return the predecoded page holding an address, NULL if not decoded                */
 /**************************************************************/
-void EX_decode_operands(const uint32_t instruction,
-				uint32_t* opcode, 
-				uint32_t* shamt, 
-				uint32_t* funct,
-				uint32_t* addr) {
-	uint32_t temp;
-	temp = instruction;
-	temp >>= 26;
-	*opcode = temp;
-
-	temp = instruction;
-	temp <<= 21;
-	temp >>= 27;
-	*shamt = temp;	
+Decoded_Instr* decoded_page_lookup(MIPS_Sim* sim, uint32_t address) {
+	Decoded_Instr **table = __atomic_load_n(&sim->MEMORY->DECODE_DIR[address >> MEM_DIR_SHIFT], __ATOMIC_ACQUIRE);
+	if (table == NULL) {
+		return NULL;
+	}
+	return __atomic_load_n(&table[(address >> MEM_PAGE_SHIFT) & (MEM_TABLE_ENTRIES - 1)], __ATOMIC_ACQUIRE);
+}
 
-	temp = instruction;
-	temp <<= 26;
-	temp >>= 26;
-	*funct = temp;
+/**************************************************************/
+/* Predecode every word of the page holding an address                                           */
+/**************************************************************/
+Decoded_Instr* predecode_page(MIPS_Sim* sim, uint32_t address) {
+	MIPS_Memory *mem = sim->MEMORY;
+	Decoded_Instr ***table = &mem->DECODE_DIR[address >> MEM_DIR_SHIFT];
+	Decoded_Instr **slot;
+	Decoded_Instr *page;
+	uint32_t base = address & ~MEM_PAGE_MASK;
+	mem_tlb_entry_t *entry;
+	MIPS_Sim *core;
+	int i;
 
-	temp = instruction;
-	temp <<= 6;
-	temp >>= 6;
-	*addr = temp;		
+	pthread_mutex_lock(&mem->ALLOC_LOCK);
+	if (*table == NULL) {
+		Decoded_Instr **new_table = calloc(MEM_TABLE_ENTRIES, sizeof(Decoded_Instr *));
+		if (new_table == NULL) {
+			printf("Error: Out of memory allocating decode table\n");
+			exit(-1);
+		}
+		__atomic_store_n(table, new_table, __ATOMIC_RELEASE);
+	}
+	slot = &(*table)[(address >> MEM_PAGE_SHIFT) & (MEM_TABLE_ENTRIES - 1)];
+	page = *slot;
+	if (page == NULL) {
+		/* fill before publishing so other cores never fetch a half-decoded page */
+		page = malloc(DECODE_PAGE_WORDS * sizeof(Decoded_Instr));
+		if (page == NULL) {
+			printf("Error: Out of memory allocating decode page 0x%08x\n", base);
+			exit(-1);
+		}
+	}
+	for (i = 0; i < DECODE_PAGE_WORDS; i++) {
+		predecode_instruction(mem_read_32(sim, base + 4 * i), &page[i]);
+	}
+	__atomic_store_n(slot, page, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&mem->CODE_GENERATION, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&mem->ALLOC_LOCK);
+
+	/* stores through any core's TLB must now notice this page holds code: the */
+	/* other cores lose write access to it and look the page up on their next store */
+	for (i = 0; i < (sim->SYSTEM != NULL ? sim->SYSTEM->NUM_CORES : 1); i++) {
+		core = (sim->SYSTEM != NULL) ? sim->SYSTEM->CORES[i] : sim;
+		if (core == NULL) {
+			continue;
+		}
+		entry = &core->MEM_TLB[(address >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+		if (core == sim && entry->tag == (address >> MEM_PAGE_SHIFT)) {
+			entry->code = TRUE;
+		} else if (core != sim && __atomic_load_n(&entry->wtag, __ATOMIC_RELAXED) == (address >> MEM_PAGE_SHIFT)) {
+			__atomic_store_n(&entry->wtag, MEM_TLB_INVALID, __ATOMIC_RELEASE);
+		}
+	}
+	return page;
 }
 
 /**************************************************************/
-/* Isolates portions of 32-bit binary instruction to determine operands                                  */
-/* needed for Memory stage of pipeline       								                             */
+/* Re-decode the word at an address after a store into a predecoded page.    */
+/* The page stays allocated, since other cores may be fetching from it.           */
 /**************************************************************/
-void MEM_decode_operands(const uint32_t instruction,
-				uint32_t* opcode, 
-				uint32_t* address) {
-	uint32_t temp;
-	temp = instruction;
-	temp >>= 26;
-	*opcode = temp;
+void redecode_word(MIPS_Sim* sim, uint32_t address) {
+	Decoded_Instr *page = decoded_page_lookup(sim, address);
 
-	temp = instruction;
-	temp <<= 6;
-	temp >>= 6;
-	*address = temp;
+	if (page == NULL) {
+		return;
+	}
+	address &= ~3;
+	predecode_instruction(mem_read_32(sim, address), &page[(address & MEM_PAGE_MASK) >> 2]);
+	__atomic_add_fetch(&sim->MEMORY->CODE_GENERATION, 1, __ATOMIC_RELEASE);
+	jit_flush(sim); /* translations were built from the old word */
 }
 
 /**************************************************************/
-/* Isolates portions of 32-bit binary instruction to determine operands                                  */
-/* needed for Write Back stage of pipeline       								                         */
+/* Release every predecoded page                                                                               */
 /**************************************************************/
-void WB_decode_operands(const uint32_t instruction,
-				uint32_t* rt,
-				uint32_t* rd,
-				uint32_t* opcode, 
-				uint32_t* funct) {
-	uint32_t temp;
-	temp = instruction;
-	temp >>= 26;
-	*opcode = temp;
-
-	temp = instruction;
-	temp <<= 11;
-	temp >>= 27;
-	*rt = temp;
-	
-	temp = instruction;
-	temp <<= 16;
-	temp >>= 27;
-	*rd = temp;
+void free_decoded(MIPS_Sim* sim) {
+	int i, j;
+	for (i = 0; i < MEM_DIR_ENTRIES; i++) {
+		if (sim->MEMORY->DECODE_DIR[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+			free(sim->MEMORY->DECODE_DIR[i][j]);
+		}
+		free(sim->MEMORY->DECODE_DIR[i]);
+		sim->MEMORY->DECODE_DIR[i] = NULL;
+	}
+	jit_flush(sim);
+}
 
-	temp = instruction;
-	temp <<= 26;
-	temp >>= 26;
-	*funct = temp;
+/**************************************************************/
+/* Predecoded instruction at an address, decoding its page on a miss                     */
+/**************************************************************/
+const Decoded_Instr* fetch_decoded(MIPS_Sim* sim, uint32_t address) {
+	Decoded_Instr *page = decoded_page_lookup(sim, address);
+	if (page == NULL) {
+		page = predecode_page(sim, address);
+	}
+	return &page[(address & MEM_PAGE_MASK) >> 2];
 }
 
 void decode_machine_register(uint32_t reg, char* buffer) {
@@ -720,272 +5578,272 @@ void decode_machine_register(uint32_t reg, char* buffer) {
 }
 
 /**************************************************************/
-/* Performs the operation and stores result to be used in WB/MEM stage                                */
+/* Dispatch engine for EX/WB: a switch ladder by default, or direct-threaded      */
+/* code (computed goto through a handler table) when built with                          */
+/* -DTHREADED_DISPATCH. Each handler is written once against these macros.    */
 /**************************************************************/
-void EX_perform_operation(uint32_t A,
-				uint32_t B,
-				uint32_t imm,
-				const uint32_t opcode,
-				uint32_t shamt,
-				const uint32_t funct,
-				uint32_t address) {
-
-	switch (opcode) {
-		// R-format
-		case (0x0):
-			switch (funct) {
-				case (0x20): // add
-					EX_MEM.ALUOutput = A + B;
-				break;
-
-				case (0x21): // addu
-					EX_MEM.ALUOutput = A + B;
-				break;
-
-				case (0x22): // sub
-					EX_MEM.ALUOutput = A - B;
-				break;
-
-				case (0x23): // subu
-					EX_MEM.ALUOutput = A - B;
-				break;
-
-				case (0x24): // and
-					EX_MEM.ALUOutput = (A && B);
-				break;
-
-				case (0x25): // or
-					EX_MEM.ALUOutput = (A || B);
-				break;
-
-				case (0x26): // xor	
-					EX_MEM.ALUOutput = (A ^ B);
-				break;
-
-				case (0x27): // nor	
-					EX_MEM.ALUOutput = ~(A | B);
-					break;
-
-				case (0x18): // mult
-				case (0x19): { // multu
-					uint64_t result = (A * B);
-					NEXT_STATE.HI = (result >> 32);
-					NEXT_STATE.LO = ((result << 32) >> 32);
-				break; }
-
-				case (0x1A): { // div
-				case (0x1B): // divu
-					NEXT_STATE.LO = (A / B);
-					NEXT_STATE.HI = (A % B);
-				break; }
-
-				case (0x2A): // slt
-					EX_MEM.ALUOutput = (A < B) ? 1 : 0;
-				break;
-
-				case (0x00): // sll
-					EX_MEM.ALUOutput = B << shamt;
-				break;
-
-				case (0x02): // srl
-					EX_MEM.ALUOutput = B >> shamt;
-				break;
-
-				case (0x3):  // sra
-					EX_MEM.ALUOutput = B >> shamt;
-				break;
-
-				case (0x9):  // jalr	
-					// Do this later
-				break;
-
-				case (0x10): // mfhi
-				case (0x12): // mflo
-				break;
-
-				case (0x11): // mthi
-					EX_MEM.ALUOutput = A;
-				break;
-
-				case (0x13): // mtlo
-					EX_MEM.ALUOutput = A;
-				break;
-
-				case (0x8):  // jr
-					// Do this later
-				break;
-
-				case (0xC):  // syscall
-					EX_MEM.ALUOutput = 0xA;
-				break;
-
-				default:
-					printf("ERROR[EX_perform_operation]: Invalid instruction (R)\n");
-				break;
-			}
-		break;
-
-
-		// J-format
-		case (0x2): // j
-			// Do this later
-		break;
-
-		case (0x3): // jal
-			// Do this later
-		break;
-
-		
-		// I-format
-		case (0x8):  // addi
-			EX_MEM.ALUOutput = A + imm;
-		break;
-
-		case (0x9):  // addiu
-			EX_MEM.ALUOutput = A + imm;
-		break;
-
-		case (0xD):  // ori
-			EX_MEM.ALUOutput = (A || imm);
-		break;
-
-		case (0xE):  // xori
-			EX_MEM.ALUOutput = (A ^ imm);
-		break;
-
-		case (0xA):  // slti
-			EX_MEM.ALUOutput = (A < imm) ? 1 : 0;
-		break;
-
-		case (0x23): // lw
-			EX_MEM.ALUOutput = A + imm;
-			EX_MEM.B = ID_EX.B;
-		break;
-
-		case (0x32): // lb
-			EX_MEM.ALUOutput = A + imm;
-			EX_MEM.B = ID_EX.B;
-		break;
-
-		case (0x36): // lh		
-			EX_MEM.ALUOutput = A + imm;
-			EX_MEM.B = ID_EX.B;
-		break;
-
-		case (0xF):  // lui
-			EX_MEM.ALUOutput = (imm << 16);
-			EX_MEM.B = ID_EX.B;
-		break;
-
-		case (0x2B): // sw
-			EX_MEM.ALUOutput = A + imm;
-			EX_MEM.B = ID_EX.B;
-		break;
-
-		case (0x28): // sb
-			EX_MEM.ALUOutput = A + imm;
-			EX_MEM.B = ID_EX.B;
-		break;
-
-		case (0x29): // sh 
-			EX_MEM.ALUOutput = A + imm;
-			EX_MEM.B = ID_EX.B;
-		break;
-
-		case (0x1):  // bltz or bgez
-			// Do this later
-		break;
-
-		case (0x4):  // beq
-			// Do this later
-		break;
-
-		case (0x5):  // bne
-			// Do this later
-		break;
-
-		case (0x6):  // blez
-			// Do this later
-		break;
-
-		case (0x7):  // bgtz
-			// Do this later
-		break;
-
-		default:
-			printf("Error[EX_perform_operation]: Invalid instruction\n");
-		break;
-	}
-
-	return;
-}
+#ifdef THREADED_DISPATCH
+#define DISPATCH(table, index)	goto *table[index];
+#define TARGET(prefix, name)	prefix##_##name:
+#define TARGET_DEFAULT(prefix)	prefix##_default:
+#define NEXT(prefix)			goto prefix##_done
+#define END_DISPATCH(prefix)	prefix##_done: ;
+#else
+#define DISPATCH(table, index)	switch (index) {
+#define TARGET(prefix, name)	case (name):
+#define TARGET_DEFAULT(prefix)	default:
+#define NEXT(prefix)			break
+#define END_DISPATCH(prefix)	}
+#endif
 
 /**************************************************************/
-/* Stores computed result in memory                    				                                */
+/* Performs the operation and stores result to be used in WB/MEM stage                                */
 /**************************************************************/
-void MEM_access(const uint32_t opcode, uint32_t address) {
-	
-	switch (opcode) {
-		// R-format
-		case (0x0):
-		break;
+void EX_perform_operation(MIPS_Sim* sim, CPU_Pipeline_Reg* ex_mem, const Decoded_Instr* instr, uint32_t A, uint32_t B, uint32_t imm) {
+#ifdef THREADED_DISPATCH
+	static const void *const ex_table[NUM_OPS] = {
+		[0 ... NUM_OPS - 1] = &&ex_default,
+		[OP_NOP] = &&ex_OP_NOP,
+		[OP_ADD] = &&ex_OP_ADD, [OP_ADDU] = &&ex_OP_ADDU,
+		[OP_SUB] = &&ex_OP_SUB, [OP_SUBU] = &&ex_OP_SUBU,
+		[OP_AND] = &&ex_OP_AND, [OP_OR] = &&ex_OP_OR,
+		[OP_XOR] = &&ex_OP_XOR, [OP_NOR] = &&ex_OP_NOR,
+		[OP_MULT] = &&ex_OP_MULT, [OP_MULTU] = &&ex_OP_MULTU,
+		[OP_DIV] = &&ex_OP_DIV, [OP_DIVU] = &&ex_OP_DIVU,
+		[OP_SLT] = &&ex_OP_SLT,
+		[OP_SLL] = &&ex_OP_SLL, [OP_SRL] = &&ex_OP_SRL, [OP_SRA] = &&ex_OP_SRA,
+		[OP_MFHI] = &&ex_OP_MFHI, [OP_MFLO] = &&ex_OP_MFLO,
+		[OP_MTHI] = &&ex_OP_MTHI, [OP_MTLO] = &&ex_OP_MTLO,
+		[OP_SYSCALL] = &&ex_OP_SYSCALL,
+		[OP_JR] = &&ex_OP_JR, [OP_JALR] = &&ex_OP_JALR,
+		[OP_J] = &&ex_OP_J, [OP_JAL] = &&ex_OP_JAL,
+		[OP_ADDI] = &&ex_OP_ADDI, [OP_ADDIU] = &&ex_OP_ADDIU,
+		[OP_ANDI] = &&ex_OP_ANDI, [OP_ORI] = &&ex_OP_ORI, [OP_XORI] = &&ex_OP_XORI,
+		[OP_SLTI] = &&ex_OP_SLTI, [OP_LUI] = &&ex_OP_LUI,
+		[OP_LW] = &&ex_OP_LW, [OP_LB] = &&ex_OP_LB, [OP_LH] = &&ex_OP_LH,
+		[OP_SW] = &&ex_OP_SW, [OP_SB] = &&ex_OP_SB, [OP_SH] = &&ex_OP_SH,
+		[OP_LL] = &&ex_OP_LL, [OP_SC] = &&ex_OP_SC,
+		[OP_BLTZ] = &&ex_OP_BLTZ, [OP_BGEZ] = &&ex_OP_BGEZ,
+		[OP_BEQ] = &&ex_OP_BEQ, [OP_BNE] = &&ex_OP_BNE,
+		[OP_BLEZ] = &&ex_OP_BLEZ, [OP_BGTZ] = &&ex_OP_BGTZ,
+	};
+#endif
+
+	DISPATCH(ex_table, instr->op)
+		TARGET(ex, OP_NOP)
+		NEXT(ex);
 
+		// R-format
+		TARGET(ex, OP_ADD)
+		TARGET(ex, OP_ADDU)
+			ex_mem->ALUOutput = A + B;
+		NEXT(ex);
+
+		TARGET(ex, OP_SUB)
+		TARGET(ex, OP_SUBU)
+			ex_mem->ALUOutput = A - B;
+		NEXT(ex);
+
+		TARGET(ex, OP_AND)
+			ex_mem->ALUOutput = (A & B);
+		NEXT(ex);
+
+		TARGET(ex, OP_OR)
+			ex_mem->ALUOutput = (A | B);
+		NEXT(ex);
+
+		TARGET(ex, OP_XOR)
+			ex_mem->ALUOutput = (A ^ B);
+		NEXT(ex);
+
+		TARGET(ex, OP_NOR)
+			ex_mem->ALUOutput = ~(A | B);
+		NEXT(ex);
+
+		TARGET(ex, OP_MULT) {
+			int64_t result = (int64_t)(int32_t)A * (int32_t)B;
+			sim->NEXT_STATE.HI = (uint64_t)result >> 32;
+			sim->NEXT_STATE.LO = (uint32_t)result;
+		NEXT(ex); }
+
+		TARGET(ex, OP_MULTU) {
+			uint64_t result = (uint64_t)A * B;
+			sim->NEXT_STATE.HI = (result >> 32);
+			sim->NEXT_STATE.LO = (uint32_t)result;
+		NEXT(ex); }
+
+		TARGET(ex, OP_DIV)
+			if (A == 0x80000000 && B == 0xFFFFFFFF) { // the quotient overflows, and would trap on the host
+				sim->NEXT_STATE.LO = 0x80000000;
+				sim->NEXT_STATE.HI = 0;
+			} else if (B != 0) { // result is undefined on divide by zero, leave HI/LO alone
+				sim->NEXT_STATE.LO = (int32_t)A / (int32_t)B;
+				sim->NEXT_STATE.HI = (int32_t)A % (int32_t)B;
+			}
+		NEXT(ex);
 
-		// J-format
-		case (0x2): // j
-			// Do this later
-		break;
-
-		case (0x3): // jal
-			// Do this later
-		break;
-
-		
-		// I-format
-		case (0x8):  // addi
-		case (0x9):  // addiu
-		case (0xD):  // ori
-		case (0xE):  // xori
-		case (0xA):  // slti
-		break;
+		TARGET(ex, OP_DIVU)
+			if (B != 0) {
+				sim->NEXT_STATE.LO = (A / B);
+				sim->NEXT_STATE.HI = (A % B);
+			}
+		NEXT(ex);
+
+		TARGET(ex, OP_SLT)
+			ex_mem->ALUOutput = ((int32_t)A < (int32_t)B) ? 1 : 0;
+		NEXT(ex);
+
+		TARGET(ex, OP_SLL)
+			ex_mem->ALUOutput = B << instr->shamt;
+		NEXT(ex);
+
+		TARGET(ex, OP_SRL)
+			ex_mem->ALUOutput = B >> instr->shamt;
+		NEXT(ex);
+
+		TARGET(ex, OP_SRA)
+			ex_mem->ALUOutput = (uint32_t)((int32_t)B >> instr->shamt);
+		NEXT(ex);
+
+		// HI/LO are read and written here, in order with mult/div, so mfhi/mflo forward like any ALU result
+		TARGET(ex, OP_MFHI)
+			ex_mem->ALUOutput = sim->CURRENT_STATE.HI;
+		NEXT(ex);
+
+		TARGET(ex, OP_MFLO)
+			ex_mem->ALUOutput = sim->CURRENT_STATE.LO;
+		NEXT(ex);
+
+		TARGET(ex, OP_MTHI)
+			sim->NEXT_STATE.HI = A;
+		NEXT(ex);
+
+		TARGET(ex, OP_MTLO)
+			sim->NEXT_STATE.LO = A;
+		NEXT(ex);
+
+		// SPIM exit ($v0 = 10): squash everything younger and stop fetching, WB stops the run
+		TARGET(ex, OP_SYSCALL)
+			ex_mem->ALUOutput = A;
+			if (A == 0xA) {
+				sim->EXITING = TRUE;
+				sim->BRANCH_SQUASH = TRUE;
+				sim->BRANCH_REDIRECT = TRUE;
+				sim->REDIRECT_PC = ex_mem->PC;
+			}
+		NEXT(ex);
 
-		case (0x23): // lw
-		case (0x32): // lb
-		case (0x36): // lh		
-			MEM_WB.LMD = mem_read_32(MEM_WB.ALUOutput);
-		break;
+		// Jumps: EX/MEM.PC is the return address
+		TARGET(ex, OP_JR)
+			branch_resolve(sim, ex_mem, TRUE, A);
+		NEXT(ex);
 
-		case (0xF):  // lui
-		break;
+		TARGET(ex, OP_JALR)
+			ex_mem->ALUOutput = ex_mem->PC;
+			branch_resolve(sim, ex_mem, TRUE, A);
+		NEXT(ex);
 
-		case (0x2B): // sw
-		case (0x28): // sb
-		case (0x29): // sh 
-			mem_write_32(MEM_WB.ALUOutput, MEM_WB.B);
-		break;
+		TARGET(ex, OP_J)
+			branch_resolve(sim, ex_mem, TRUE, (ex_mem->PC & 0xF0000000) | (instr->target << 2));
+		NEXT(ex);
 
-		case (0x1):  // bltz or bgez
-			// Do this later
-		break;
+		TARGET(ex, OP_JAL)
+			ex_mem->ALUOutput = ex_mem->PC;
+			branch_resolve(sim, ex_mem, TRUE, (ex_mem->PC & 0xF0000000) | (instr->target << 2));
+		NEXT(ex);
 
-		case (0x4):  // beq
-			// Do this later
-		break;
+		// I-format
+		TARGET(ex, OP_ADDI)
+		TARGET(ex, OP_ADDIU)
+			ex_mem->ALUOutput = A + imm;
+		NEXT(ex);
+
+		TARGET(ex, OP_ANDI)
+			ex_mem->ALUOutput = (A & imm);
+		NEXT(ex);
+
+		TARGET(ex, OP_ORI)
+			ex_mem->ALUOutput = (A | imm);
+		NEXT(ex);
+
+		TARGET(ex, OP_XORI)
+			ex_mem->ALUOutput = (A ^ imm);
+		NEXT(ex);
+
+		TARGET(ex, OP_SLTI)
+			ex_mem->ALUOutput = ((int32_t)A < (int32_t)imm) ? 1 : 0;
+		NEXT(ex);
+
+		TARGET(ex, OP_LUI)
+			ex_mem->ALUOutput = (imm << 16);
+		NEXT(ex);
+
+		TARGET(ex, OP_LW)
+		TARGET(ex, OP_LB)
+		TARGET(ex, OP_LH)
+		TARGET(ex, OP_SW)
+		TARGET(ex, OP_SB)
+		TARGET(ex, OP_SH)
+		TARGET(ex, OP_LL)
+		TARGET(ex, OP_SC)
+			ex_mem->ALUOutput = A + imm;
+		NEXT(ex);
+
+		// Branches: the target is relative to the address after the branch
+		TARGET(ex, OP_BLTZ)
+			branch_resolve(sim, ex_mem, (int32_t)A < 0, ex_mem->PC + (imm << 2));
+		NEXT(ex);
+
+		TARGET(ex, OP_BGEZ)
+			branch_resolve(sim, ex_mem, (int32_t)A >= 0, ex_mem->PC + (imm << 2));
+		NEXT(ex);
+
+		TARGET(ex, OP_BEQ)
+			branch_resolve(sim, ex_mem, A == B, ex_mem->PC + (imm << 2));
+		NEXT(ex);
+
+		TARGET(ex, OP_BNE)
+			branch_resolve(sim, ex_mem, A != B, ex_mem->PC + (imm << 2));
+		NEXT(ex);
+
+		TARGET(ex, OP_BLEZ)
+			branch_resolve(sim, ex_mem, (int32_t)A <= 0, ex_mem->PC + (imm << 2));
+		NEXT(ex);
+
+		TARGET(ex, OP_BGTZ)
+			branch_resolve(sim, ex_mem, (int32_t)A > 0, ex_mem->PC + (imm << 2));
+		NEXT(ex);
+
+		TARGET_DEFAULT(ex)
+			printf("Error[EX_perform_operation]: Invalid instruction\n");
+		NEXT(ex);
+	END_DISPATCH(ex)
 
-		case (0x5):  // bne
-			// Do this later
-		break;
+	return;
+}
 
-		case (0x6):  // blez
-			// Do this later
+/**************************************************************/
+/* Stores computed result in memory                    				                                */
+/**************************************************************/
+void MEM_access(MIPS_Sim* sim, CPU_Pipeline_Reg* mem_wb, const Decoded_Instr* instr, uint32_t address) {
+	
+	switch (instr->class) {
+		case (CLASS_LOAD):
+			mem_wb->LMD = mem_load(sim, instr, address);
 		break;
 
-		case (0x7):  // bgtz
-			// Do this later
+		case (CLASS_STORE):
+			if (instr->op == OP_SC) {
+				mem_wb->LMD = mem_store_conditional(sim, address, mem_wb->B);
+			} else {
+				mem_store(sim, instr, address, mem_wb->B);
+			}
 		break;
 
 		default:
-			printf("Error[MEM_access]: Invalid instruction\n");
+			if (instr->op == OP_INVALID) {
+				printf("Error[MEM_access]: Invalid instruction\n");
+			}
 		break;
 	}
 
@@ -995,159 +5853,296 @@ void MEM_access(const uint32_t opcode, uint32_t address) {
 /**************************************************************/
 /* Writes computed result to destination register              		                                */
 /**************************************************************/
-void WB_populate_destination(uint32_t rt,
-				uint32_t rd,
-				const uint32_t opcode,
-				const uint32_t funct) {
-	switch (opcode) {
-		// R-format
-		case (0x0):
-			switch (funct) {
-				case (0x20): // add
-				case (0x21): // addu
-				case (0x22): // sub
-				case (0x23): // subu
-				case (0x24): // and
-				case (0x25): // or
-				case (0x26): // xor	
-				case (0x27): // nor	
-					NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
-				break;
-				
-				case (0x18): // mult
-				case (0x19): // multu
-				case (0x1A): // div
-				case (0x1B): // divu
-					NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
-				break;
-
-				case (0x2A): // slt
-					NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
-				break;
+void WB_populate_destination(MIPS_Sim* sim, const CPU_Pipeline_Reg* mem_wb, const Decoded_Instr* instr) {
+#ifdef THREADED_DISPATCH
+	static const void *const wb_table[] = {
+		[CLASS_NONE] = &&wb_CLASS_NONE,
+		[CLASS_ALU] = &&wb_CLASS_ALU,
+		[CLASS_LOAD] = &&wb_CLASS_LOAD,
+		[CLASS_STORE] = &&wb_CLASS_STORE,
+		[CLASS_BRANCH] = &&wb_default,
+		[CLASS_JUMP] = &&wb_CLASS_JUMP,
+		[CLASS_HILO] = &&wb_CLASS_HILO,
+		[CLASS_SYSCALL] = &&wb_CLASS_SYSCALL,
+	};
+#endif
+
+	DISPATCH(wb_table, instr->class)
+		TARGET(wb, CLASS_NONE)
+			if (instr->op == OP_INVALID) {
+				printf("Error[WB_populate_destination]: Invalid instruction\n");
+			}
+		NEXT(wb);
 
-				case (0x00): // sll
-					NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
-				break;
+		TARGET(wb, CLASS_ALU)
+		TARGET(wb, CLASS_HILO) // mfhi/mflo read HI/LO in EX, the others have no dest
+		TARGET(wb, CLASS_JUMP) // jal/jalr link the return address, j/jr have no dest
+			sim->NEXT_STATE.REGS[instr->dest] = mem_wb->ALUOutput;
+		NEXT(wb);
 
-				case (0x02): // srl
-					NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
-				break;
+		TARGET(wb, CLASS_LOAD)
+		TARGET(wb, CLASS_STORE) // only sc has a dest (its success flag), other stores write $zero
+			sim->NEXT_STATE.REGS[instr->dest] = mem_wb->LMD;
+		NEXT(wb);
 
-				case (0x3):  // sra
-					NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
-				break;
+		TARGET(wb, CLASS_SYSCALL) // the exit is handled by WB() once it is known to retire
+		TARGET_DEFAULT(wb) // branches write no register
+		NEXT(wb);
+	END_DISPATCH(wb)
 
-				case (0x9):  // jalr	
-					// Do this later
-				break;
+	// dest is 0 when nothing is written; $zero is hardwired
+	sim->NEXT_STATE.REGS[0] = 0;
 
-				case (0x10): // mfhi
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.HI;
-				break;
+	return;
+}
 
-				case (0x12): // mflo
-					NEXT_STATE.REGS[rd] = CURRENT_STATE.LO;
-				break;
+/************************************************************/
+/* Initialize Memory                                                                                                    */ 
+/************************************************************/
+void initialize(MIPS_Sim* sim) { 
+	if (sim->MEMORY == NULL) {
+		init_memory(sim);
+	} else {
+		mem_tlb_flush(sim);
+	}
+	sim->CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	sim->CURRENT_STATE.REGS[27] = sim->CORE_ID;
+	sim->NEXT_STATE = sim->CURRENT_STATE;
+	sim->RUN_FLAG = TRUE;
+	sim->FETCH_ENABLED = TRUE;
+	sim->FORWARDING = TRUE;
+	sim->ISSUE_WIDTH = 1;
+	bpred_configure(&sim->BPRED, NULL);
+	jit_init(sim);
+}
 
-				case (0x11): // mthi
-					NEXT_STATE.HI = MEM_WB.ALUOutput;
-				break;
+/************************************************************/
+/* Create an independent simulator instance for a program                          */
+/************************************************************/
+MIPS_Sim* sim_create(const char* program) {
+	return sim_create_core(program, NULL, 0);
+}
 
-				case (0x13): // mtlo
-					NEXT_STATE.LO = MEM_WB.ALUOutput;
-				break;
+/************************************************************/
+/* Create one core, on its own memory or on a shared one                            */
+/************************************************************/
+MIPS_Sim* sim_create_core(const char* program, MIPS_Memory* shared, int core_id) {
+	MIPS_Sim* sim = calloc(1, sizeof(MIPS_Sim));
+	if (sim == NULL) {
+		printf("Error: Out of memory allocating simulator\n");
+		exit(-1);
+	}
+	snprintf(sim->prog_file, sizeof(sim->prog_file), "%s", program);
+	sim->MEMORY = shared;
+	sim->CORE_ID = core_id;
+	initialize(sim);
+	return sim;
+}
 
-				case (0x8):  // jr
-					// Do this later
-				break;
+/************************************************************/
+/* Release everything a simulator instance owns                                        */
+/************************************************************/
+void sim_destroy(MIPS_Sim* sim) {
+	if (sim->SYSTEM == NULL || sim->SYSTEM->MEMORY != sim->MEMORY || sim->CORE_ID == 0) {
+		free_memory(sim);
+		mem_free_pristine(sim);
+		free(sim->MEMORY->DIRTY_PAGES);
+		pthread_mutex_destroy(&sim->MEMORY->ALLOC_LOCK);
+		pthread_mutex_destroy(&sim->MEMORY->LINK_LOCK);
+		free(sim->MEMORY);
+	}
+	trace_stop(sim);
+	pipeview_stop(sim);
+	free(sim->PROFILE.PCS);
+	jit_release(sim);
+	cache_release(&sim->ICACHE);
+	cache_release(&sim->DCACHE);
+	bpred_release(&sim->BPRED);
+	free(sim);
+}
 
-				case (0xC): // syscall
-					NEXT_STATE.REGS[2] = MEM_WB.ALUOutput;
-				break;
+/************************************************************/
+/* Pick up code changes made by other cores: their stores re-decoded          */
+/* words this core may hold translations of, or made pages code that this  */
+/* core's TLB still treats as plain data.                                                    */
+/************************************************************/
+void sync_code(MIPS_Sim* sim) {
+	uint32_t generation = __atomic_load_n(&sim->MEMORY->CODE_GENERATION, __ATOMIC_ACQUIRE);
 
-				default:
-					printf("ERROR[WB_populate_destination]: Invalid instruction (R)\n");
-				break;
-			}
-		break;
+	if (generation != sim->CODE_GENERATION) {
+		mem_tlb_flush(sim);
+		jit_flush(sim);
+		sim->CODE_GENERATION = generation;
+	}
+}
 
+/************************************************************/
+/* Create a multi-core system: every core runs the same program over one    */
+/* memory, told apart by the core id in $k1                                                */
+/************************************************************/
+MIPS_System* system_create(const char* program, int num_cores, uint32_t quantum) {
+	MIPS_System* sys = calloc(1, sizeof(MIPS_System));
+	int i;
 
-		// J-format
-		case (0x2): // j
-		case (0x3): // jal
-		break;
+	if (sys == NULL) {
+		printf("Error: Out of memory allocating system\n");
+		exit(-1);
+	}
+	if (num_cores < 1 || num_cores > MAX_CORES) {
+		printf("Error: Number of cores must be between 1 and %d\n", MAX_CORES);
+		exit(1);
+	}
+	sys->NUM_CORES = num_cores;
+	sys->QUANTUM = quantum > 0 ? quantum : 1;
+	for (i = 0; i < num_cores; i++) {
+		sys->CORES[i] = sim_create_core(program, sys->MEMORY, i);
+		sys->CORES[i]->SYSTEM = sys;
+		sys->MEMORY = sys->CORES[0]->MEMORY;
+	}
+	pthread_barrier_init(&sys->BARRIER, NULL, num_cores);
+	return sys;
+}
 
-		
-		// I-format
-		case (0x8):  // addi
-		case (0x9):  // addiu
-		case (0xD):  // ori
-		case (0xE):  // xori
-		case (0xA):  // slti
-			NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
-		break;
+/************************************************************/
+/* Release every core and the shared memory                                             */
+/************************************************************/
+void system_destroy(MIPS_System* sys) {
+	int i;
+	for (i = sys->NUM_CORES - 1; i >= 0; i--) { // core 0 owns the memory, so goes last
+		sim_destroy(sys->CORES[i]);
+	}
+	pthread_barrier_destroy(&sys->BARRIER);
+	free(sys);
+}
 
-		case (0x23): // lw
-			NEXT_STATE.REGS[rt] = MEM_WB.LMD;
-		break;
+/************************************************************/
+/* Reload the program once into the shared memory and reset every core     */
+/************************************************************/
+void system_reset(MIPS_System* sys) {
+	int i;
 
-		case (0x32): // lb
-			NEXT_STATE.REGS[rt] = MEM_WB.LMD;
-		break;
+	reset(sys->CORES[0]);
+	for (i = 1; i < sys->NUM_CORES; i++) {
+		reset_state(sys->CORES[i]);
+		sync_code(sys->CORES[i]);
+	}
+}
 
-		case (0x36): // lh		
-			NEXT_STATE.REGS[rt] = MEM_WB.LMD;
-		break;
+/************************************************************/
+/* End of a quantum, run by one thread while the others wait at the barrier */
+/************************************************************/
+static void system_end_quantum(MIPS_System* sys) {
+	int i, running = FALSE;
 
-		case (0xF):  // lui
-			NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
-		break;
+	if (sys->CYCLES_LEFT > 0) {
+		sys->CYCLES_LEFT -= sys->SLICE;
+	}
+	for (i = 0; i < sys->NUM_CORES; i++) {
+		running |= sys->CORES[i]->RUN_FLAG;
+	}
+	sys->STOP = (sys->CYCLES_LEFT == 0 || !running);
+	if (sys->CYCLES_LEFT > 0 && sys->CYCLES_LEFT < sys->QUANTUM) {
+		sys->SLICE = sys->CYCLES_LEFT;
+	}
+}
 
-		case (0x2B): // sw
-		case (0x28): // sb
-		case (0x29): // sh 
-		break;
+/************************************************************/
+/* Host thread of one core: a quantum of cycles, then synchronize               */
+/************************************************************/
+static void* system_core_thread(void* arg) {
+	MIPS_Sim* sim = arg;
+	MIPS_System* sys = sim->SYSTEM;
+	uint32_t i;
+
+	while (1) {
+		sync_code(sim);
+		for (i = 0; i < sys->SLICE && sim->RUN_FLAG; i++) {
+			cycle(sim);
+		}
+		if (pthread_barrier_wait(&sys->BARRIER) == PTHREAD_BARRIER_SERIAL_THREAD) {
+			system_end_quantum(sys);
+		}
+		pthread_barrier_wait(&sys->BARRIER); // everyone sees the same STOP
+		if (sys->STOP) {
+			return NULL;
+		}
+	}
+}
 
-		case (0x1):  // bltz or bgez
-		case (0x4):  // beq
-		case (0x5):  // bne
-		case (0x6):  // blez
-		case (0x7):  // bgtz
-		break;
+/************************************************************/
+/* Run every core for n cycles (n < 0: until all stop), one host thread each */
+/************************************************************/
+void system_run(MIPS_System* sys, int64_t num_cycles) {
+	pthread_t threads[MAX_CORES];
+	uint64_t start_cycles = 0, cycles = 0;
+	uint64_t start_instructions = 0, instructions = 0;
+	double start;
+	int i;
 
-		default:
-			printf("Error[WB_populate_destination]: Invalid instruction\n");
-		break;
+	if (num_cycles == 0) {
+		return;
+	}
+	for (i = 0; i < sys->NUM_CORES; i++) {
+		start_cycles += sys->CORES[i]->CYCLE_COUNT;
+		start_instructions += sys->CORES[i]->INSTRUCTION_COUNT;
+	}
+	sys->CYCLES_LEFT = num_cycles;
+	sys->SLICE = (num_cycles > 0 && num_cycles < sys->QUANTUM) ? num_cycles : sys->QUANTUM;
+	sys->STOP = FALSE;
+
+	start = host_seconds();
+	for (i = 0; i < sys->NUM_CORES; i++) {
+		if (pthread_create(&threads[i], NULL, system_core_thread, sys->CORES[i]) != 0) {
+			printf("Error: Can't start the thread of core %d\n", i);
+			exit(-1);
+		}
+	}
+	for (i = 0; i < sys->NUM_CORES; i++) {
+		pthread_join(threads[i], NULL);
 	}
 
-	return;
+	for (i = 0; i < sys->NUM_CORES; i++) {
+		cycles += sys->CORES[i]->CYCLE_COUNT;
+		instructions += sys->CORES[i]->INSTRUCTION_COUNT;
+	}
+	printf("%d cores, quantum %u cycles: ", sys->NUM_CORES, sys->QUANTUM);
+	report_host_rate(cycles - start_cycles, instructions - start_instructions, host_seconds() - start);
 }
 
 /************************************************************/
-/* Initialize Memory                                                                                                    */ 
+/* Per-core cycle/instruction counters                                                         */
 /************************************************************/
-void initialize() { 
-	init_memory();
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+void system_report(MIPS_System* sys) {
+	int i;
+	MIPS_Sim* core;
+
+	printf("-------------------------------------------------------------\n");
+	printf("[Core]\t[Cycles]\t[Instructions]\t[Fast-Forwarded]\t[PC]\n");
+	printf("-------------------------------------------------------------\n");
+	for (i = 0; i < sys->NUM_CORES; i++) {
+		core = sys->CORES[i];
+		printf("%s%d\t%llu\t\t%llu\t\t%llu\t\t\t0x%08x%s\n", i == sys->CURRENT_CORE ? "*" : " ", i,
+			(unsigned long long)core->CYCLE_COUNT, (unsigned long long)core->INSTRUCTION_COUNT, (unsigned long long)core->FF_INSTRUCTION_COUNT,
+			core->CURRENT_STATE.PC, core->RUN_FLAG ? "" : " (stopped)");
+	}
+	printf("-------------------------------------------------------------\n\n");
 }
 
 /************************************************************/
 /* Print the program loaded into memory (in MIPS assembly format)    */ 
 /************************************************************/
-void print_program(){
+void print_program(MIPS_Sim* sim){
 	int i;
 	uint32_t addr;
 	
-	for(i=0; i<PROGRAM_SIZE; i++){
+	for(i=0; i<sim->PROGRAM_SIZE; i++){
 		addr = MEM_TEXT_BEGIN + (i*4);
 		printf("[0x%x]\t", addr);
-		print_instruction(addr);
+		print_instruction(sim, addr);
 	}
 }
 
-void print_instruction(uint32_t addr){
+void print_instruction(MIPS_Sim* sim, uint32_t addr){
 	uint32_t opcode;
 	uint32_t rs;
 	uint32_t rt;
@@ -1159,7 +6154,7 @@ void print_instruction(uint32_t addr){
 	char reg_str[5];
 
 	// Step 1: Read in the instruction at the given memory addr
-	const uint32_t instruction = mem_read_32(addr);
+	const uint32_t instruction = mem_read_32(sim, addr);
 
 	// Step 2: Isolate instruction
 	decode_all_operands(instruction, &opcode, &rs, &rt, &rd, &shamt, &funct, &immediate, &address);
@@ -1470,6 +6465,22 @@ void print_instruction(uint32_t addr){
 			printf("%d(%s)\n", immediate, reg_str);	
 		break;
 
+		case (0x30): // ll
+			printf("ll ");
+			decode_machine_register(rt, reg_str);
+			printf("%s, ", reg_str);
+			decode_machine_register(rs, reg_str);
+			printf("%d(%s)\n", immediate, reg_str);	
+		break;
+
+		case (0x38): // sc
+			printf("sc ");
+			decode_machine_register(rt, reg_str);
+			printf("%s, ", reg_str);
+			decode_machine_register(rs, reg_str);
+			printf("%d(%s)\n", immediate, reg_str);	
+		break;
+
 		case (0x28): // sb
 			printf("sb ");
 			decode_machine_register(rt, reg_str);
@@ -1540,30 +6551,37 @@ void print_instruction(uint32_t addr){
 /************************************************************/
 /* Print the current pipeline                                                                                    */ 
 /************************************************************/
-void show_pipeline(){
+void show_pipeline(MIPS_Sim* sim){
+	uint32_t i;
+
 	printf("Current contents of the pipeline registers:\n\n");
-	printf("PC:\t%d\n", CURRENT_STATE.PC);
-	
-	// IF_ID
-	printf("IF/ID.IR\t%d\n", IF_ID.IR);
-	printf("IF/ID.PC\t%d\n", IF_ID.PC);
-
-	// ID_EX
-	printf("ID/EX.IR\t%d\n", ID_EX.IR);
-	printf("ID/EX.A\t%d\n", ID_EX.A);
-	printf("ID/EX.B\t%d\n", ID_EX.B);
-	printf("ID/EX.imm\t%d\n", ID_EX.imm);
-
-	// EX_MEM
-	printf("EX/MEM.IR\t%d\n", EX_MEM.IR);
-	printf("EX/MEM.A\t%d\n", EX_MEM.A);
-	printf("EX/MEM.B\t%d\n", EX_MEM.B);
-	printf("EX/MEM.ALUOutput\t%d\n", EX_MEM.ALUOutput);
-
-	// MEM_WB
-	printf("MEM_WB.IR\t%d\n", MEM_WB.IR);
-	printf("MEM_WB.ALUOutput\t%d\n", MEM_WB.ALUOutput);
-	printf("MEM_WB.LMD\t%d\n", MEM_WB.LMD);
+	printf("PC:\t%d\n", sim->CURRENT_STATE.PC);
+
+	for (i = 0; i < sim->ISSUE_WIDTH; i++) {
+		if (sim->ISSUE_WIDTH > 1) {
+			printf("\nSlot %u%s:\n", i, i == 0 ? " (oldest)" : "");
+		}
+		// IF_ID
+		printf("IF/ID.IR\t%d\n", sim->IF_ID[i].IR);
+		printf("IF/ID.PC\t%d\n", sim->IF_ID[i].PC);
+
+		// ID_EX
+		printf("ID/EX.IR\t%d\n", sim->ID_EX[i].IR);
+		printf("ID/EX.A\t%d\n", sim->ID_EX[i].A);
+		printf("ID/EX.B\t%d\n", sim->ID_EX[i].B);
+		printf("ID/EX.imm\t%d\n", sim->ID_EX[i].imm);
+
+		// EX_MEM
+		printf("EX/MEM.IR\t%d\n", sim->EX_MEM[i].IR);
+		printf("EX/MEM.A\t%d\n", sim->EX_MEM[i].A);
+		printf("EX/MEM.B\t%d\n", sim->EX_MEM[i].B);
+		printf("EX/MEM.ALUOutput\t%d\n", sim->EX_MEM[i].ALUOutput);
+
+		// MEM_WB
+		printf("MEM_WB.IR\t%d\n", sim->MEM_WB[i].IR);
+		printf("MEM_WB.ALUOutput\t%d\n", sim->MEM_WB[i].ALUOutput);
+		printf("MEM_WB.LMD\t%d\n", sim->MEM_WB[i].LMD);
+	}
 
 	return;
 }
@@ -1572,21 +6590,266 @@ void show_pipeline(){
 /* main                                                                                                                                   */
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
-	printf("\n**************************\n");
-	printf("Welcome to MU-MIPS SIM...\n");
-	printf("**************************\n\n");
-	
-	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
+	static const struct option long_options[] = {
+		{ "run", no_argument, NULL, 'R' },
+		{ "max-cycles", required_argument, NULL, 'M' },
+		{ "script", required_argument, NULL, 'S' },
+		{ "stats-json", required_argument, NULL, 'J' },
+		{ "no-forwarding", no_argument, NULL, 'N' },
+		{ "perf", required_argument, NULL, 'P' },
+		{ "icache", required_argument, NULL, 'I' },
+		{ "dcache", required_argument, NULL, 'D' },
+		{ "bpred", required_argument, NULL, 'B' },
+		{ "check", no_argument, NULL, 'C' },
+		{ "watchdog-cycles", required_argument, NULL, 'W' },
+		{ "watchdog-instructions", required_argument, NULL, 'X' },
+		{ "trace", required_argument, NULL, 'T' },
+		{ "trace-ring", required_argument, NULL, 'G' },
+		{ "pipeview", required_argument, NULL, 'V' },
+		{ "profile", no_argument, NULL, 'O' },
+		{ "simpoint", required_argument, NULL, 'K' },
+		{ "issue-width", required_argument, NULL, 'A' },
+		{ NULL, 0, NULL, 0 }
+	};
+	MIPS_Sim* sim;
+	MIPS_Sim* core;
+	MIPS_System* sys = NULL;
+	unsigned long long ff_count = 0;
+	uint32_t ff_pc = 0;
+	int use_ff_pc = FALSE;
+	int num_cores = 1;
+	uint32_t quantum = DEFAULT_QUANTUM;
+	int batch_run = FALSE;
+	int forwarding = TRUE;
+	int check = FALSE;
+	uint64_t max_cycles = 0;
+	uint64_t cycle_limit = 0;
+	uint64_t instruction_limit = 0;
+	const char* script = NULL;
+	const char* stats_json = NULL;
+	const char* perf_file = NULL;
+	const char* icache = NULL;
+	const char* dcache = NULL;
+	const char* bpred = NULL;
+	const char* trace = NULL;
+	uint32_t trace_ring = 0;
+	const char* pipeview = NULL;
+	int profile = FALSE;
+	const char* simpoint = NULL;
+	uint32_t issue_width = 1;
+	const char* status;
+	FILE* script_fp;
+	FILE* stats_fp = NULL;
+	double start;
+	int running, stop, exit_code = 0;
+	int opt, i;
+
+	while ((opt = getopt_long(argc, argv, "f:u:c:q:", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'f':
+				ff_count = strtoull(optarg, NULL, 0);
+				break;
+			case 'u':
+				ff_pc = strtoul(optarg, NULL, 16);
+				use_ff_pc = TRUE;
+				break;
+			case 'c':
+				num_cores = atoi(optarg);
+				break;
+			case 'q':
+				quantum = strtoul(optarg, NULL, 0);
+				break;
+			case 'R':
+				batch_run = TRUE;
+				break;
+			case 'M':
+				max_cycles = strtoull(optarg, NULL, 0);
+				break;
+			case 'S':
+				script = optarg;
+				break;
+			case 'J':
+				stats_json = optarg;
+				break;
+			case 'N':
+				forwarding = FALSE;
+				break;
+			case 'P':
+				perf_file = optarg;
+				break;
+			case 'I':
+				icache = optarg;
+				break;
+			case 'D':
+				dcache = optarg;
+				break;
+			case 'B':
+				bpred = optarg;
+				break;
+			case 'C':
+				check = TRUE;
+				break;
+			case 'W':
+				cycle_limit = strtoull(optarg, NULL, 0);
+				break;
+			case 'X':
+				instruction_limit = strtoull(optarg, NULL, 0);
+				break;
+			case 'T':
+				trace = optarg;
+				break;
+			case 'G':
+				trace_ring = strtoul(optarg, NULL, 0);
+				break;
+			case 'V':
+				pipeview = optarg;
+				break;
+			case 'O':
+				profile = TRUE;
+				break;
+			case 'K':
+				simpoint = optarg;
+				break;
+			case 'A':
+				issue_width = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				printf("Usage: %s [-f <n>] [-u <pc>] [-c <cores>] [-q <quantum>]\n"
+					"\t[--run] [--max-cycles <n>] [--script <file>] [--stats-json <file>|-] [--no-forwarding] [--issue-width <n>] [--perf <file>]\n\t[--icache <spec>] [--dcache <spec>] [--bpred <spec>] [--check]\n\t[--watchdog-cycles <n>] [--watchdog-instructions <n>]\n\t[--trace <file>] [--trace-ring <cycles>] [--pipeview <file>] [--profile]\n\t[--simpoint <spec>] <input program>\n\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	if (optind >= argc) {
+		printf("Error: You should provide input file.\nUsage: %s [-f <n>] [-u <pc>] [-c <cores>] [-q <quantum>]\n"
+			"\t[--run] [--max-cycles <n>] [--script <file>] [--stats-json <file>|-] [--no-forwarding] [--issue-width <n>] [--perf <file>]\n\t[--icache <spec>] [--dcache <spec>] [--bpred <spec>] [--check]\n\t[--watchdog-cycles <n>] [--watchdog-instructions <n>]\n\t[--trace <file>] [--trace-ring <cycles>] [--pipeview <file>] [--profile]\n\t[--simpoint <spec>] <input program> \n\n",  argv[0]);
 		exit(1);
 	}
 
-	strcpy(prog_file, argv[1]);
-	initialize();
-	load_program();
-	help();
-	while (1){
-		handle_command();
+	/* open the results first so a bad path fails before the run; with "-" the */
+	/* JSON owns stdout and everything else the simulator prints goes to stderr */
+	if (stats_json != NULL) {
+		if (strcmp(stats_json, "-") == 0) {
+			stats_fp = fdopen(dup(STDOUT_FILENO), "w");
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+		} else {
+			stats_fp = fopen(stats_json, "w");
+		}
+		if (stats_fp == NULL) {
+			printf("Error: Can't create stats file %s\n", stats_json);
+			exit(1);
+		}
 	}
-	return 0;
+
+	/* batch mode: no banner, menu or prompts */
+	if (!batch_run && script == NULL && simpoint == NULL) {
+		printf("\n**************************\n");
+		printf("Welcome to MU-MIPS SIM...\n");
+		printf("**************************\n\n");
+	}
+
+	if (num_cores > 1) {
+		sys = system_create(argv[optind], num_cores, quantum);
+		sim = sys->CORES[0];
+		printf("%d cores sharing memory, synchronized every %u cycles.\n\n", sys->NUM_CORES, sys->QUANTUM);
+	} else {
+		sim = sim_create(argv[optind]);
+	}
+	for (i = 0; i < num_cores; i++) {
+		core = sys != NULL ? sys->CORES[i] : sim;
+		core->FORWARDING = forwarding;
+		core->CYCLE_LIMIT = cycle_limit;
+		core->INSTRUCTION_LIMIT = instruction_limit;
+		perf_enable(core, perf_file != NULL);
+		if (!issue_width_set(core, issue_width) ||
+			(icache != NULL && !cache_configure(&core->ICACHE, icache)) ||
+			(dcache != NULL && !cache_configure(&core->DCACHE, dcache)) ||
+			(bpred != NULL && !bpred_configure(&core->BPRED, bpred))) {
+			exit(1);
+		}
+	}
+	load_program(sim);
+	start = host_seconds();
+	if (ff_count > 0 || use_ff_pc) {
+		fast_forward(sim, ff_count > 0 ? ff_count : UINT64_MAX, use_ff_pc, ff_pc);
+	}
+	for (i = 0; check && i < num_cores; i++) {
+		check_enable(sys != NULL ? sys->CORES[i] : sim, TRUE);
+	}
+	if (trace != NULL && !trace_start_all(sim, trace, trace_ring)) {
+		exit(1);
+	}
+	if (pipeview != NULL && !pipeview_start_all(sim, pipeview, pipeview_format_of(pipeview))) {
+		exit(1);
+	}
+	for (i = 0; profile && i < num_cores; i++) {
+		if (!profile_enable(sys != NULL ? sys->CORES[i] : sim, TRUE)) {
+			exit(1);
+		}
+	}
+
+	if (batch_run || script != NULL || simpoint != NULL) {
+		if (script != NULL) {
+			script_fp = fopen(script, "r");
+			if (script_fp == NULL) {
+				printf("Error: Can't open script %s\n", script);
+				exit(1);
+			}
+			while (handle_command(sys != NULL ? sys->CORES[sys->CURRENT_CORE] : sim, script_fp, FALSE));
+			fclose(script_fp);
+		}
+		if (simpoint != NULL) {
+			if (!simpoint_run(sim, simpoint)) {
+				exit_code = 1;
+			}
+		} else if (batch_run) {
+			if (sys != NULL) {
+				system_run(sys, max_cycles > 0 ? (int64_t)max_cycles : -1);
+			} else if (max_cycles > 0) {
+				run(sim, max_cycles);
+			} else {
+				runAll(sim);
+			}
+		}
+
+		for (i = 0; profile && i < num_cores; i++) {
+			profile_report(sys != NULL ? sys->CORES[i] : sim, PROFILE_DEFAULT_BLOCKS);
+		}
+
+		/* exited only once every core has; a core that failed decides the status */
+		running = sim->RUN_FLAG;
+		stop = sim->STOP_REASON;
+		for (i = 0; sys != NULL && i < sys->NUM_CORES; i++) {
+			running |= sys->CORES[i]->RUN_FLAG;
+			if (sys->CORES[i]->STOP_REASON > stop) {
+				stop = sys->CORES[i]->STOP_REASON;
+			}
+		}
+		status = stop == STOP_DIVERGED ? "diverged" : stop == STOP_BAD_FETCH ? "bad_fetch" : stop == STOP_WATCHDOG ? "watchdog" :
+			simpoint != NULL ? "sampled" : !running ? "exited" : (batch_run && max_cycles > 0) ? "max_cycles" : "running";
+		if (stats_fp != NULL) {
+			write_stats_json(sim, stats_fp, status, host_seconds() - start);
+			if (fclose(stats_fp) != 0) {
+				printf("Error: Can't write stats file %s\n", stats_json);
+				exit_code = 1;
+			}
+		}
+		if (exit_code == 0) {
+			exit_code = stop == STOP_DIVERGED ? 4 : stop == STOP_BAD_FETCH ? 6 : stop == STOP_WATCHDOG ? 5 : running && simpoint == NULL ? 3 : 0;
+		}
+	} else {
+		help();
+		while (handle_command(sys != NULL ? sys->CORES[sys->CURRENT_CORE] : sim, stdin, TRUE));
+	}
+
+	if (perf_file != NULL && !perf_dump(sim, perf_file) && exit_code == 0) {
+		exit_code = 1;
+	}
+
+	if (sys != NULL) {
+		system_destroy(sys);
+	} else {
+		sim_destroy(sim);
+	}
+	return exit_code;
 }
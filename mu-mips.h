@@ -1,4 +1,6 @@
+#include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #define FALSE 0
 #define TRUE  1
@@ -24,19 +26,43 @@
 
 typedef struct {
 	uint32_t begin, end;
-	uint8_t *mem;
 } mem_region_t;
 
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-	{ MEM_TEXT_BEGIN, MEM_TEXT_END, NULL },
-	{ MEM_DATA_BEGIN, MEM_DATA_END, NULL },
-	{ MEM_KDATA_BEGIN, MEM_KDATA_END, NULL },
-	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END, NULL }
+/* regions only bound the legal address space, backing pages are allocated on first write */
+static const mem_region_t MEM_REGIONS[] = {
+	{ MEM_TEXT_BEGIN, MEM_TEXT_END },
+	{ MEM_DATA_BEGIN, MEM_DATA_END },
+	{ MEM_KDATA_BEGIN, MEM_KDATA_END },
+	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END }
 };
 
 #define NUM_MEM_REGION 4
 #define MIPS_REGS 32
+#define PIPELINE_DEPTH 5
+#define MAX_ISSUE_WIDTH 4	/* instructions per pipeline register */
+
+/******************************************************************************/
+/* Sparse guest memory: two-level page table of 4 KiB pages                                                         */
+/******************************************************************************/
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE  (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK  (MEM_PAGE_SIZE - 1)
+#define MEM_DIR_SHIFT  22
+#define MEM_DIR_ENTRIES   (1 << (32 - MEM_DIR_SHIFT))
+#define MEM_TABLE_ENTRIES (1 << (MEM_DIR_SHIFT - MEM_PAGE_SHIFT))
+
+/******************************************************************************/
+/* Software TLB: direct-mapped guest page -> host page cache in front of the page table                  */
+/******************************************************************************/
+#define MEM_TLB_ENTRIES 256
+#define MEM_TLB_INVALID 0xFFFFFFFF /* never a valid page number */
+
+typedef struct {
+	uint32_t tag;	/* guest page number */
+	uint32_t wtag;	/* same page number once it is marked dirty, stores hit only on this */
+	uint8_t *page;	/* host pointer to the backing page */
+	int code;		/* page has predecoded instructions that stores must invalidate */
+} mem_tlb_entry_t;
 
 typedef struct CPU_State_Struct {
   uint32_t PC;		                   /* program counter */
@@ -44,60 +70,606 @@ typedef struct CPU_State_Struct {
   uint32_t HI, LO;                     /* special regs for mult/div. */
 } CPU_State;
 
+/******************************************************************************/
+/* Predecoded instructions                                                                                                 */
+/******************************************************************************/
+typedef enum {
+	OP_NOP = 0,	/* all-zero word, also what an empty pipeline register holds */
+	OP_INVALID,
+	/* R-format */
+	OP_SLL, OP_SRL, OP_SRA, OP_JR, OP_JALR, OP_SYSCALL,
+	OP_MFHI, OP_MTHI, OP_MFLO, OP_MTLO, OP_MULT, OP_MULTU, OP_DIV, OP_DIVU,
+	OP_ADD, OP_ADDU, OP_SUB, OP_SUBU, OP_AND, OP_OR, OP_XOR, OP_NOR, OP_SLT,
+	/* J-format */
+	OP_J, OP_JAL,
+	/* I-format */
+	OP_BLTZ, OP_BGEZ, OP_BEQ, OP_BNE, OP_BLEZ, OP_BGTZ,
+	OP_ADDI, OP_ADDIU, OP_SLTI, OP_ANDI, OP_ORI, OP_XORI, OP_LUI,
+	OP_LB, OP_LH, OP_LW, OP_SB, OP_SH, OP_SW,
+	OP_LL, OP_SC,
+	NUM_OPS
+} mips_op_t;
+
+typedef enum {
+	CLASS_NONE = 0,
+	CLASS_ALU,		/* result in ALUOutput, written back to dest */
+	CLASS_LOAD,
+	CLASS_STORE,
+	CLASS_BRANCH,
+	CLASS_JUMP,
+	CLASS_HILO,		/* mult/div/mfhi/mthi/mflo/mtlo */
+	CLASS_SYSCALL
+} mips_class_t;
+
+typedef struct Decoded_Instr_Struct {
+	uint32_t word;		/* raw instruction */
+	uint8_t op;			/* handler id (mips_op_t) */
+	uint8_t class;		/* opcode class (mips_class_t) */
+	uint8_t rs, rt, rd, shamt;
+	uint8_t dest;		/* register written in WB, 0 if none */
+	uint8_t reads;		/* READS_RS | READS_RT: source registers the hazard unit checks */
+	uint32_t imm;		/* immediate, sign- or zero-extended as the opcode requires */
+	uint32_t target;	/* 26-bit jump target field */
+} Decoded_Instr;
+
+#define DECODE_PAGE_WORDS (MEM_PAGE_SIZE / 4)
+
+#define READS_RS 0x1
+#define READS_RT 0x2
+
+/******************************************************************************/
+/* ELF32 executables (only the fields the loader reads)                                                     */
+/******************************************************************************/
+#define ELF_MAGIC        "\x7f" "ELF"
+#define ELF_EI_CLASS     4
+#define ELF_EI_DATA      5
+#define ELF_CLASS_32     1
+#define ELF_DATA_LSB     1
+#define ELF_DATA_MSB     2
+#define ELF_TYPE_EXEC    2
+#define ELF_MACHINE_MIPS 8
+#define ELF_EHDR_SIZE    52
+#define ELF_PHDR_SIZE    32
+#define ELF_PT_LOAD      1
+#define ELF_PF_X         1
+
+/******************************************************************************/
+/* Checkpoint file: magic, version, cores, pages until the end marker             */
+/******************************************************************************/
+#define CHECKPOINT_MAGIC   "MUMIPSCK"
+#define CHECKPOINT_VERSION 11
+#define CHECKPOINT_END     0xFFFFFFFF /* never a page address */
+
+/******************************************************************************/
+/* L1 cache models. Timing only: the data always lives in guest memory, a   */
+/* cache only decides how many cycles an access stalls its stage.             */
+/******************************************************************************/
+typedef enum {
+	REPL_LRU = 0,
+	REPL_RANDOM,
+	REPL_PLRU		/* tree pseudo-LRU */
+} cache_repl_t;
+
+typedef struct {
+	uint32_t tag;		/* address >> LINE_SHIFT */
+	uint8_t valid, dirty;
+	uint64_t stamp;		/* last use, for LRU */
+} cache_line_t;
+
+typedef struct {
+	int ENABLED;
+	uint32_t SIZE, ASSOC, LINE_SIZE;	/* bytes, ways, bytes; all powers of two */
+	uint32_t MISS_PENALTY;				/* cycles to fill a line, again to write back a dirty victim */
+	uint8_t REPLACEMENT;				/* cache_repl_t */
+	uint8_t WRITE_BACK;					/* else write-through, with a write buffer that never stalls */
+	uint8_t WRITE_ALLOCATE;				/* store misses fill the line */
+	uint32_t SETS, LINE_SHIFT;
+	cache_line_t *LINES;				/* SETS * ASSOC */
+	uint64_t *PLRU;						/* tree bits per set, node i at bit i */
+	uint64_t CLOCK;						/* LRU stamps */
+	uint32_t RANDOM;					/* xorshift state, fixed seed so runs repeat */
+
+	uint64_t READS, WRITES;
+	uint64_t READ_MISSES, WRITE_MISSES;
+	uint64_t EVICTIONS;					/* valid lines replaced */
+	uint64_t MEMORY_WRITES;				/* dirty write-backs, or every store when write-through */
+} cache_t;
+
+#define CACHE_DEFAULT_SPEC "size=8k,assoc=2,line=32,repl=lru,write=wb,alloc=1,penalty=10"
+#define CACHE_MAX_ASSOC 64
+
+/******************************************************************************/
+/* Branch prediction                                                                                                             */
+/******************************************************************************/
+/* IF predicts from the predecoded instruction: direction from the predictor, target
+ * from the BTB (or from the instruction itself when there is no BTB). ID redirects a
+ * predicted-taken direct branch the BTB missed (1 cycle); EX resolves every branch
+ * and jump and redirects a misprediction (2 cycles). */
+typedef enum {
+	BPRED_NOT_TAKEN = 0,	/* static not-taken */
+	BPRED_BTFN,				/* static backward taken, forward not taken */
+	BPRED_BIMODAL,			/* 2-bit counters indexed by PC */
+	BPRED_GSHARE			/* 2-bit counters indexed by PC xor global history */
+} bpred_type_t;
+
+typedef struct {
+	uint32_t pc;		/* full branch address, tag */
+	uint32_t target;
+	uint8_t valid;
+} btb_entry_t;
+
+typedef struct {
+	uint8_t TYPE;				/* bpred_type_t */
+	uint32_t SIZE;				/* 2-bit counters, power of two */
+	uint32_t HISTORY_BITS;		/* gshare */
+	uint32_t BTB_ENTRIES;		/* direct-mapped, power of two; 0 = targets come from the instruction */
+	uint8_t *COUNTERS;
+	uint32_t HISTORY;			/* speculative: shifted at fetch, repaired on a redirect */
+	btb_entry_t *BTB;
+
+	uint64_t BRANCHES, TAKEN;		/* conditional branches resolved */
+	uint64_t DIRECTION_MISSES;		/* conditional branches whose direction was mispredicted */
+	uint64_t JUMPS;
+	uint64_t MISPREDICTS;			/* EX redirects, direction or target */
+	uint64_t ID_REDIRECTS;			/* predicted taken without a target at fetch */
+	uint64_t BTB_LOOKUPS, BTB_HITS;
+	uint64_t PENALTY_CYCLES;		/* fetch slots lost to redirects */
+} bpred_t;
+
+#define BPRED_DEFAULT_SPEC "type=nottaken,size=1024,history=10,btb=0"
+
+/******************************************************************************/
+/* SimPoint-style sampling: basic-block vectors per fixed-size interval from a  */
+/* functional pass, k-means on their random projections, then a few detailed  */
+/* intervals per cluster, weighted by the cluster's share of the program           */
+/******************************************************************************/
+typedef struct {
+	uint64_t INTERVAL;		/* instructions per interval */
+	uint32_t MAX_K;			/* clusters tried: 1..MAX_K, chosen by BIC */
+	uint64_t WARMUP;		/* detailed instructions before each measured interval */
+	uint32_t SAMPLES;		/* intervals simulated per cluster; 2 or more give an error estimate */
+	uint64_t SEED;
+	uint32_t VERIFY;		/* also simulate the whole program in detail and compare */
+} simpoint_config_t;
+
+#define SIMPOINT_DEFAULT_SPEC "interval=1000000,maxk=10,warmup=10000,samples=2,seed=1,verify=0"
+#define SIMPOINT_DIMS 15				/* projected BBV dimensions, as SimPoint uses */
+#define SIMPOINT_KMEANS_RUNS 5			/* seeds tried for each k */
+#define SIMPOINT_KMEANS_ITERATIONS 100
+#define SIMPOINT_BIC_THRESHOLD 0.9		/* smallest k within this fraction of the best BIC */
+
+#define MAX_CORES 16
+#define DEFAULT_QUANTUM 1000	/* cycles each core runs between synchronizations */
+
+/******************************************************************************/
+/* Guest memory: the sparse pages plus their predecoded copies. Shared by every */
+/* core of a multi-core system, so page-table growth and LL/SC are locked.        */
+/******************************************************************************/
+typedef struct MIPS_Memory_Struct {
+	uint8_t **PAGE_DIR[MEM_DIR_ENTRIES];			/* NULL until a page in that 4 MiB slice is touched */
+	uint32_t PAGES_ALLOCATED;
+	Decoded_Instr **DECODE_DIR[MEM_DIR_ENTRIES];	/* predecoded pages, same layout as PAGE_DIR */
+	pthread_mutex_t ALLOC_LOCK;		/* publishes new page tables, pages and decoded pages */
+	uint32_t CODE_GENERATION;		/* bumped whenever predecoded code changes */
+
+	/* LL/SC: one link per core, broken by any store to the linked word */
+	pthread_mutex_t LINK_LOCK;
+	int RESERVATIONS;				/* live links; stores skip the link check while zero */
+	uint8_t LL_VALID[MAX_CORES];
+	uint32_t LL_ADDR[MAX_CORES];
+	uint32_t LL_VALUE[MAX_CORES];	/* word seen by ll, sc also fails if it changed */
+
+	/* Fast reset: pages written since the program was loaded, and the loaded image */
+	uint8_t *DIRTY_DIR[MEM_DIR_ENTRIES];	/* per-page dirty flags, same layout as PAGE_DIR */
+	uint32_t *DIRTY_PAGES;					/* addresses of the dirty pages */
+	uint32_t NUM_DIRTY, DIRTY_CAPACITY;
+	uint32_t *PRISTINE_PAGES;				/* page addresses of the loaded image, ascending */
+	uint8_t *PRISTINE_DATA;					/* their contents right after load_program */
+	uint32_t NUM_PRISTINE;
+	uint32_t ENTRY_PC;						/* where the loaded program starts */
+} MIPS_Memory;
+
+/******************************************************************************/
+/* Binary translator for fast-forward: hot basic blocks -> x86-64 host code                          */
+/******************************************************************************/
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#endif
+
+#define JIT_CODE_SIZE      (16 << 20)	/* bytes of host code cache */
+#define JIT_TABLE_SIZE     (1 << 16)	/* block lookup table, power of two */
+#define JIT_MAX_EXITS      (1 << 16)	/* chainable block exits */
+#define JIT_MAX_BLOCK      64			/* guest instructions per block */
+#define JIT_MAX_BLOCK_CODE 4096			/* worst-case host bytes per block */
+#define JIT_HOT_THRESHOLD  16			/* interpreted executions before translating */
+#define JIT_NO_STOP_PC     0xFFFFFFFF
+
+typedef struct {
+	uint32_t pc;		/* guest block start, 0 if the slot is empty */
+	int32_t count;		/* times interpreted, -1 if it cannot be translated */
+	uint8_t *code;		/* host entry point once translated */
+} jit_entry_t;
+
+typedef struct {
+	uint32_t target;	/* guest PC this exit continues at */
+	uint8_t *patch;		/* rel32 of the exit jump, retargeted when the target is translated */
+} jit_exit_t;
+
+/* shared with translated code through r12 - keep the layout in sync with jit_emit_* */
+typedef struct {
+	int64_t budget;		/* guest instructions still allowed */
+	uint32_t stop_pc;	/* blocks starting here bail to the dispatcher */
+	uint8_t flushed;	/* a store invalidated the code cache */
+} jit_ctx_t;
+
+typedef struct {
+	int ENABLED;
+	uint8_t *CODE;				/* mmap'd code cache, NULL if unavailable */
+	uint32_t CODE_USED;
+	uint8_t *EMIT;				/* emitter write position */
+	uint8_t *EPILOGUE;			/* return path from translated code to C */
+	jit_entry_t TABLE[JIT_TABLE_SIZE];
+	uint32_t BLOCKS;
+	jit_exit_t EXITS[JIT_MAX_EXITS];
+	uint32_t NUM_EXITS;
+	jit_ctx_t CTX;
+	uint64_t TRANSLATED_INSTRUCTIONS;	/* guest instructions executed in host code */
+} jit_state_t;
+
 typedef struct CPU_Pipeline_Reg_Struct{
 	uint32_t PC;
 	uint32_t IR;
+	Decoded_Instr D;	/* predecoded form of IR */
 	uint32_t A;
 	uint32_t B;
 	uint32_t imm;
 	uint32_t ALUOutput;
 	uint32_t LMD;
+	uint8_t VALID;	/* holds an instruction, clear for a bubble */
+	uint8_t PRED_TAKEN;	/* branch predicted taken at fetch */
+	uint32_t PRED_PC;	/* where fetch went after this instruction */
+	uint32_t PRED_HISTORY;	/* global branch history it was predicted with */
+	uint64_t SEQ;		/* fetch order, follows the instruction through the latches */
 	
 } CPU_Pipeline_Reg;
 
+/******************************************************************************/
+/* Performance counters. Stalls and bubbles are always counted; the rest only  */
+/* while ENABLED, so a run without them pays one predictable branch per event. */
+/******************************************************************************/
+typedef enum {
+	STALL_LOAD_USE = 0,	/* operand loaded by the instruction just ahead */
+	STALL_NO_FORWARD,	/* forwarding off, operand not written back yet */
+	STALL_ICACHE,		/* fetch waiting on an I-cache miss */
+	STALL_DCACHE,		/* load/store waiting on a D-cache miss */
+	NUM_STALL_CAUSES
+} perf_stall_t;
+
+/* Why ID left issue slots empty in a cycle: the first reason it stopped */
+typedef enum {
+	ISSUE_EMPTY = 0,		/* IF/ID ran out: fetch miss, redirect or taken branch */
+	ISSUE_OPERAND,			/* an operand wasn't ready (load-use, or forwarding off) */
+	ISSUE_MEMORY,			/* a second load/store: one memory op per cycle */
+	ISSUE_DEPENDENCY,		/* reads a result of an older instruction in the same bundle */
+	ISSUE_CONTROL,			/* behind a branch, jump or syscall, which ends a bundle */
+	ISSUE_HELD,				/* ID held by a D-cache miss, or squashed */
+	NUM_ISSUE_LIMITS
+} perf_issue_t;
+
+typedef struct {
+	int ENABLED;
+	uint64_t CYCLES;						/* since enabled or cleared */
+	uint64_t RETIRED;
+	uint64_t RETIRED_OP[NUM_OPS];			/* retirements per opcode/funct */
+	uint64_t STALLS[NUM_STALL_CAUSES];
+	uint64_t OCCUPANCY[PIPELINE_DEPTH];		/* instructions each stage held, summed over cycles */
+	uint64_t ISSUED[MAX_ISSUE_WIDTH + 1];	/* cycles ID issued 0..width instructions */
+	uint64_t EMPTY_SLOTS[NUM_ISSUE_LIMITS];	/* issue slots left empty, by perf_issue_t */
+} perf_counters_t;
+
+#define PERF_ON(sim) __builtin_expect((sim)->PERF.ENABLED, 0)
+
+enum { STAGE_IF = 0, STAGE_ID, STAGE_EX, STAGE_MEM, STAGE_WB };
+
+/******************************************************************************/
+/* Lockstep checking: a functional reference retires each instruction with WB */
+/******************************************************************************/
+typedef struct {
+	int ENABLED;
+	int DIVERGED;		/* stopped the run at a mismatch */
+	CPU_State STATE;	/* reference architectural state; PC is the next instruction to retire */
+	uint64_t CHECKED;	/* retirements compared */
+} check_t;
+
+#define CHECK_ON(sim) __builtin_expect((sim)->CHECK.ENABLED, 0)
+
+/******************************************************************************/
+/* Pipeline trace: one fixed-size record per cycle, streamed to a file or    */
+/* kept in a ring of the last N cycles. Records are in host byte order.        */
+/******************************************************************************/
+#define TRACE_MAGIC   "MUMIPSTR"
+#define TRACE_VERSION 2
+#define TRACE_BUFFER  4096		/* records buffered before a streamed write */
+
+/* per-cycle flags */
+#define TRACE_STALL_HAZARD 0x01	/* ID held IF/ID for an operand */
+#define TRACE_STALL_MEM    0x02	/* MEM waited on the D-cache, EX/ID/IF held */
+#define TRACE_STALL_FETCH  0x04	/* IF waited on the I-cache */
+#define TRACE_FLUSH        0x08	/* EX squashed the wrong path (mispredict or exit) */
+#define TRACE_REDIRECT     0x10	/* fetch was redirected, by EX or ID */
+#define TRACE_NO_FETCH     0x20	/* fetch off: draining or exiting */
+
+enum { LATCH_IF_ID = 0, LATCH_ID_EX, LATCH_EX_MEM, LATCH_MEM_WB, NUM_LATCHES };
+
+typedef struct {
+	char magic[8];			/* TRACE_MAGIC */
+	uint32_t version;
+	uint32_t record_size;	/* sizeof(trace_record_t) */
+	uint32_t core;
+	uint32_t ring;			/* ring capacity in cycles, 0 if streamed */
+} trace_header_t;
+
+typedef struct {
+	uint64_t cycle;				/* CYCLE_COUNT once this cycle completes */
+	uint64_t retired;			/* INSTRUCTION_COUNT at the same point */
+	uint32_t fetch_pc;			/* PC IF fetches from next cycle */
+	uint32_t pc[NUM_LATCHES];	/* instruction address held by each latch at the end of the cycle */
+	uint32_t ir[NUM_LATCHES];
+	uint8_t valid;				/* bit per latch, clear for a bubble */
+	uint8_t pred_taken;			/* bit per latch */
+	uint8_t flags;				/* TRACE_* */
+	uint8_t pad;
+} trace_record_t;
+
+typedef struct {
+	int ENABLED;
+	FILE* FP;
+	char PATH[256];
+	trace_record_t *RECORDS;	/* write buffer, or the ring */
+	uint32_t CAPACITY;
+	uint32_t HEAD;				/* next free record */
+	int RING;					/* keep only the last CAPACITY cycles, written when tracing stops */
+	int WRAPPED;				/* the ring has been filled at least once */
+	uint64_t RECORDED;
+	uint64_t LAST_MISPREDICTS, LAST_REDIRECTS;	/* to see this cycle's redirects in the bpred counters */
+	int LAST_EXITING;
+} trace_t;
+
+#define TRACE_ON(sim) __builtin_expect((sim)->TRACE.ENABLED, 0)
+
+/******************************************************************************/
+/* Pipeline view: each instruction's stages over time, for Konata or as Chrome */
+/* trace events (chrome://tracing, Perfetto). One cycle is one microsecond there. */
+/******************************************************************************/
+typedef enum {
+	PIPEVIEW_KONATA = 0,
+	PIPEVIEW_CHROME
+} pipeview_format_t;
+
+#define PIPEVIEW_SLOTS (PIPELINE_DEPTH * MAX_ISSUE_WIDTH)	/* instructions tracked at once; also the Chrome lanes */
+
+typedef struct {
+	uint64_t seq;		/* 0: free slot */
+	uint64_t id;		/* Konata instruction id */
+	uint32_t pc;
+	uint8_t op;
+	uint8_t latch;		/* latch it sat in after the last cycle */
+	uint8_t stage;		/* STAGE_* shown since start */
+	uint8_t stalled;
+	uint64_t start;
+} pipeview_entry_t;
+
+typedef struct {
+	int ENABLED;
+	FILE* FP;
+	char PATH[256];
+	uint8_t FORMAT;				/* pipeview_format_t */
+	uint64_t NOW;				/* cycles since tracing started, plus the cycle it started at */
+	uint64_t CURSOR;			/* Konata: cycle of the last C command */
+	uint64_t NEXT_ID, RETIRED;
+	uint64_t EVENTS;			/* Chrome: events written, for the separators */
+	pipeview_entry_t SLOTS[PIPEVIEW_SLOTS];
+} pipeview_t;
+
+#define PIPEVIEW_ON(sim) __builtin_expect((sim)->PIPEVIEW.ENABLED, 0)
+
+/******************************************************************************/
+/* Per-PC profile: exact counts for every word of the loaded text, summed into */
+/* basic blocks for the hot-spot report                                                                */
+/******************************************************************************/
+typedef struct {
+	uint64_t retired;
+	uint64_t stalls[NUM_STALL_CAUSES];	/* cycles this instruction held its stage (fetch: waited for it) */
+	uint64_t penalty;					/* fetch slots lost to this branch's redirects */
+} profile_entry_t;
+
+typedef struct {
+	int ENABLED;
+	profile_entry_t *PCS;		/* indexed by (PC - MEM_TEXT_BEGIN) / 4 */
+	uint32_t SIZE;				/* words, PROGRAM_SIZE when enabled */
+	profile_entry_t OUTSIDE;	/* PCs past the loaded text */
+	uint64_t LAST_MISPREDICTS, LAST_ID_REDIRECTS;
+} profile_t;
+
+#define PROFILE_ON(sim) __builtin_expect((sim)->PROFILE.ENABLED, 0)
+#define PROFILE_DEFAULT_BLOCKS 10	/* blocks in the hot-spot report */
+
+/* Why a core stopped (RUN_FLAG cleared) */
+typedef enum {
+	STOP_NONE = 0,
+	STOP_EXIT,			/* exit syscall retired */
+	STOP_WATCHDOG,		/* cycle or instruction limit reached */
+	STOP_BAD_FETCH,		/* retired an instruction from outside the loaded program */
+	STOP_DIVERGED		/* lockstep check failed */
+} stop_reason_t;
+
 /***************************************************************/
-/* CPU State info.                                                                                                               */
+/* Simulator instance: everything one simulation owns, so several can run  */
+/* side by side (on separate threads) in one process.                                */
 /***************************************************************/
+typedef struct MIPS_Sim_Struct {
+	/* CPU State info. */
+	CPU_State CURRENT_STATE, NEXT_STATE;
+	int RUN_FLAG;	/* run flag*/
+	int STOP_REASON;	/* stop_reason_t, once RUN_FLAG is clear */
+	uint64_t INSTRUCTION_COUNT;
+	uint64_t CYCLE_COUNT;
+	uint32_t PROGRAM_SIZE; /*in words*/
+	uint64_t FF_INSTRUCTION_COUNT; /* instructions retired by the functional model */
+	int FETCH_ENABLED; /* cleared while the pipeline drains */
+	int EXITING;		/* EX saw the exit syscall: fetch stops, older instructions drain */
+	uint64_t CYCLE_LIMIT;		/* watchdog, 0 = none: stop once CYCLE_COUNT reaches it */
+	uint64_t INSTRUCTION_LIMIT;	/* same for pipeline plus fast-forwarded instructions */
+
+	/* Pipeline Registers: a slot per instruction issued together, oldest first. */
+	/* Valid slots always come first; the rest are bubbles.                     */
+	CPU_Pipeline_Reg IF_ID[MAX_ISSUE_WIDTH];
+	CPU_Pipeline_Reg ID_EX[MAX_ISSUE_WIDTH];
+	CPU_Pipeline_Reg EX_MEM[MAX_ISSUE_WIDTH];
+	CPU_Pipeline_Reg MEM_WB[MAX_ISSUE_WIDTH];
+	uint32_t ISSUE_WIDTH;	/* slots in use: 1 (scalar), 2 or 4 */
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_FLAG;	/* run flag*/
-uint32_t INSTRUCTION_COUNT;
-uint32_t CYCLE_COUNT;
-uint32_t PROGRAM_SIZE; /*in words*/
+	/* Hazard unit */
+	int FORWARDING;			/* forward EX/MEM and MEM/WB results, otherwise stall until WB */
+	int HAZARD_STALL;		/* set by ID this cycle: IF holds IF/ID and the PC */
+	int MEM_STALL;			/* set by MEM this cycle: EX, ID and IF hold */
+	uint64_t STALL_COUNT;	/* cycles a stage was held, for an operand or a cache miss */
+	uint64_t BUBBLE_COUNT;	/* bubbles inserted into the pipeline */
+	uint64_t FORWARD_COUNT;	/* operands taken from EX/MEM or MEM/WB instead of the register file */
+	perf_counters_t PERF;
+	check_t CHECK;
+	trace_t TRACE;
+	pipeview_t PIPEVIEW;
+	profile_t PROFILE;
+	uint64_t FETCH_SEQ;		/* SEQ of the next instruction fetched */
 
+	/* L1 caches, private to the core */
+	cache_t ICACHE, DCACHE;
+	uint32_t FETCH_WAIT;	/* I-cache miss: cycles until the line arrives */
+	int FETCH_FILLED;		/* the line at PC has arrived, fetch without probing again */
+	uint32_t MEM_WAIT;		/* same for the access waiting in EX/MEM */
+	int MEM_FILLED;
+
+	/* Branch prediction; EX and ID redirect fetch through these */
+	bpred_t BPRED;
+	int BRANCH_SQUASH;		/* set by EX this cycle: IF/ID is on the wrong path */
+	int BRANCH_REDIRECT;	/* set by EX or ID this cycle: IF fetches nothing, the PC becomes REDIRECT_PC */
+	uint32_t REDIRECT_PC;
+
+	char prog_file[256];
+
+	MIPS_Memory *MEMORY;
+	mem_tlb_entry_t MEM_TLB[MEM_TLB_ENTRIES];
+	jit_state_t JIT;
+
+	/* Multi-core: which core this is, and the system it belongs to (NULL when alone) */
+	int CORE_ID;
+	struct MIPS_System_Struct *SYSTEM;
+	uint32_t CODE_GENERATION;	/* MEMORY->CODE_GENERATION when TLB/JIT were last synced */
+} MIPS_Sim;
 
 /***************************************************************/
-/* Pipeline Registers.                                                                                                        */
+/* Shared-memory multiprocessor: one MIPS_Sim per core over a single memory,  */
+/* each core stepped on its own host thread. Cores run QUANTUM cycles and      */
+/* then meet at a barrier (QUANTUM = 1 is cycle lockstep).                             */
 /***************************************************************/
-CPU_Pipeline_Reg IF_ID;
-CPU_Pipeline_Reg ID_EX;
-CPU_Pipeline_Reg EX_MEM;
-CPU_Pipeline_Reg MEM_WB;
-
-char prog_file[32];
+typedef struct MIPS_System_Struct {
+	int NUM_CORES;
+	MIPS_Sim *CORES[MAX_CORES];
+	MIPS_Memory *MEMORY;		/* owned by core 0 */
+	uint32_t QUANTUM;
+	int CURRENT_CORE;			/* core the interactive commands act on */
 
+	pthread_barrier_t BARRIER;
+	int64_t CYCLES_LEFT;		/* of the current run, -1 to run until every core stops */
+	uint32_t SLICE;				/* cycles in the current quantum */
+	int STOP;
+} MIPS_System;
 
 /***************************************************************/
 /* Function Declerations.                                                                                                */
 /***************************************************************/
 void help();
-uint32_t mem_read_32(uint32_t address);
-void mem_write_32(uint32_t address, uint32_t value);
-void cycle();
-void run(int num_cycles);
-void runAll();
-void mdump(uint32_t start, uint32_t stop) ;
-void rdump();
-void handle_command();
-void reset();
-void init_memory();
-void load_program();
-void handle_pipeline();
-void WB();
-void MEM();
-void EX();
-void ID();
-void IF();
+uint32_t mem_read_32(MIPS_Sim* sim, uint32_t address);
+void mem_write_32(MIPS_Sim* sim, uint32_t address, uint32_t value);
+void cycle(MIPS_Sim* sim);
+void run(MIPS_Sim* sim, uint64_t num_cycles);
+void runAll(MIPS_Sim* sim);
+double host_seconds();
+void report_host_rate(uint64_t cycles, uint64_t instructions, double seconds);
+void mdump(MIPS_Sim* sim, uint32_t start, uint32_t stop) ;
+void rdump(MIPS_Sim* sim);
+void write_stats_json(MIPS_Sim* sim, FILE* fp, const char* status, double seconds);
+void perf_enable(MIPS_Sim* sim, int enabled);
+void perf_clear(MIPS_Sim* sim);
+void check_enable(MIPS_Sim* sim, int enabled);
+void check_retire(MIPS_Sim* sim, const CPU_Pipeline_Reg* wb);
+void sim_stop(MIPS_Sim* sim, stop_reason_t reason);
+void perf_sample(MIPS_Sim* sim);
+int trace_start(MIPS_Sim* sim, const char* path, uint32_t ring);
+void trace_stop(MIPS_Sim* sim);
+void trace_sample(MIPS_Sim* sim);
+void trace_command(MIPS_Sim* sim, FILE* in);
+int pipeview_start(MIPS_Sim* sim, const char* path, pipeview_format_t format);
+void pipeview_stop(MIPS_Sim* sim);
+void pipeview_sample(MIPS_Sim* sim);
+void pipeview_command(MIPS_Sim* sim, FILE* in);
+int profile_enable(MIPS_Sim* sim, int enabled);
+void profile_clear(MIPS_Sim* sim);
+void profile_sample(MIPS_Sim* sim);
+void profile_report(MIPS_Sim* sim, uint32_t max_blocks);
+void profile_command(MIPS_Sim* sim, FILE* in);
+void simpoint_command(MIPS_Sim* sim, FILE* in);
+void perf_report(MIPS_Sim* sim, FILE* fp);
+int perf_dump(MIPS_Sim* sim, const char* path);
+void stats_command(MIPS_Sim* sim, FILE* in);
+int handle_command(MIPS_Sim* sim, FILE* in, int prompt);
+void reset(MIPS_Sim* sim);
+void init_memory(MIPS_Sim* sim);
+void free_memory(MIPS_Sim* sim);
+int mem_region_valid(uint32_t address);
+uint8_t* mem_page_lookup(MIPS_Sim* sim, uint32_t address);
+uint8_t* mem_page_alloc(MIPS_Sim* sim, uint32_t address);
+void mem_tlb_flush(MIPS_Sim* sim);
+void mem_mark_dirty(MIPS_Sim* sim, uint32_t address);
+void mem_clear_dirty(MIPS_Sim* sim);
+void mem_snapshot_pristine(MIPS_Sim* sim);
+void mem_free_pristine(MIPS_Sim* sim);
+void mem_reset_dirty(MIPS_Sim* sim);
+uint32_t mem_read_32_slow(MIPS_Sim* sim, uint32_t address);
+void mem_write_32_slow(MIPS_Sim* sim, uint32_t address, uint32_t value);
+void load_program(MIPS_Sim* sim);
+int cache_configure(cache_t* cache, const char* spec);
+void cache_invalidate(cache_t* cache);
+void cache_release(cache_t* cache);
+uint32_t cache_access(cache_t* cache, uint32_t address, int write);
+void cache_report(const cache_t* cache, const char* name, FILE* fp);
+int bpred_configure(bpred_t* bp, const char* spec);
+void bpred_reset(bpred_t* bp);
+void bpred_release(bpred_t* bp);
+uint32_t bpred_predict(MIPS_Sim* sim, uint32_t pc, const Decoded_Instr* d, uint8_t* taken, uint32_t* history);
+void bpred_update(MIPS_Sim* sim, uint32_t pc, const Decoded_Instr* d, int taken, uint32_t target, uint32_t history);
+void bpred_report(const bpred_t* bp, FILE* fp);
+void branch_resolve(MIPS_Sim* sim, CPU_Pipeline_Reg* reg, int taken, uint32_t target);
+int checkpoint_save(MIPS_Sim* sim, const char* path);
+int checkpoint_restore(MIPS_Sim* sim, const char* path);
+void handle_pipeline(MIPS_Sim* sim);
+void pipeline_drain(MIPS_Sim* sim);
+int issue_width_set(MIPS_Sim* sim, uint32_t width);
+int functional_execute(MIPS_Sim* sim, CPU_State* state);
+int functional_step(MIPS_Sim* sim);
+void fast_forward(MIPS_Sim* sim, uint64_t max_instructions, int use_stop_pc, uint32_t stop_pc);
+int simpoint_configure(simpoint_config_t* cfg, const char* spec);
+int simpoint_run(MIPS_Sim* sim, const char* spec);
+uint64_t interpret_block(MIPS_Sim* sim, uint64_t max_instructions, int use_stop_pc, uint32_t stop_pc, int* exited);
+void jit_init(MIPS_Sim* sim);
+void jit_flush(MIPS_Sim* sim);
+void jit_release(MIPS_Sim* sim);
+jit_entry_t* jit_lookup(MIPS_Sim* sim, uint32_t pc, int insert);
+uint8_t* jit_translate(MIPS_Sim* sim, uint32_t pc);
+uint64_t jit_fast_forward(MIPS_Sim* sim, uint64_t max_instructions, int use_stop_pc, uint32_t stop_pc, int* exited);
+uint32_t mem_load(MIPS_Sim* sim, const Decoded_Instr* instr, uint32_t address);
+void mem_store(MIPS_Sim* sim, const Decoded_Instr* instr, uint32_t address, uint32_t value);
 void decode_all_operands(const uint32_t instruction,
 				uint32_t* opcode,
 				uint32_t* rs, 
@@ -107,38 +679,32 @@ void decode_all_operands(const uint32_t instruction,
 				uint32_t* funct, 
 				uint32_t* immediate,
 				uint32_t* address);
-void ID_decode_operands(const uint32_t instruction,
-				uint32_t* rs, // A
-				uint32_t* rt, // B
-				uint32_t* immediate);
-void EX_decode_operands(const uint32_t instruction,
-				uint32_t* opcode, 
-				uint32_t* shamt, 
-				uint32_t* funct,
-				uint32_t* addr);
-void MEM_decode_operands(const uint32_t instruction,
-				uint32_t* opcode, 
-				uint32_t* address);
-void WB_decode_operands(const uint32_t instruction,
-				uint32_t* rt,
-				uint32_t* rd,
-				uint32_t* opcode, 
-				uint32_t* funct);
 void decode_machine_register(uint32_t reg, char* buffer);
-void EX_perform_operation(uint32_t A, // rs
-				uint32_t B, // rt
-				uint32_t imm,
-				const uint32_t opcode,
-				uint32_t shamt,
-				const uint32_t funct,
-				uint32_t address); // later - for jump instr
-void MEM_access(const uint32_t opcode, uint32_t address);
-void WB_populate_destination(uint32_t rt,
-				uint32_t rd,
-				const uint32_t opcode,
-				const uint32_t funct);
-void show_pipeline();
-void initialize();
-void print_program();
-void print_instruction(uint32_t addr);
+void EX_perform_operation(MIPS_Sim* sim, CPU_Pipeline_Reg* ex_mem, const Decoded_Instr* instr, uint32_t A, uint32_t B, uint32_t imm);
+void MEM_access(MIPS_Sim* sim, CPU_Pipeline_Reg* mem_wb, const Decoded_Instr* instr, uint32_t address);
+void WB_populate_destination(MIPS_Sim* sim, const CPU_Pipeline_Reg* mem_wb, const Decoded_Instr* instr);
+void predecode_instruction(uint32_t instruction, Decoded_Instr* d);
+Decoded_Instr* predecode_page(MIPS_Sim* sim, uint32_t address);
+Decoded_Instr* decoded_page_lookup(MIPS_Sim* sim, uint32_t address);
+void redecode_word(MIPS_Sim* sim, uint32_t address);
+void free_decoded(MIPS_Sim* sim);
+const Decoded_Instr* fetch_decoded(MIPS_Sim* sim, uint32_t address);
+void show_pipeline(MIPS_Sim* sim);
+void initialize(MIPS_Sim* sim);
+MIPS_Sim* sim_create(const char* program);
+void sim_destroy(MIPS_Sim* sim);
+MIPS_Sim* sim_create_core(const char* program, MIPS_Memory* shared, int core_id);
+void reset_state(MIPS_Sim* sim);
+void sync_code(MIPS_Sim* sim);
+uint32_t mem_load_linked(MIPS_Sim* sim, uint32_t address);
+uint32_t mem_store_conditional(MIPS_Sim* sim, uint32_t address, uint32_t value);
+void mem_break_links(MIPS_Sim* sim, uint32_t address);
+void mem_clear_link(MIPS_Memory* mem, int core);
+MIPS_System* system_create(const char* program, int num_cores, uint32_t quantum);
+void system_destroy(MIPS_System* sys);
+void system_reset(MIPS_System* sys);
+void system_run(MIPS_System* sys, int64_t num_cycles);
+void system_report(MIPS_System* sys);
+void print_program(MIPS_Sim* sim);
+void print_instruction(MIPS_Sim* sim, uint32_t addr);
 